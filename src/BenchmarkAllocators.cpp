@@ -0,0 +1,153 @@
+
+// Author: Joel Sikström
+
+#include <cstdlib>
+#include <iostream>
+
+#include <malloc.h>
+#include <sys/mman.h>
+
+#include "BenchmarkAllocators.hpp"
+#include "JSMalloc.inline.hpp"
+
+std::unique_ptr<BenchmarkAllocator> BenchmarkAllocator::create(const std::string &name, size_t pool_size) {
+  std::unique_ptr<BenchmarkAllocator> allocator;
+
+  if(name == "jsmalloc") {
+    allocator.reset(new JSMallocBenchmarkAllocator(pool_size));
+  } else if(name == "jsmalloc-cache") {
+    allocator.reset(new JSMallocCacheBenchmarkAllocator(pool_size));
+  } else if(name == "jsmalloc-slab") {
+    allocator.reset(new JSMallocSlabBenchmarkAllocator(pool_size));
+  } else if(name == "jsmallocz") {
+    allocator.reset(new JSMallocZBenchmarkAllocator(pool_size));
+  } else if(name == "malloc") {
+    allocator.reset(new SystemBenchmarkAllocator());
+  } else {
+    return nullptr;
+  }
+
+  allocator->reset();
+  return allocator;
+}
+
+std::vector<std::string> BenchmarkAllocator::names() {
+  return {"jsmalloc", "jsmalloc-cache", "jsmalloc-slab", "jsmallocz", "malloc"};
+}
+
+PoolBenchmarkAllocator::PoolBenchmarkAllocator(size_t pool_size) {
+  _pool_size = pool_size;
+  _pool = static_cast<uint8_t *>(mmap(nullptr, pool_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+  if(_pool == MAP_FAILED) {
+    perror("mmap failed");
+    exit(1);
+  }
+
+  _high_water = (uintptr_t)_pool;
+}
+
+PoolBenchmarkAllocator::~PoolBenchmarkAllocator() {
+  munmap(_pool, _pool_size);
+}
+
+void PoolBenchmarkAllocator::reset() {
+  // Every run starts with untouched pages, so that page faults are part of
+  // every run alike.
+  madvise(_pool, _pool_size, MADV_DONTNEED);
+  _high_water = (uintptr_t)_pool;
+  initialize();
+}
+
+size_t PoolBenchmarkAllocator::footprint() {
+  return _high_water.load() - (uintptr_t)_pool;
+}
+
+void JSMallocBenchmarkAllocator::initialize() {
+  _allocator = JSMalloc::create(_pool, _pool_size);
+}
+
+void *JSMallocBenchmarkAllocator::allocate(size_t size) {
+  void *ptr = _allocator->allocate(size);
+  record(ptr, size);
+  return ptr;
+}
+
+void JSMallocBenchmarkAllocator::free(void *ptr, size_t) {
+  _allocator->free(ptr);
+}
+
+thread_local JSMallocThreadCache JSMallocCacheBenchmarkAllocator::_cache;
+
+void JSMallocCacheBenchmarkAllocator::reset() {
+  if(_allocator != nullptr) {
+    _cache.flush(_allocator);
+  }
+
+  JSMallocBenchmarkAllocator::reset();
+}
+
+void *JSMallocCacheBenchmarkAllocator::allocate(size_t size) {
+  void *ptr = _cache.allocate(_allocator, size);
+  record(ptr, size);
+  return ptr;
+}
+
+void JSMallocCacheBenchmarkAllocator::free(void *ptr, size_t) {
+  _cache.free(_allocator, ptr);
+}
+
+void JSMallocSlabBenchmarkAllocator::initialize() {
+  JSMallocBenchmarkAllocator::initialize();
+  _slabs = JSMallocSlabs::create(_allocator, SlabCutoff);
+}
+
+void *JSMallocSlabBenchmarkAllocator::allocate(size_t size) {
+  void *ptr = _slabs->allocate(size);
+  if(ptr == nullptr) {
+    ptr = _allocator->allocate(size);
+  }
+
+  record(ptr, size);
+  return ptr;
+}
+
+void JSMallocSlabBenchmarkAllocator::free(void *ptr, size_t) {
+  if(!_slabs->free(ptr)) {
+    _allocator->free(ptr);
+  }
+}
+
+void JSMallocZBenchmarkAllocator::initialize() {
+  _allocator = JSMallocZ::create(_pool, _pool_size, false);
+}
+
+void *JSMallocZBenchmarkAllocator::allocate(size_t size) {
+  void *ptr = _allocator->allocate(size);
+  record(ptr, size);
+  return ptr;
+}
+
+void JSMallocZBenchmarkAllocator::free(void *ptr, size_t size) {
+  _allocator->free(ptr, size);
+}
+
+void SystemBenchmarkAllocator::reset() {
+  malloc_trim(0);
+}
+
+void *SystemBenchmarkAllocator::allocate(size_t size) {
+  return malloc(size);
+}
+
+void SystemBenchmarkAllocator::free(void *ptr, size_t) {
+  ::free(ptr);
+}
+
+size_t SystemBenchmarkAllocator::footprint() {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+  struct mallinfo2 info = mallinfo2();
+  return info.arena + info.hblkhd;
+#else
+  return 0;
+#endif
+}
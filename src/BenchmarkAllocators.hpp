@@ -0,0 +1,142 @@
+
+// Author: Joel Sikström
+
+#ifndef BENCHMARK_ALLOCATORS_HPP
+#define BENCHMARK_ALLOCATORS_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "JSMalloc.hpp"
+#include "JSMallocSlab.hpp"
+#include "JSMallocThreadCache.hpp"
+
+// The interface that the benchmarks replay operations against. Every
+// allocator gets a pool of its own, and is reset between runs so that each run
+// starts from an empty heap.
+class BenchmarkAllocator {
+public:
+  virtual ~BenchmarkAllocator() {}
+
+  virtual const char *name() = 0;
+
+  // Frees everything and starts over from an empty heap.
+  virtual void reset() = 0;
+
+  virtual void *allocate(size_t size) = 0;
+  virtual void free(void *ptr, size_t size) = 0;
+
+  // Bytes of memory the allocator has used for its heap since the last reset.
+  // This is the highest address handed out in the pool for the pool-based
+  // allocators. For the system allocator it is read from mallinfo2, which
+  // counts the memory of malloc's arenas and mmapped chunks at the time of
+  // the call, so it is only approximate.
+  virtual size_t footprint() = 0;
+
+  // Returns nullptr if name is not a known allocator.
+  static std::unique_ptr<BenchmarkAllocator> create(const std::string &name, size_t pool_size);
+
+  static std::vector<std::string> names();
+};
+
+// Pool-based allocators, which all keep their heap in one mapping.
+class PoolBenchmarkAllocator : public BenchmarkAllocator {
+public:
+  PoolBenchmarkAllocator(size_t pool_size);
+  ~PoolBenchmarkAllocator();
+
+  void reset();
+  size_t footprint();
+
+protected:
+  uint8_t *_pool;
+  size_t _pool_size;
+  std::atomic<uintptr_t> _high_water;
+
+  // Places the allocator in the pool, which has been emptied.
+  virtual void initialize() = 0;
+
+  void record(void *ptr, size_t size) {
+    uintptr_t end = (uintptr_t)ptr + size;
+    uintptr_t high_water = _high_water.load(std::memory_order_relaxed);
+    while(ptr != nullptr && end > high_water && !_high_water.compare_exchange_weak(high_water, end, std::memory_order_relaxed)) {}
+  }
+};
+
+class JSMallocBenchmarkAllocator : public PoolBenchmarkAllocator {
+public:
+  JSMallocBenchmarkAllocator(size_t pool_size) : PoolBenchmarkAllocator(pool_size) {}
+
+  const char *name() { return "jsmalloc"; }
+  void *allocate(size_t size);
+  void free(void *ptr, size_t size);
+
+protected:
+  JSMalloc *_allocator = nullptr;
+
+  void initialize();
+};
+
+// JSMalloc with a thread cache in front of it. Every thread has a cache of
+// its own, which is flushed by reset on the calling thread only.
+class JSMallocCacheBenchmarkAllocator : public JSMallocBenchmarkAllocator {
+public:
+  JSMallocCacheBenchmarkAllocator(size_t pool_size) : JSMallocBenchmarkAllocator(pool_size) {}
+
+  const char *name() { return "jsmalloc-cache"; }
+  void reset();
+  void *allocate(size_t size);
+  void free(void *ptr, size_t size);
+
+private:
+  static thread_local JSMallocThreadCache _cache;
+};
+
+// JSMalloc with slabs for requests of at most SlabCutoff bytes, the same as
+// the malloc wrapper.
+class JSMallocSlabBenchmarkAllocator : public JSMallocBenchmarkAllocator {
+public:
+  static const size_t SlabCutoff = 48;
+
+  JSMallocSlabBenchmarkAllocator(size_t pool_size) : JSMallocBenchmarkAllocator(pool_size) {}
+
+  const char *name() { return "jsmalloc-slab"; }
+  void *allocate(size_t size);
+  void free(void *ptr, size_t size);
+
+private:
+  JSMallocSlabs *_slabs;
+
+  void initialize();
+};
+
+class JSMallocZBenchmarkAllocator : public PoolBenchmarkAllocator {
+public:
+  JSMallocZBenchmarkAllocator(size_t pool_size) : PoolBenchmarkAllocator(pool_size) {}
+
+  const char *name() { return "jsmallocz"; }
+  void *allocate(size_t size);
+  void free(void *ptr, size_t size);
+
+private:
+  JSMallocZ *_allocator;
+
+  void initialize();
+};
+
+// Whatever malloc the benchmark is linked or preloaded with, which makes it
+// possible to compare against other allocators with LD_PRELOAD.
+class SystemBenchmarkAllocator : public BenchmarkAllocator {
+public:
+  const char *name() { return "malloc"; }
+  void reset();
+  void *allocate(size_t size);
+  void free(void *ptr, size_t size);
+  size_t footprint();
+};
+
+#endif // BENCHMARK_ALLOCATORS_HPP
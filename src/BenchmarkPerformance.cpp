@@ -1,210 +1,326 @@
 
+// Author: Joel Sikström
+
+#include <algorithm>
 #include <chrono>
-#include <fstream>
-#include <sstream>
-#include <iostream>
+#include <cstdlib>
 #include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
 #include <vector>
-#include <map>
-
-#include <sys/mman.h>
-
-#include "JSMalloc.hpp"
-#include "JSMallocUtil.inline.hpp"
 
-#include "TLSF.hpp"
-#include "TLSFUtil.inline.hpp"
+#include "BenchmarkAllocators.hpp"
+#include "BenchmarkTrace.hpp"
+
+// Replays allocation traces against every allocator and reports throughput,
+// per-operation latency, peak footprint and fragmentation. Throughput is
+// measured over several uninstrumented runs, and latency and footprint in a
+// separate instrumented run, so that the timers do not count towards the
+// throughput.
+
+struct Options {
+  size_t runs = 5;
+  size_t pool_size = 256UL * 1024 * 1024;
+  std::vector<std::string> allocators = BenchmarkAllocator::names();
+  bool csv = false;
+  std::vector<std::string> traces;
+};
 
-static void print_bits(uint64_t n) {
-    for (int i = 63; i >= 0; --i) {
-        std::cout << ((n >> i) & 1);
-    }
-    std::cout << std::endl;
-}
+struct Latency {
+  double p50;
+  double p99;
+  double p999;
+};
 
-struct Operation {
-  char type;
-  std::string id;
-  size_t size;
+struct Result {
+  std::string trace;
+  std::string allocator;
+  size_t ops;
+  size_t failed;
+  // Operations per second of every run, sorted.
+  std::vector<double> throughput;
+  Latency allocate_latency;
+  Latency free_latency;
+  size_t peak_live;
+  size_t peak_footprint;
 };
 
-static const size_t PAGE_SIZE = 2097152;
-static const size_t BLOCK_HEADER_SIZE = 0;
+static Latency compute_latency(std::vector<uint32_t> &samples) {
+  if(samples.empty()) {
+    return {0, 0, 0};
+  }
 
-std::map<std::string, JSMallocAlloc> heap;
-std::map<void *, size_t> allocmap;
-std::vector<Operation> operations;
+  std::sort(samples.begin(), samples.end());
+  auto percentile = [&](double p) {
+    return static_cast<double>(samples[std::min(samples.size() - 1, static_cast<size_t>(p * samples.size()))]);
+  };
 
-std::vector<bool> collect_heap(void *heap_start) {
-  uintptr_t hstart = (uintptr_t)heap_start;
-  std::vector<bool> partitions(PAGE_SIZE / 16, false);
+  return {percentile(0.5), percentile(0.99), percentile(0.999)};
+}
 
-  // Fill heap table.
-  for(const auto &obj : heap) {
-    const JSMallocAlloc& a = obj.second;
-    size_t ostart = (((uintptr_t)a.addr) - hstart) / 16;
-    for(size_t i = 0; i < (BLOCK_HEADER_SIZE / 16); i++) {
-      partitions[ostart - 1 - i] = true;
+static void free_remaining(BenchmarkAllocator &allocator, const Trace &trace, std::vector<void *> &objects, std::vector<uint64_t> &sizes) {
+  for(size_t i = 0; i < trace.num_slots; i++) {
+    if(objects[i] != nullptr) {
+      allocator.free(objects[i], sizes[i]);
+      objects[i] = nullptr;
     }
+  }
+}
+
+// Returns the number of seconds it took to replay the trace.
+static double replay(BenchmarkAllocator &allocator, const Trace &trace, std::vector<void *> &objects, size_t &failed) {
+  failed = 0;
 
-    for(size_t i = 0; i < (a.size / 16); i++) {
-      partitions[ostart + i] = true;
+  auto start_time = std::chrono::steady_clock::now();
+
+  for(const TraceOp &op : trace.ops) {
+    if(op.type == TraceOp::Allocate) {
+      void *ptr = allocator.allocate(op.size);
+      failed += (ptr == nullptr);
+      objects[op.slot] = ptr;
+    } else if(objects[op.slot] != nullptr) {
+      allocator.free(objects[op.slot], op.size);
+      objects[op.slot] = nullptr;
     }
   }
 
-  return partitions;
+  auto end_time = std::chrono::steady_clock::now();
+  return std::chrono::duration<double>(end_time - start_time).count();
 }
 
-std::vector<size_t> collect_heap_holes(void *heap_start) {
-  std::vector<size_t> holes;
-  std::vector<bool> partitions = collect_heap(heap_start);
-
-  size_t counter = 0;
-  for(size_t i = 0; i < partitions.size(); i++) {
-    if (partitions[i] || i == (partitions.size() - 1)) {
-      if(i != 0 && counter > 0) {
-        holes.push_back(counter);
+static void replay_instrumented(BenchmarkAllocator &allocator, const Trace &trace, std::vector<void *> &objects,
+                                std::vector<uint64_t> &sizes, Result &result) {
+  std::vector<uint32_t> allocate_samples;
+  std::vector<uint32_t> free_samples;
+  allocate_samples.reserve(trace.ops.size());
+  free_samples.reserve(trace.ops.size());
+
+  size_t live = 0;
+  result.peak_live = 0;
+  result.peak_footprint = 0;
+
+  for(size_t i = 0; i < trace.ops.size(); i++) {
+    const TraceOp &op = trace.ops[i];
+
+    if(op.type == TraceOp::Allocate) {
+      auto start_time = std::chrono::steady_clock::now();
+      void *ptr = allocator.allocate(op.size);
+      auto end_time = std::chrono::steady_clock::now();
+
+      allocate_samples.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(end_time - start_time).count());
+      objects[op.slot] = ptr;
+      sizes[op.slot] = op.size;
+
+      // The footprint can only grow when memory is allocated, so sampling it
+      // after every allocation finds its peak.
+      if(ptr != nullptr) {
+        live += op.size;
+        result.peak_live = std::max(result.peak_live, live);
+        result.peak_footprint = std::max(result.peak_footprint, allocator.footprint());
       }
-      counter = 0;
-    } else {
-      counter += 16;
+    } else if(objects[op.slot] != nullptr) {
+      auto start_time = std::chrono::steady_clock::now();
+      allocator.free(objects[op.slot], op.size);
+      auto end_time = std::chrono::steady_clock::now();
+
+      free_samples.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(end_time - start_time).count());
+      objects[op.slot] = nullptr;
+      live -= sizes[op.slot];
     }
   }
 
-  return holes;
+  result.allocate_latency = compute_latency(allocate_samples);
+  result.free_latency = compute_latency(free_samples);
 }
 
-void dump_heap_state(void *heap_start) {
-  std::map<size_t, size_t> counts;
-  std::vector<size_t> holes = collect_heap_holes(heap_start);
-  size_t last_free = 0;
+static Result run_benchmark(BenchmarkAllocator &allocator, const Trace &trace, size_t runs) {
+  Result result;
+  result.trace = trace.name;
+  result.allocator = allocator.name();
+  result.ops = trace.ops.size();
 
-  for(size_t i = 0; i < holes.size(); i++) {
-    if(i == holes.size() - 1) {
-      last_free = holes[i];
-    } else {
-      counts[holes[i]]++;
-    }
-  }
+  std::vector<void *> objects(trace.num_slots, nullptr);
 
-  for(const auto& pair : counts) {
-    std::cout << std::setw(7) << pair.second << " " << pair.first << std::endl;
+  // Objects that are left at the end of a run are the last ones allocated in
+  // their slots.
+  std::vector<uint64_t> sizes(trace.num_slots, 0);
+  for(const TraceOp &op : trace.ops) {
+    sizes[op.slot] = op.size;
   }
 
-  std::cout << "END " << last_free << std::endl;
-}
-
-void print_free_blocks(void *heap_start) {
-  std::vector<size_t> holes = collect_heap_holes(heap_start);
+  // The first run warms up the caches and the code, and is not counted.
+  for(size_t i = 0; i <= runs; i++) {
+    double seconds = replay(allocator, trace, objects, result.failed);
+    if(i > 0) {
+      result.throughput.push_back(result.ops / seconds);
+    }
 
-  for(size_t hole : holes) {
-    std::cout << hole << std::endl;
+    free_remaining(allocator, trace, objects, sizes);
+    allocator.reset();
   }
-}
 
-void print_heap(void *heap_start) {
-  std::vector<bool> partitions = collect_heap(heap_start);
+  std::sort(result.throughput.begin(), result.throughput.end());
 
-  for(size_t i = 0; i < partitions.size(); i++) {
-    if (partitions[i]) std::cout << '1';
-    else std::cout << "\033[41m \033[0m";
+  replay_instrumented(allocator, trace, objects, sizes, result);
+  free_remaining(allocator, trace, objects, sizes);
+  allocator.reset();
 
-    if(i % 256 == 0) std::cout << std::endl;
-  }
+  return result;
 }
 
-uint8_t *mmap_allocate(size_t pool_size) {
-  return static_cast<uint8_t *>(mmap(nullptr, pool_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+static double median(const std::vector<double> &sorted) {
+  size_t n = sorted.size();
+  return (n % 2 == 1) ? sorted[n / 2] : (sorted[n / 2 - 1] + sorted[n / 2]) / 2;
 }
 
-void process_file(const std::string &filename) {
-  std::ifstream file(filename);
-
-  if(!file.is_open()) {
-    std::cerr << "Failed to open the file: " << filename << std::endl;
-    exit(1);
+// The share of the peak footprint that was not used by live objects at the
+// peak. Both peaks do not necessarily happen at the same time.
+static double fragmentation(const Result &result) {
+  if(result.peak_footprint == 0 || result.peak_live > result.peak_footprint) {
+    return 0;
   }
 
-  char type;
-  std::string id;
-  size_t size;
-  std::string line;
+  return 1.0 - static_cast<double>(result.peak_live) / result.peak_footprint;
+}
 
-  while(std::getline(file, line)) {
-    std::istringstream iss(line);
-    iss >> type >> id >> size;
-    operations.push_back({type, id, size});
-  }
+static void print_csv_header() {
+  std::cout << "trace,allocator,runs,ops,ops_per_sec,ops_per_sec_min,ops_per_sec_max,"
+            << "alloc_p50_ns,alloc_p99_ns,alloc_p999_ns,free_p50_ns,free_p99_ns,free_p999_ns,"
+            << "peak_live_bytes,peak_footprint_bytes,fragmentation,failed_allocations" << std::endl;
+}
 
-  file.close();
+static void print_csv(const Result &result) {
+  std::cout << result.trace << ',' << result.allocator << ',' << result.throughput.size() << ',' << result.ops << ','
+            << std::fixed << std::setprecision(0)
+            << median(result.throughput) << ',' << result.throughput.front() << ',' << result.throughput.back() << ','
+            << result.allocate_latency.p50 << ',' << result.allocate_latency.p99 << ',' << result.allocate_latency.p999 << ','
+            << result.free_latency.p50 << ',' << result.free_latency.p99 << ',' << result.free_latency.p999 << ','
+            << result.peak_live << ',' << result.peak_footprint << ','
+            << std::setprecision(4) << fragmentation(result) << ',' << result.failed << std::endl;
 }
 
-void apply_distribution(TLSF *allocator, void *heap_start) {
-  size_t counter = 0;
-  char last_op = 'a';
+static void print_table_header() {
+  std::cout << std::left << std::setw(16) << "allocator" << std::right
+            << std::setw(12) << "Mops/s" << std::setw(9) << "spread"
+            << std::setw(24) << "alloc p50/p99/p99.9 ns" << std::setw(24) << "free p50/p99/p99.9 ns"
+            << std::setw(12) << "live MiB" << std::setw(12) << "peak MiB" << std::setw(8) << "frag"
+            << std::setw(8) << "failed" << std::endl;
+}
 
-  for(const Operation &op : operations) {
-    if(op.type == 'a' && last_op == 'f') {
-      //allocator.coalesce(allocmap);
-    }
+static void print_table(const Result &result) {
+  auto latency = [](const Latency &latency) {
+    std::ostringstream out;
+    out << latency.p50 << '/' << latency.p99 << '/' << latency.p999;
+    return out.str();
+  };
+
+  double ops_per_sec = median(result.throughput);
+  double spread = (result.throughput.back() - result.throughput.front()) / ops_per_sec;
+
+  std::cout << std::left << std::setw(16) << result.allocator << std::right << std::fixed
+            << std::setw(12) << std::setprecision(2) << ops_per_sec / 1e6
+            << std::setw(8) << std::setprecision(1) << spread * 100 << '%'
+            << std::setw(24) << latency(result.allocate_latency) << std::setw(24) << latency(result.free_latency)
+            << std::setw(12) << std::setprecision(2) << result.peak_live / 1048576.0
+            << std::setw(12) << result.peak_footprint / 1048576.0
+            << std::setw(7) << std::setprecision(1) << fragmentation(result) * 100 << '%'
+            << std::setw(8) << result.failed << std::endl;
+}
 
-    if(op.type == 'a') {
-      //JSMallocAlloc alloc = allocator.debug_allocate(op.size);
-      //JSMallocAlloc alloc = allocator.allocate(op.size);
-      JSMallocAlloc alloc = allocator->allocate(op.size);
+static void usage(const char *program) {
+  std::cout << "Usage: " << program << " [options] <trace>..." << std::endl;
+  std::cout << "The provided files should describe an allocation/free pattern on the following form:" << std::endl;
+  std::cout << "Allocation:\t 'a <id> <size>'" << std::endl;
+  std::cout << "Free:\t\t 'f <id> <size>'" << std::endl;
+  std::cout << std::endl;
+  std::cout << "Options:" << std::endl;
+  std::cout << "  --runs=<n>          Number of timed runs per allocator (default 5)" << std::endl;
+  std::cout << "  --pool-size=<MiB>   Size of the pool of the pool-based allocators (default 256)" << std::endl;
+  std::cout << "  --allocators=<a,b>  Allocators to compare (default all):";
+  for(const std::string &name : BenchmarkAllocator::names()) {
+    std::cout << ' ' << name;
+  }
+  std::cout << std::endl;
+  std::cout << "  --csv               Print one comma-separated line per trace and allocator" << std::endl;
+  exit(1);
+}
 
-      if(alloc.addr != nullptr) {
-        heap[op.id] = alloc;
-        allocmap.insert({alloc.addr, alloc.size});
-      } else {
-        std::cout << "Failed to allocate: " << op.size << std::endl;
-      }
-    } else if(op.type == 'f') {
-      if(heap.find(op.id) != heap.end()) {
-        allocator->free(heap[op.id].addr);
-        //allocator.free(heap[op.id].addr);
-        //allocator.free(heap[op.id].addr, heap[op.id].size);
-
-        allocmap.erase(heap[op.id].addr);
-        heap.erase(op.id);
+static Options parse_options(int argc, char **argv) {
+  Options options;
+
+  for(int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    std::string value = arg.substr(arg.find('=') + 1);
+
+    if(arg.compare(0, 7, "--runs=") == 0) {
+      options.runs = std::max(1UL, strtoul(value.c_str(), nullptr, 10));
+    } else if(arg.compare(0, 12, "--pool-size=") == 0) {
+      options.pool_size = strtoul(value.c_str(), nullptr, 10) * 1024 * 1024;
+    } else if(arg.compare(0, 13, "--allocators=") == 0) {
+      options.allocators.clear();
+      std::istringstream names(value);
+      std::string name;
+      while(std::getline(names, name, ',')) {
+        options.allocators.push_back(name);
       }
+    } else if(arg == "--csv") {
+      options.csv = true;
+    } else if(arg.compare(0, 2, "--") == 0) {
+      usage(argv[0]);
+    } else {
+      options.traces.push_back(arg);
     }
-
-    counter++;
-    last_op = op.type;
   }
-}
 
-int main(int argc, char **argv) {
-  if(argc < 2) {
-    std::cout << "Usage: ./" << argv[0] << " <filename>" << std::endl;
-    std::cout << "The provided file should describe an allocation/free pattern on the following form:" << std::endl;
-    std::cout << "Allocation:\t 'a <id> <size>'" << std::endl;
-    std::cout << "Free:\t\t 'f <id> <size>'" << std::endl;
-    exit(1);
+  if(options.traces.empty() || options.allocators.empty() || options.pool_size == 0) {
+    usage(argv[0]);
   }
 
-  std::string filename = argv[1];
-
-  void *pool1 = mmap_allocate(PAGE_SIZE + sizeof(TLSF));
-  TLSF *tlsf = TLSF::create((uintptr_t)pool1, PAGE_SIZE + sizeof(TLSF));
+  return options;
+}
 
-  void *pool2 = mmap_allocate(PAGE_SIZE);
-  JSMalloc jsm(pool2, PAGE_SIZE, false);
+int main(int argc, char **argv) {
+  Options options = parse_options(argc, argv);
+
+  std::vector<std::unique_ptr<BenchmarkAllocator>> allocators;
+  for(const std::string &name : options.allocators) {
+    std::unique_ptr<BenchmarkAllocator> allocator = BenchmarkAllocator::create(name, options.pool_size);
+    if(allocator == nullptr) {
+      std::cerr << "Unknown allocator: " << name << std::endl;
+      exit(1);
+    }
 
-  void *pool3 = mmap_allocate(PAGE_SIZE);
-  JSMallocZ jsmz(pool3, PAGE_SIZE, false);
+    allocators.push_back(std::move(allocator));
+  }
 
+  if(options.csv) {
+    print_csv_header();
+  }
 
-  process_file(filename);
+  for(const std::string &filename : options.traces) {
+    Trace trace;
+    std::string error;
+    if(!trace.load(filename, error)) {
+      std::cerr << error << std::endl;
+      exit(1);
+    }
 
-  auto start_time = std::chrono::high_resolution_clock::now();
-  apply_distribution(tlsf, pool1);
-  auto end_time = std::chrono::high_resolution_clock::now();
+    if(!options.csv) {
+      std::cout << trace.name << ": " << trace.ops.size() << " operations, "
+                << trace.num_allocations() << " allocations" << std::endl;
+      print_table_header();
+    }
 
-  auto duration = end_time - start_time;
-  const double seconds = std::chrono::duration<double>(duration).count();
-  std::cout << seconds << std::endl;
+    for(std::unique_ptr<BenchmarkAllocator> &allocator : allocators) {
+      Result result = run_benchmark(*allocator, trace, options.runs);
+      if(options.csv) {
+        print_csv(result);
+      } else {
+        print_table(result);
+      }
+    }
+  }
 
   return 0;
 }
@@ -1,106 +1,708 @@
 
-#include <array>
+// Author: Joel Sikström
+
+#include <algorithm>
+#include <atomic>
 #include <chrono>
-#include <cstddef>
-#include <fstream>
-#include <functional>
+#include <condition_variable>
+#include <cstdlib>
+#include <iomanip>
 #include <iostream>
+#include <memory>
 #include <mutex>
-#include <stdexcept>
+#include <sstream>
 #include <string>
 #include <thread>
 #include <vector>
 
-#include <sys/mman.h>
+#include "BenchmarkAllocators.hpp"
+#include "BenchmarkTrace.hpp"
+
+// Runs multi-threaded allocation patterns against every allocator, for a
+// range of thread counts, and reports how throughput and latency scale:
+//   threadtest  every thread allocates a batch of objects and frees it again
+//   larson      every thread replaces random objects in an array of its own,
+//               and the arrays are handed to the next thread between epochs,
+//               so that objects are freed by other threads than their owner
+//   prodcons    threads are paired up, one allocates and the other frees
+//   replay      every thread replays the whole trace given with --trace
+// Object sizes are taken from the trace if one is given, and are generated
+// from a distribution otherwise. As in perf, throughput is measured over
+// uninstrumented runs, and latency in a separate instrumented run.
+
+struct Options {
+  std::vector<size_t> threads;
+  std::vector<std::string> patterns = {"threadtest", "larson", "prodcons"};
+  std::vector<std::string> allocators = BenchmarkAllocator::names();
+  size_t ops = 200000;
+  size_t runs = 3;
+  size_t pool_size = 1024UL * 1024 * 1024;
+  std::string trace;
+  std::string distribution = "mixed";
+  uint64_t seed = 1;
+  bool csv = false;
+
+  // Options of the distribution generator.
+  size_t generate = 0;
+  size_t max_live = 10000;
+  double free_probability = 0.5;
+  bool sizes_only = false;
+};
+
+// A histogram with four buckets per power of two of nanoseconds, which bounds
+// the error of a percentile to 25%.
+class LatencyHistogram {
+public:
+  static const size_t SubBucketsLog2 = 2;
+  static const size_t NumBuckets = 64 << SubBucketsLog2;
+
+  void record(uint64_t ns) {
+    _counts[bucket(ns)]++;
+    _total++;
+  }
+
+  void merge(const LatencyHistogram &other) {
+    for(size_t i = 0; i < NumBuckets; i++) {
+      _counts[i] += other._counts[i];
+    }
+    _total += other._total;
+  }
+
+  // The lower bound of the bucket that holds the percentile.
+  uint64_t percentile(double p) const {
+    uint64_t rank = static_cast<uint64_t>(p * _total);
+    uint64_t seen = 0;
+    for(size_t i = 0; i < NumBuckets; i++) {
+      seen += _counts[i];
+      if(seen > rank) {
+        return lower_bound(i);
+      }
+    }
+
+    return 0;
+  }
+
+private:
+  uint64_t _counts[NumBuckets] = {};
+  uint64_t _total = 0;
+
+  static size_t bucket(uint64_t ns) {
+    if(ns < (1UL << SubBucketsLog2)) {
+      return ns;
+    }
+
+    size_t log2 = 63 - __builtin_clzl(ns);
+    size_t sub_bucket = (ns >> (log2 - SubBucketsLog2)) & ((1UL << SubBucketsLog2) - 1);
+    return ((log2 - SubBucketsLog2 + 1) << SubBucketsLog2) + sub_bucket;
+  }
+
+  static uint64_t lower_bound(size_t index) {
+    if(index < (1UL << SubBucketsLog2)) {
+      return index;
+    }
+
+    size_t log2 = (index >> SubBucketsLog2) + SubBucketsLog2 - 1;
+    uint64_t sub_bucket = index & ((1UL << SubBucketsLog2) - 1);
+    return ((1UL << SubBucketsLog2) + sub_bucket) << (log2 - SubBucketsLog2);
+  }
+};
+
+struct ThreadResult {
+  LatencyHistogram allocate_latency;
+  LatencyHistogram free_latency;
+  size_t ops = 0;
+  size_t failed = 0;
+};
+
+struct Object {
+  void *ptr;
+  uint64_t size;
+};
+
+class Barrier {
+public:
+  Barrier(size_t count) : _count(count), _waiting(0), _generation(0) {}
+
+  void wait() {
+    std::unique_lock<std::mutex> lock(_lock);
+    size_t generation = _generation;
+    if(++_waiting == _count) {
+      _waiting = 0;
+      _generation++;
+      _condition.notify_all();
+    } else {
+      _condition.wait(lock, [&] { return generation != _generation; });
+    }
+  }
+
+private:
+  std::mutex _lock;
+  std::condition_variable _condition;
+  size_t _count;
+  size_t _waiting;
+  size_t _generation;
+};
+
+// A bounded single-producer single-consumer queue.
+class ObjectQueue {
+public:
+  static const size_t Capacity = 1024;
+
+  bool push(Object object) {
+    size_t tail = _tail.load(std::memory_order_relaxed);
+    if(tail - _head.load(std::memory_order_acquire) == Capacity) {
+      return false;
+    }
+
+    _objects[tail % Capacity] = object;
+    _tail.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool pop(Object &object) {
+    size_t head = _head.load(std::memory_order_relaxed);
+    if(head == _tail.load(std::memory_order_acquire)) {
+      return false;
+    }
+
+    object = _objects[head % Capacity];
+    _head.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+private:
+  Object _objects[Capacity];
+  // The producer and the consumer each write to a cache line of their own.
+  std::atomic<size_t> _head{0};
+  char _padding[64];
+  std::atomic<size_t> _tail{0};
+};
+
+// Everything the threads of one run share.
+struct Run {
+  BenchmarkAllocator *allocator;
+  const Options *options;
+  const std::vector<uint64_t> *sizes;
+  const Trace *trace;
+  size_t num_threads;
+  Barrier *barrier;
+
+  // Used by larson.
+  std::vector<std::vector<Object>> arrays;
+
+  // Used by prodcons, one queue per pair of threads.
+  std::unique_ptr<ObjectQueue[]> queues;
+};
 
-#include "JSMalloc.hpp"
+static const size_t THREADTEST_BATCH = 1000;
+static const size_t LARSON_OBJECTS = 1000;
+static const size_t LARSON_EPOCHS = 4;
 
-const int n_runs = 1;
-const int n_threads = 100;
-const size_t max_allocs = -1;
-const bool should_free = true;
-const std::string filename = "distributions/dacapo_h2_1.txt";
+template<bool Instrumented>
+static void *timed_allocate(Run &run, uint64_t size, ThreadResult &result) {
+  void *ptr;
+  if(Instrumented) {
+    auto start_time = std::chrono::steady_clock::now();
+    ptr = run.allocator->allocate(size);
+    auto end_time = std::chrono::steady_clock::now();
+    result.allocate_latency.record(std::chrono::duration_cast<std::chrono::nanoseconds>(end_time - start_time).count());
+  } else {
+    ptr = run.allocator->allocate(size);
+  }
+
+  result.ops++;
+  result.failed += (ptr == nullptr);
+  return ptr;
+}
+
+template<bool Instrumented>
+static void timed_free(Run &run, Object object, ThreadResult &result) {
+  if(object.ptr == nullptr) {
+    return;
+  }
 
-std::array<std::vector<std::pair<void *, size_t>>, n_threads> allocations;
+  if(Instrumented) {
+    auto start_time = std::chrono::steady_clock::now();
+    run.allocator->free(object.ptr, object.size);
+    auto end_time = std::chrono::steady_clock::now();
+    result.free_latency.record(std::chrono::duration_cast<std::chrono::nanoseconds>(end_time - start_time).count());
+  } else {
+    run.allocator->free(object.ptr, object.size);
+  }
 
-uint8_t *mmap_allocate(size_t pool_size) {
-  return static_cast<uint8_t *>(mmap(nullptr, pool_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+  result.ops++;
 }
 
-void allocate_run(JSMallocZ &allocator, std::vector<size_t> &allocation_sizes, int i) {
-  size_t num_allocations = 0;
-  for (size_t size : allocation_sizes) {
-    if (num_allocations++ >= max_allocs) {
-      break;
+// Every thread walks the sizes from an offset of its own.
+class SizeStream {
+public:
+  SizeStream(const std::vector<uint64_t> &sizes, size_t thread, size_t num_threads)
+    : _sizes(sizes), _index(thread * sizes.size() / num_threads) {}
+
+  uint64_t next() {
+    if(_index == _sizes.size()) {
+      _index = 0;
     }
+    return _sizes[_index++];
+  }
+
+private:
+  const std::vector<uint64_t> &_sizes;
+  size_t _index;
+};
+
+template<bool Instrumented>
+static void threadtest(Run &run, size_t thread, ThreadResult &result) {
+  SizeStream sizes(*run.sizes, thread, run.num_threads);
+  std::vector<Object> objects(THREADTEST_BATCH);
 
-    void *p = allocator.allocate(size);
+  for(size_t i = 0; i < run.options->ops / (2 * THREADTEST_BATCH); i++) {
+    for(Object &object : objects) {
+      object.size = sizes.next();
+      object.ptr = timed_allocate<Instrumented>(run, object.size, result);
+    }
 
-    if (should_free) {
-      allocations[i].push_back(std::make_pair(p, size));
+    for(Object &object : objects) {
+      timed_free<Instrumented>(run, object, result);
     }
   }
 }
 
-void process_file(const std::string &filename, std::vector<size_t> &allocation_sizes) {
-  std::ifstream file(filename);
+template<bool Instrumented>
+static void larson(Run &run, size_t thread, ThreadResult &result) {
+  SizeStream sizes(*run.sizes, thread, run.num_threads);
+  uint64_t random = run.options->seed * 0x9e3779b97f4a7c15UL + thread + 1;
 
-  if (!file.is_open()) {
-    std::cerr << "Failed to open the file: " << filename << std::endl;
-    exit(1);
+  std::vector<Object> &own = run.arrays[thread];
+  own.resize(LARSON_OBJECTS);
+  for(Object &object : own) {
+    object.size = sizes.next();
+    object.ptr = timed_allocate<Instrumented>(run, object.size, result);
+  }
+
+  size_t steps = run.options->ops / (2 * LARSON_EPOCHS);
+  std::vector<Object> *objects = &own;
+
+  for(size_t epoch = 0; epoch < LARSON_EPOCHS; epoch++) {
+    // All arrays are filled before they change hands.
+    run.barrier->wait();
+    objects = &run.arrays[(thread + epoch) % run.num_threads];
+
+    for(size_t i = 0; i < steps; i++) {
+      random ^= random << 13;
+      random ^= random >> 7;
+      random ^= random << 17;
+
+      Object &object = (*objects)[random % LARSON_OBJECTS];
+      timed_free<Instrumented>(run, object, result);
+      object.size = sizes.next();
+      object.ptr = timed_allocate<Instrumented>(run, object.size, result);
+    }
+
+    run.barrier->wait();
+  }
+
+  for(Object &object : *objects) {
+    timed_free<Instrumented>(run, object, result);
+  }
+}
+
+template<bool Instrumented>
+static void prodcons(Run &run, size_t thread, ThreadResult &result) {
+  ObjectQueue &queue = run.queues[thread / 2];
+  size_t count = run.options->ops / 2;
+
+  if(thread % 2 == 0) {
+    SizeStream sizes(*run.sizes, thread, run.num_threads);
+    for(size_t i = 0; i < count; i++) {
+      Object object;
+      object.size = sizes.next();
+      object.ptr = timed_allocate<Instrumented>(run, object.size, result);
+      while(!queue.push(object)) {
+        std::this_thread::yield();
+      }
+    }
+  } else {
+    for(size_t i = 0; i < count; i++) {
+      Object object;
+      while(!queue.pop(object)) {
+        std::this_thread::yield();
+      }
+      timed_free<Instrumented>(run, object, result);
+    }
+  }
+}
+
+template<bool Instrumented>
+static void replay(Run &run, size_t, ThreadResult &result) {
+  std::vector<Object> objects(run.trace->num_slots, Object{nullptr, 0});
+
+  for(const TraceOp &op : run.trace->ops) {
+    Object &object = objects[op.slot];
+    if(op.type == TraceOp::Allocate) {
+      object.size = op.size;
+      object.ptr = timed_allocate<Instrumented>(run, op.size, result);
+    } else {
+      timed_free<Instrumented>(run, object, result);
+      object.ptr = nullptr;
+    }
   }
 
-  std::string line;
-  while (std::getline(file, line)) {
-    try {
-      const int number = std::stoi(line);
-      allocation_sizes.push_back(number);
-    } catch (const std::invalid_argument &ia) {
-      std::cerr << "Invalid argument: " << ia.what() << std::endl;
-    } catch (const std::out_of_range &oor) {
-      std::cerr << "Out of range: " << oor.what() << std::endl;
+  for(Object &object : objects) {
+    timed_free<Instrumented>(run, object, result);
+  }
+}
+
+template<bool Instrumented>
+static void run_pattern(const std::string &pattern, Run &run, size_t thread, ThreadResult &result) {
+  if(pattern == "threadtest") {
+    threadtest<Instrumented>(run, thread, result);
+  } else if(pattern == "larson") {
+    larson<Instrumented>(run, thread, result);
+  } else if(pattern == "prodcons") {
+    prodcons<Instrumented>(run, thread, result);
+  } else {
+    replay<Instrumented>(run, thread, result);
+  }
+}
+
+// Returns the number of seconds from the moment all threads have started
+// until the last one is done.
+template<bool Instrumented>
+static double run_threads(const std::string &pattern, Run &run, std::vector<ThreadResult> &results) {
+  Barrier start(run.num_threads + 1);
+  Barrier barrier(run.num_threads);
+  run.barrier = &barrier;
+  run.arrays.assign(run.num_threads, std::vector<Object>());
+  run.queues.reset(new ObjectQueue[(run.num_threads + 1) / 2]);
+  results.assign(run.num_threads, ThreadResult());
+
+  std::vector<std::thread> threads;
+  for(size_t i = 0; i < run.num_threads; i++) {
+    threads.emplace_back([&, i] {
+      // The results are kept on the thread's own stack until it is done, so
+      // that the threads do not share any cache lines.
+      ThreadResult result;
+      start.wait();
+      run_pattern<Instrumented>(pattern, run, i, result);
+      results[i] = result;
+    });
+  }
+
+  start.wait();
+  auto start_time = std::chrono::steady_clock::now();
+
+  for(std::thread &thread : threads) {
+    thread.join();
+  }
+
+  auto end_time = std::chrono::steady_clock::now();
+  return std::chrono::duration<double>(end_time - start_time).count();
+}
+
+struct Result {
+  std::string pattern;
+  std::string allocator;
+  size_t threads;
+  size_t ops;
+  size_t failed;
+  // Operations per second of every run, sorted.
+  std::vector<double> throughput;
+  // Throughput per thread relative to that of the smallest thread count.
+  double scaling;
+  LatencyHistogram allocate_latency;
+  LatencyHistogram free_latency;
+  // The highest p99 allocation latency of any thread.
+  uint64_t worst_allocate_p99;
+};
+
+static Result run_benchmark(const std::string &pattern, BenchmarkAllocator &allocator, size_t num_threads,
+                            const Options &options, const std::vector<uint64_t> &sizes, const Trace &trace) {
+  Result result;
+  result.pattern = pattern;
+  result.allocator = allocator.name();
+  result.threads = num_threads;
+  result.scaling = 0;
+  result.worst_allocate_p99 = 0;
+
+  Run run;
+  run.allocator = &allocator;
+  run.options = &options;
+  run.sizes = &sizes;
+  run.trace = &trace;
+  run.num_threads = num_threads;
+
+  std::vector<ThreadResult> results;
+
+  for(size_t i = 0; i < options.runs; i++) {
+    double seconds = run_threads<false>(pattern, run, results);
+    allocator.reset();
+
+    size_t ops = 0;
+    for(const ThreadResult &thread_result : results) {
+      ops += thread_result.ops;
     }
+    result.throughput.push_back(ops / seconds);
+  }
+
+  std::sort(result.throughput.begin(), result.throughput.end());
+
+  run_threads<true>(pattern, run, results);
+  allocator.reset();
+
+  result.ops = 0;
+  result.failed = 0;
+  for(const ThreadResult &thread_result : results) {
+    result.ops += thread_result.ops;
+    result.failed += thread_result.failed;
+    result.allocate_latency.merge(thread_result.allocate_latency);
+    result.free_latency.merge(thread_result.free_latency);
+    result.worst_allocate_p99 = std::max(result.worst_allocate_p99, thread_result.allocate_latency.percentile(0.99));
+  }
+
+  return result;
+}
+
+static double median(const std::vector<double> &sorted) {
+  size_t n = sorted.size();
+  return (n % 2 == 1) ? sorted[n / 2] : (sorted[n / 2 - 1] + sorted[n / 2]) / 2;
+}
+
+static std::string latency(const LatencyHistogram &histogram) {
+  std::ostringstream out;
+  out << histogram.percentile(0.5) << '/' << histogram.percentile(0.99) << '/' << histogram.percentile(0.999);
+  return out.str();
+}
+
+static void print_csv_header() {
+  std::cout << "pattern,allocator,threads,runs,ops,ops_per_sec,ops_per_sec_min,ops_per_sec_max,scaling,"
+            << "alloc_p50_ns,alloc_p99_ns,alloc_p999_ns,free_p50_ns,free_p99_ns,free_p999_ns,"
+            << "worst_thread_alloc_p99_ns,failed_allocations" << std::endl;
+}
+
+static void print_csv(const Result &result) {
+  std::cout << result.pattern << ',' << result.allocator << ',' << result.threads << ','
+            << result.throughput.size() << ',' << result.ops << ','
+            << std::fixed << std::setprecision(0)
+            << median(result.throughput) << ',' << result.throughput.front() << ',' << result.throughput.back() << ','
+            << std::setprecision(3) << result.scaling << ','
+            << result.allocate_latency.percentile(0.5) << ',' << result.allocate_latency.percentile(0.99) << ','
+            << result.allocate_latency.percentile(0.999) << ','
+            << result.free_latency.percentile(0.5) << ',' << result.free_latency.percentile(0.99) << ','
+            << result.free_latency.percentile(0.999) << ','
+            << result.worst_allocate_p99 << ',' << result.failed << std::endl;
+}
+
+static void print_table_header() {
+  std::cout << std::left << std::setw(12) << "pattern" << std::setw(16) << "allocator" << std::right
+            << std::setw(8) << "threads" << std::setw(10) << "Mops/s" << std::setw(9) << "spread"
+            << std::setw(9) << "scaling" << std::setw(22) << "alloc p50/p99/p99.9"
+            << std::setw(22) << "free p50/p99/p99.9" << std::setw(11) << "worst p99"
+            << std::setw(8) << "failed" << std::endl;
+}
+
+static void print_table(const Result &result) {
+  double ops_per_sec = median(result.throughput);
+  double spread = (result.throughput.back() - result.throughput.front()) / ops_per_sec;
+
+  std::cout << std::left << std::setw(12) << result.pattern << std::setw(16) << result.allocator << std::right
+            << std::setw(8) << result.threads << std::fixed
+            << std::setw(10) << std::setprecision(2) << ops_per_sec / 1e6
+            << std::setw(8) << std::setprecision(1) << spread * 100 << '%'
+            << std::setw(9) << std::setprecision(2) << result.scaling
+            << std::setw(22) << latency(result.allocate_latency) << std::setw(22) << latency(result.free_latency)
+            << std::setw(11) << result.worst_allocate_p99 << std::setw(8) << result.failed << std::endl;
+}
+
+static void usage(const char *program) {
+  std::cout << "Usage: " << program << " [options]" << std::endl;
+  std::cout << "  --threads=<n,m,...>       Thread counts (default powers of two up to twice the CPUs)" << std::endl;
+  std::cout << "  --patterns=<p,q,...>      threadtest, larson, prodcons and replay (default all but replay)" << std::endl;
+  std::cout << "  --allocators=<a,b,...>    Allocators to compare (default all):";
+  for(const std::string &name : BenchmarkAllocator::names()) {
+    std::cout << ' ' << name;
   }
+  std::cout << std::endl;
+  std::cout << "  --ops=<n>                 Operations per thread (default 200000)" << std::endl;
+  std::cout << "  --runs=<n>                Number of timed runs (default 3)" << std::endl;
+  std::cout << "  --pool-size=<MiB>         Size of the pool of the pool-based allocators (default 1024)" << std::endl;
+  std::cout << "  --trace=<file>            Take sizes from a trace or a LOG_ALLOC file, and enable replay" << std::endl;
+  std::cout << "  --distribution=<spec>     Size distribution without a trace (default mixed):" << std::endl;
+  std::cout << "                            fixed:<size>, uniform:<min>:<max>, exponential:<mean>, mixed" << std::endl;
+  std::cout << "  --seed=<n>                Seed of the distribution (default 1)" << std::endl;
+  std::cout << "  --csv                     Print one comma-separated line per result" << std::endl;
+  std::cout << std::endl;
+  std::cout << "  --generate=<n>            Print a trace of n allocations from the distribution and exit" << std::endl;
+  std::cout << "  --max-live=<n>            Most objects live at once in the trace (default 10000)" << std::endl;
+  std::cout << "  --free-probability=<p>    Probability of a free before every allocation (default 0.5)" << std::endl;
+  std::cout << "  --sizes-only              Print only the sizes, in the LOG_ALLOC format" << std::endl;
+  exit(1);
+}
 
-  file.close();
+static std::vector<std::string> split(const std::string &value) {
+  std::vector<std::string> items;
+  std::istringstream iss(value);
+  std::string item;
+  while(std::getline(iss, item, ',')) {
+    items.push_back(item);
+  }
+
+  return items;
 }
 
-int main() {
-  size_t pool_size = 10 * 1000 * 1024;
-  void *pool = mmap_allocate(pool_size);
-  JSMallocZ allocator(pool, pool_size, false);
+static Options parse_options(int argc, char **argv) {
+  Options options;
+
+  for(int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    std::string key = arg.substr(0, arg.find('='));
+    std::string value = arg.substr(arg.find('=') + 1);
+
+    if(key == "--threads") {
+      for(const std::string &item : split(value)) {
+        options.threads.push_back(strtoul(item.c_str(), nullptr, 10));
+      }
+    } else if(key == "--patterns") {
+      options.patterns = split(value);
+    } else if(key == "--allocators") {
+      options.allocators = split(value);
+    } else if(key == "--ops") {
+      options.ops = strtoul(value.c_str(), nullptr, 10);
+    } else if(key == "--runs") {
+      options.runs = std::max(1UL, strtoul(value.c_str(), nullptr, 10));
+    } else if(key == "--pool-size") {
+      options.pool_size = strtoul(value.c_str(), nullptr, 10) * 1024 * 1024;
+    } else if(key == "--trace") {
+      options.trace = value;
+    } else if(key == "--distribution") {
+      options.distribution = value;
+    } else if(key == "--seed") {
+      options.seed = strtoull(value.c_str(), nullptr, 10);
+    } else if(key == "--csv") {
+      options.csv = true;
+    } else if(key == "--generate") {
+      options.generate = strtoul(value.c_str(), nullptr, 10);
+    } else if(key == "--max-live") {
+      options.max_live = std::max(1UL, strtoul(value.c_str(), nullptr, 10));
+    } else if(key == "--free-probability") {
+      options.free_probability = strtod(value.c_str(), nullptr);
+    } else if(key == "--sizes-only") {
+      options.sizes_only = true;
+    } else {
+      usage(argv[0]);
+    }
+  }
+
+  if(options.threads.empty()) {
+    size_t max_threads = 2 * std::max(1U, std::thread::hardware_concurrency());
+    for(size_t threads = 1; threads <= max_threads; threads *= 2) {
+      options.threads.push_back(threads);
+    }
+  }
 
-  std::vector<std::thread> threads(n_threads);
+  if(!options.trace.empty() && std::find(options.patterns.begin(), options.patterns.end(), "replay") == options.patterns.end()) {
+    options.patterns.push_back("replay");
+  }
+
+  for(const std::string &pattern : options.patterns) {
+    if(pattern != "threadtest" && pattern != "larson" && pattern != "prodcons" && pattern != "replay") {
+      usage(argv[0]);
+    }
+  }
 
-  std::vector<size_t> allocation_sizes;
+  std::sort(options.threads.begin(), options.threads.end());
+  if(std::find(options.threads.begin(), options.threads.end(), 0UL) != options.threads.end() || options.pool_size == 0) {
+    usage(argv[0]);
+  }
 
-  process_file(filename, allocation_sizes);
+  return options;
+}
 
-  auto start_time = std::chrono::high_resolution_clock::now();
+int main(int argc, char **argv) {
+  Options options = parse_options(argc, argv);
 
-  for (int i = 0; i < n_runs; i++) {
+  SizeDistribution distribution;
+  if(!distribution.parse(options.distribution)) {
+    std::cerr << "Invalid distribution: " << options.distribution << std::endl;
+    exit(1);
+  }
 
-    for (int j = 0; j < n_threads; j++) {
-      threads[j] =
-          std::thread(allocate_run, std::ref(allocator), std::ref(allocation_sizes), j);
+  if(options.generate > 0) {
+    Trace trace;
+    trace.generate(distribution, options.generate, options.max_live, options.free_probability, options.seed);
+
+    if(options.sizes_only) {
+      for(uint64_t size : trace.allocation_sizes()) {
+        std::cout << size << '\n';
+      }
+    } else {
+      trace.write(std::cout);
+    }
+
+    return 0;
+  }
+
+  Trace trace;
+  std::vector<uint64_t> sizes;
+  if(!options.trace.empty()) {
+    std::string error;
+    if(!trace.load(options.trace, error)) {
+      std::cerr << error << std::endl;
+      exit(1);
     }
+    sizes = trace.allocation_sizes();
+  } else {
+    sizes = distribution.generate(1 << 16, options.seed);
+  }
+
+  if(sizes.empty()) {
+    std::cerr << "No allocations in " << options.trace << std::endl;
+    exit(1);
+  }
 
-    for (auto &t : threads) {
-      t.join();
+  std::vector<std::unique_ptr<BenchmarkAllocator>> allocators;
+  for(const std::string &name : options.allocators) {
+    std::unique_ptr<BenchmarkAllocator> allocator = BenchmarkAllocator::create(name, options.pool_size);
+    if(allocator == nullptr) {
+      std::cerr << "Unknown allocator: " << name << std::endl;
+      exit(1);
     }
 
-    if (should_free) {
-      for (auto &vec : allocations) {
-        for (const auto &p : vec) {
-          allocator.free(p.first, p.second);
+    allocators.push_back(std::move(allocator));
+  }
+
+  if(options.csv) {
+    print_csv_header();
+  } else {
+    print_table_header();
+  }
+
+  for(const std::string &pattern : options.patterns) {
+    for(std::unique_ptr<BenchmarkAllocator> &allocator : allocators) {
+      // The throughput per thread of the smallest thread count.
+      double baseline = 0;
+
+      for(size_t num_threads : options.threads) {
+        // Producers and consumers come in pairs.
+        if(pattern == "prodcons" && num_threads % 2 != 0) {
+          continue;
+        }
+
+        Result result = run_benchmark(pattern, *allocator, num_threads, options, sizes, trace);
+        double per_thread = median(result.throughput) / num_threads;
+        if(baseline == 0) {
+          baseline = per_thread;
+        }
+        result.scaling = per_thread / baseline;
+
+        if(options.csv) {
+          print_csv(result);
+        } else {
+          print_table(result);
         }
-        vec.clear();
       }
     }
   }
 
-  auto end_time = std::chrono::high_resolution_clock::now();
-  auto duration = end_time - start_time;
-  const double seconds = std::chrono::duration<double>(duration).count();
-  std::cout << "Concurrent took: " << seconds << " seconds" << std::endl;
+  return 0;
 }
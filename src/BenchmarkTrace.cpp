@@ -0,0 +1,319 @@
+
+// Author: Joel Sikström
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <random>
+#include <sstream>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "BenchmarkTrace.hpp"
+#include "JSMallocTrace.hpp"
+
+bool SizeDistribution::parse(const std::string &spec) {
+  std::istringstream iss(spec);
+  std::string kind;
+  std::getline(iss, kind, ':');
+
+  char separator;
+  if(kind == "fixed" && (iss >> _min) && _min > 0) {
+    _kind = Kind::Fixed;
+  } else if(kind == "uniform" && (iss >> _min >> separator >> _max) && separator == ':' && 0 < _min && _min <= _max) {
+    _kind = Kind::Uniform;
+  } else if(kind == "exponential" && (iss >> _mean) && _mean >= 1) {
+    _kind = Kind::Exponential;
+  } else if(spec == "mixed") {
+    _kind = Kind::Mixed;
+  } else {
+    return false;
+  }
+
+  return true;
+}
+
+std::vector<uint64_t> SizeDistribution::generate(size_t count, uint64_t seed) {
+  std::mt19937_64 rng(seed);
+  std::uniform_int_distribution<uint64_t> uniform(_min, _max);
+  std::exponential_distribution<double> exponential(1.0 / _mean);
+
+  // 90% of the objects are around 48 bytes, and the rest are spread evenly
+  // between 256 bytes and 64 KiB.
+  std::exponential_distribution<double> mixed_small(1.0 / 48);
+  std::uniform_int_distribution<uint64_t> mixed_large(256, 64 * 1024);
+  std::uniform_int_distribution<int> mixed_choice(0, 9);
+
+  std::vector<uint64_t> sizes(count);
+  for(uint64_t &size : sizes) {
+    switch(_kind) {
+    case Kind::Fixed:
+      size = _min;
+      break;
+    case Kind::Uniform:
+      size = uniform(rng);
+      break;
+    case Kind::Exponential:
+      size = 1 + static_cast<uint64_t>(exponential(rng));
+      break;
+    case Kind::Mixed:
+      size = (mixed_choice(rng) != 0) ? 1 + static_cast<uint64_t>(mixed_small(rng)) : mixed_large(rng);
+      break;
+    }
+  }
+
+  return sizes;
+}
+
+bool Trace::load(const std::string &filename, std::string &error) {
+  int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+  struct stat st;
+
+  if(fd < 0 || fstat(fd, &st) != 0) {
+    if(fd >= 0) {
+      close(fd);
+    }
+    error = "Failed to open the file: " + filename;
+    return false;
+  }
+
+  name = filename.substr(filename.find_last_of('/') + 1);
+  ops.clear();
+  num_slots = 0;
+
+  size_t size = st.st_size;
+  if(size == 0) {
+    close(fd);
+    return true;
+  }
+
+  void *data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+
+  if(data == MAP_FAILED) {
+    error = "Failed to map the file: " + filename;
+    return false;
+  }
+
+  madvise(data, size, MADV_SEQUENTIAL);
+
+  const char *bytes = static_cast<const char *>(data);
+  bool binary = size >= sizeof(JSMallocTraceHeader) && memcmp(bytes, JSMallocTraceHeader::Magic, sizeof(JSMallocTraceHeader::magic)) == 0;
+  bool loaded = binary ? load_binary(bytes, size, filename, error) : load_text(bytes, size, filename, error);
+
+  munmap(data, size);
+  return loaded;
+}
+
+bool Trace::load_binary(const char *data, size_t size, const std::string &filename, std::string &error) {
+  const JSMallocTraceHeader *header = reinterpret_cast<const JSMallocTraceHeader *>(data);
+  if(header->version != JSMallocTraceHeader::Version || header->record_size != sizeof(JSMallocTraceRecord)) {
+    error = filename + ": unsupported trace version";
+    return false;
+  }
+
+  const JSMallocTraceRecord *records = reinterpret_cast<const JSMallocTraceRecord *>(data + sizeof(JSMallocTraceHeader));
+  size_t num_records = (size - sizeof(JSMallocTraceHeader)) / sizeof(JSMallocTraceRecord);
+
+  // The chunks of different threads are interleaved in the order they were
+  // written, so operations are put back in the order they happened.
+  struct TimedRecord {
+    uint64_t time;
+    const JSMallocTraceRecord *record;
+  };
+
+  std::vector<uint64_t> thread_times;
+  std::vector<TimedRecord> timed;
+  timed.reserve(num_records);
+
+  for(size_t i = 0; i < num_records; i++) {
+    const JSMallocTraceRecord &record = records[i];
+    if(record.thread >= thread_times.size()) {
+      thread_times.resize(record.thread + 1, 0);
+    }
+
+    uint64_t &time = thread_times[record.thread];
+    if(record.op == JSMallocTraceRecord::Timestamp) {
+      time = record.address;
+    } else {
+      time += record.time_delta;
+      timed.push_back({time, &record});
+    }
+  }
+
+  std::stable_sort(timed.begin(), timed.end(), [](const TimedRecord &a, const TimedRecord &b) {
+    return a.time < b.time;
+  });
+
+  // The slot of every live address. Frees do not record a size, so it is
+  // taken from the allocation instead.
+  std::unordered_map<uint64_t, uint32_t> slots;
+  std::vector<uint64_t> slot_sizes;
+
+  for(const TimedRecord &entry : timed) {
+    const JSMallocTraceRecord &record = *entry.record;
+
+    if(record.op == JSMallocTraceRecord::Allocate) {
+      uint32_t slot = static_cast<uint32_t>(num_slots++);
+      slots[record.address] = slot;
+      slot_sizes.push_back(record.size);
+      ops.push_back({TraceOp::Allocate, slot, record.size});
+    } else if(record.op == JSMallocTraceRecord::Free) {
+      auto it = slots.find(record.address);
+      if(it != slots.end()) {
+        ops.push_back({TraceOp::Free, it->second, slot_sizes[it->second]});
+        slots.erase(it);
+      }
+    }
+  }
+
+  return true;
+}
+
+// Parses an unsigned number at pos and moves pos past it.
+static bool parse_number(const char *&pos, const char *end, uint64_t &value) {
+  if(pos == end || !isdigit(static_cast<unsigned char>(*pos))) {
+    return false;
+  }
+
+  value = 0;
+  while(pos != end && isdigit(static_cast<unsigned char>(*pos))) {
+    value = value * 10 + (*pos++ - '0');
+  }
+
+  return true;
+}
+
+static void skip_blanks(const char *&pos, const char *end) {
+  while(pos != end && (*pos == ' ' || *pos == '\t' || *pos == '\r')) {
+    pos++;
+  }
+}
+
+bool Trace::load_text(const char *data, size_t size, const std::string &filename, std::string &error) {
+  // The slot of every id, and whether the object in that slot is live.
+  std::unordered_map<std::string, uint32_t> slots;
+  std::vector<bool> live;
+
+  const char *end = data + size;
+  size_t line_number = 0;
+
+  for(const char *line = data; line < end;) {
+    const char *line_end = static_cast<const char *>(memchr(line, '\n', end - line));
+    if(line_end == nullptr) {
+      line_end = end;
+    }
+
+    line_number++;
+    const char *pos = line;
+    skip_blanks(pos, line_end);
+    if(pos == line_end) {
+      line = line_end + 1;
+      continue;
+    }
+
+    uint64_t size;
+    if(isdigit(static_cast<unsigned char>(*pos))) {
+      if(!parse_number(pos, line_end, size)) {
+        error = filename + ":" + std::to_string(line_number) + ": expected a size";
+        return false;
+      }
+
+      live.push_back(true);
+      ops.push_back({TraceOp::Allocate, static_cast<uint32_t>(num_slots++), size});
+      line = line_end + 1;
+      continue;
+    }
+
+    char type = *pos++;
+    skip_blanks(pos, line_end);
+    const char *id_start = pos;
+    while(pos != line_end && !isspace(static_cast<unsigned char>(*pos))) {
+      pos++;
+    }
+    std::string id(id_start, pos);
+    skip_blanks(pos, line_end);
+
+    if((type != TraceOp::Allocate && type != TraceOp::Free) || id.empty() || !parse_number(pos, line_end, size)) {
+      error = filename + ":" + std::to_string(line_number) + ": expected 'a <id> <size>' or 'f <id> <size>'";
+      return false;
+    }
+
+    auto it = slots.find(id);
+    if(type == TraceOp::Allocate) {
+      // An id that is allocated again while live gets a new slot, and the old
+      // object is left for the end of the replay.
+      if(it == slots.end() || live[it->second]) {
+        slots[id] = static_cast<uint32_t>(num_slots++);
+        it = slots.find(id);
+        live.push_back(false);
+      }
+
+      live[it->second] = true;
+      ops.push_back({TraceOp::Allocate, it->second, size});
+    } else if(it != slots.end() && live[it->second]) {
+      live[it->second] = false;
+      ops.push_back({TraceOp::Free, it->second, size});
+    }
+
+    line = line_end + 1;
+  }
+
+  return true;
+}
+
+void Trace::generate(SizeDistribution &distribution, size_t num_allocations, size_t max_live,
+                     double free_probability, uint64_t seed) {
+  std::vector<uint64_t> sizes = distribution.generate(num_allocations, seed);
+  std::mt19937_64 rng(seed + 1);
+  std::uniform_real_distribution<double> coin(0, 1);
+
+  ops.clear();
+  num_slots = 0;
+
+  // Live objects, in no particular order.
+  std::vector<TraceOp> live;
+
+  for(uint64_t size : sizes) {
+    if(!live.empty() && (live.size() >= max_live || coin(rng) < free_probability)) {
+      size_t index = std::uniform_int_distribution<size_t>(0, live.size() - 1)(rng);
+      std::swap(live[index], live.back());
+      ops.push_back({TraceOp::Free, live.back().slot, live.back().size});
+      live.pop_back();
+    }
+
+    TraceOp op = {TraceOp::Allocate, static_cast<uint32_t>(num_slots++), size};
+    ops.push_back(op);
+    live.push_back(op);
+  }
+}
+
+void Trace::write(std::ostream &out) {
+  for(const TraceOp &op : ops) {
+    out << static_cast<char>(op.type) << ' ' << op.slot << ' ' << op.size << '\n';
+  }
+}
+
+size_t Trace::num_allocations() {
+  size_t count = 0;
+  for(const TraceOp &op : ops) {
+    count += (op.type == TraceOp::Allocate);
+  }
+
+  return count;
+}
+
+std::vector<uint64_t> Trace::allocation_sizes() {
+  std::vector<uint64_t> sizes;
+  for(const TraceOp &op : ops) {
+    if(op.type == TraceOp::Allocate) {
+      sizes.push_back(op.size);
+    }
+  }
+
+  return sizes;
+}
@@ -0,0 +1,79 @@
+
+// Author: Joel Sikström
+
+#ifndef BENCHMARK_TRACE_HPP
+#define BENCHMARK_TRACE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+struct TraceOp {
+  static const uint8_t Allocate = 'a';
+  static const uint8_t Free = 'f';
+
+  uint8_t type;
+  // Objects are numbered densely in the order they are first allocated, so
+  // that replays can keep live objects in a plain array.
+  uint32_t slot;
+  uint64_t size;
+};
+
+// Request sizes drawn from a distribution, which is described by one of:
+//   fixed:<size>
+//   uniform:<min>:<max>
+//   exponential:<mean>
+//   mixed             mostly small objects with a tail of larger ones
+// Sizes are generated from a seed, so that they are the same in every run.
+class SizeDistribution {
+public:
+  // Returns false if spec is not a valid description.
+  bool parse(const std::string &spec);
+
+  std::vector<uint64_t> generate(size_t count, uint64_t seed);
+
+private:
+  enum class Kind { Fixed, Uniform, Exponential, Mixed };
+
+  Kind _kind = Kind::Mixed;
+  uint64_t _min = 0;
+  uint64_t _max = 0;
+  double _mean = 0;
+};
+
+// A sequence of allocations and frees, read from either a binary trace written
+// with LOG_ALLOC, or a text file with one operation per line:
+//   a <id> <size>
+//   f <id> <size>
+// where ids are arbitrary tokens. Frees of ids that are not live are dropped
+// when the trace is loaded. Lines that only hold a size are read as
+// allocations that are never freed.
+class Trace {
+public:
+  std::string name;
+  std::vector<TraceOp> ops;
+  size_t num_slots = 0;
+
+  // Returns false and sets error if the file cannot be read or is malformed.
+  bool load(const std::string &filename, std::string &error);
+
+  // Generates num_allocations allocations with sizes from distribution. Each
+  // allocation is preceded by the free of a random live object with the given
+  // probability, or always once max_live objects are live.
+  void generate(SizeDistribution &distribution, size_t num_allocations, size_t max_live,
+                double free_probability, uint64_t seed);
+
+  // Writes the trace in the text format that load reads.
+  void write(std::ostream &out);
+
+  size_t num_allocations();
+  std::vector<uint64_t> allocation_sizes();
+
+private:
+  bool load_binary(const char *data, size_t size, const std::string &filename, std::string &error);
+  bool load_text(const char *data, size_t size, const std::string &filename, std::string &error);
+};
+
+#endif // BENCHMARK_TRACE_HPP
@@ -1,670 +1,693 @@
 
 // Author: Joel Sikström
 
+#include <algorithm>
 #include <cmath>
+#include <cstring>
+#include <ctime>
 #include <iostream>
 #include <cassert>
 #include <limits>
+#include <thread>
+#include <vector>
 
-#include "JSMalloc.hpp"
-#include "JSMallocUtil.inline.hpp"
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "JSMalloc.inline.hpp"
 
 template class JSMallocBase<BaseConfig>;
 template class JSMallocBase<ZOptimizedConfig>;
+template class JSMallocT<BaseConfig>;
 
-// Contains first- and second-level index to segregated lists
-// In the case of the optimized version, only the fl mapping is used.
-struct Mapping { 
-  static const uint32_t UNABLE_TO_FIND = std::numeric_limits<uint32_t>::max();
-  size_t fl, sl;
-};
-
-size_t BlockHeader::get_size() {
-  return size & ~(_BlockFreeMask | _BlockLastMask);
-}
-
-bool BlockHeader::is_free() {
-  return (size & _BlockFreeMask) == _BlockFreeMask;
+void JSMallocRegionMap::clear() {
+  for(size_t i = 0; i < Capacity; i++) {
+    _entries[i] = 0;
+  }
 }
 
-bool BlockHeader::is_last() {
-  return (size & _BlockLastMask) == _BlockLastMask;
-}
+bool JSMallocRegionMap::insert(uintptr_t start, size_t size, uint16_t value) {
+  for(uintptr_t chunk = start >> ChunkShift; chunk < ((start + size) >> ChunkShift); chunk++) {
+    uint64_t entry = (chunk << 16) | (value + 1U);
+    size_t index = chunk % Capacity;
+    size_t probes = 0;
 
-void BlockHeader::mark_free() {
-    size |= _BlockFreeMask;
-}
+    while(true) {
+      uint64_t expected = 0;
+      if(_entries[index].compare_exchange_strong(expected, entry)) {
+        break;
+      }
 
-void BlockHeader::mark_used() {
-    size &= ~_BlockFreeMask;
-}
+      if(++probes == Capacity) {
+        return false;
+      }
 
-void BlockHeader::mark_last() {
-  size |= _BlockLastMask;
-}
+      index = (index + 1) % Capacity;
+    }
+  }
 
-void BlockHeader::unmark_last() {
-  size &= ~_BlockLastMask;
+  return true;
 }
 
-template<typename Config>
-JSMallocBase<Config>::JSMallocBase(void *pool, size_t pool_size, bool start_full) {
-  initialize(pool, pool_size, start_full);
-}
+uint32_t JSMallocRegionMap::lookup(uintptr_t address) {
+  uint64_t chunk = address >> ChunkShift;
+  size_t index = chunk % Capacity;
 
-template<typename Config>
-void JSMallocBase<Config>::reset(bool initial_block_allocated) {
-  // Initialize bitmap and blocks
-  _fl_bitmap = 0;
-  for(size_t i = 0; i < _fl_index; i++) {
-    if(Config::UseSecondLevels) {
-      _sl_bitmap[i] = 0;
+  for(size_t probes = 0; probes < Capacity; probes++) {
+    uint64_t entry = _entries[index].load(std::memory_order_acquire);
+    if(entry == 0) {
+      return NOT_FOUND;
     }
 
-    for(size_t j = 0; j < _sl_index; j++) {
-      _blocks[i * _sl_index + j] = nullptr;
+    if((entry >> 16) == chunk) {
+      return (entry & 0xFFFF) - 1;
     }
+
+    index = (index + 1) % Capacity;
   }
-  _blocks[_num_lists] = nullptr;
 
-  BlockHeader *blk = reinterpret_cast<BlockHeader *>(_block_start);
+  return NOT_FOUND;
+}
 
-  if(!Config::DeferredCoalescing) {
-    blk->prev_phys_block = nullptr;
-  }
+static std::atomic<uint64_t> next_stats_id{1};
+static pthread_once_t stats_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t stats_key;
 
-  if(!initial_block_allocated) {
-    blk->size = _pool_size - _block_header_length;
-    insert_block(blk);
+uint64_t JSMallocThreadStatsCache::next_id() {
+  return next_stats_id.fetch_add(1);
+}
 
-  } else if(_block_header_length > 0) {
-      blk->mark_used();
+void JSMallocThreadStatsCache::insert(uint64_t id, JSMallocThreadStats *stats) {
+  Cache &thread_cache = cache();
+  Entry &entry = thread_cache.entries[id % NumEntries];
+  if(entry.stats != nullptr) {
+    entry.stats->in_use.store(false, std::memory_order_release);
   }
+  entry = {id, stats};
 
-  if(_block_header_length > 0) {
-    blk->mark_last();
+  // The entry is already in place, since setting the key can allocate and
+  // count into the same block.
+  if(!thread_cache.registered) {
+    thread_cache.registered = true;
+    pthread_once(&stats_key_once, create_key);
+    pthread_setspecific(stats_key, &thread_cache);
   }
 }
 
-template<typename Config>
-void *JSMallocBase<Config>::allocate(size_t size) {
-  return debug_allocate(size).addr;
+void JSMallocThreadStatsCache::create_key() {
+  pthread_key_create(&stats_key, release);
 }
 
-template<typename Config>
-JSMallocAlloc JSMallocBase<Config>::debug_allocate(size_t size) {
-  BlockHeader *blk = find_block(size);
-
-  if(blk == nullptr) {
-    return {nullptr, 0};
-  } 
-
-  size_t allocated_size = blk->get_size();
-
-  _internal_fragmentation = allocated_size - size;
-  _allocated += allocated_size;
+void JSMallocThreadStatsCache::release(void *ptr) {
+  Cache *thread_cache = static_cast<Cache *>(ptr);
+  for(size_t i = 0; i < NumEntries; i++) {
+    if(thread_cache->entries[i].stats != nullptr) {
+      thread_cache->entries[i].stats->in_use.store(false, std::memory_order_release);
+    }
+    thread_cache->entries[i] = {0, nullptr};
+  }
 
-  // Make sure addresses are aligned to the word-size (8-bytes).
-  // TODO: This might not be necessary if everything is already aligned, and
-  // should take into account that the block size might be smaller than expected.
-  uintptr_t blk_start = (uintptr_t)blk + _block_header_length;
-  return {(void *)blk_start, allocated_size};
+  // Blocks that are claimed by later destructors are handed back as well.
+  thread_cache->registered = false;
 }
 
-template<typename Config>
-double JSMallocBase<Config>::internal_fragmentation() {
-  return (double)_internal_fragmentation / _allocated;
+void JSMallocClassStats::add(const JSMallocClassStats &other) {
+  allocs += other.allocs;
+  frees += other.frees;
+  splits += other.splits;
+  coalesces += other.coalesces;
+  cas_retries += other.cas_retries;
+  lock_waits += other.lock_waits;
+  allocated_bytes += other.allocated_bytes;
+  requested_bytes += other.requested_bytes;
+  live_bytes += other.live_bytes;
+  free_bytes += other.free_bytes;
 }
 
-template<typename Config>
-void JSMallocBase<Config>::print_blk(BlockHeader *blk) {
-  std::cout << "Block (@ " << blk << ")\n" 
-            << " size=" << blk->get_size() << "\n"
-            << " LF=" << (blk->is_last() ? "1" : "0") << (blk->is_free() ? "1" : "0") << " (not accurate)\n";
-
-  if(!Config::DeferredCoalescing) {
-    std::cout << " phys_prev=" << ((blk->prev_phys_block == nullptr) ? 0 : blk->prev_phys_block) << "\n";
-  }
+void JSMallocStats::add(const JSMallocStats &other) {
+  pool_bytes += other.pool_bytes;
+  total.add(other.total);
 
-  if(blk->is_free()) {
-    std::cout << " next=" << blk_get_next(blk) << ","
-              << " prev=" << blk_get_prev(blk)
-              << std::endl;
+  num_classes = std::max(num_classes, other.num_classes);
+  for(size_t i = 0; i < other.num_classes; i++) {
+    classes[i].min_size = other.classes[i].min_size;
+    classes[i].add(other.classes[i]);
   }
 }
 
-template<typename Config>
-void JSMallocBase<Config>::print_phys_blks() {
-  BlockHeader *current = reinterpret_cast<BlockHeader *>(_block_start);
+void JSMallocStats::print(FILE *out) {
+  fprintf(out, "pool bytes:      %14zu\n", pool_bytes);
+  fprintf(out, "live bytes:      %14zu\n", total.live_bytes);
+  fprintf(out, "free bytes:      %14zu\n", total.free_bytes);
+  fprintf(out, "allocs:          %14lu\n", total.allocs);
+  fprintf(out, "frees:           %14lu\n", total.frees);
+  fprintf(out, "splits:          %14lu\n", total.splits);
+  fprintf(out, "coalesces:       %14lu\n", total.coalesces);
+  fprintf(out, "CAS retries:     %14lu\n", total.cas_retries);
+  fprintf(out, "lock waits:      %14lu\n", total.lock_waits);
 
-  while(current != nullptr) {
-    print_blk(current);
-    current = get_next_phys_block(current);
-  }
-}
+  fprintf(out, "%12s %12s %12s %10s %10s %10s %10s %14s %14s\n",
+          "class", "allocs", "frees", "splits", "coalesces", "CAS", "waits", "live bytes", "free bytes");
 
-template<typename Config>
-void JSMallocBase<Config>::print_free_lists() {
-  for(size_t i = 0; i < 32; i++) {
-    if((_fl_bitmap & (1UL << i)) == 0) {
+  for(size_t i = 0; i < num_classes; i++) {
+    JSMallocClassStats &c = classes[i];
+    if(c.allocs == 0 && c.frees == 0 && c.free_bytes == 0 && c.coalesces == 0) {
       continue;
     }
 
-    if(Config::UseSecondLevels) {
-      for(size_t j = 0; j < 32; j++) {
-        if((_sl_bitmap[i] & (1UL << j)) == 0) {
-          continue;
-        }
-
-        printf("FREE-LIST (%02ld): ", i * _fl_index + j);
-        BlockHeader *current = _blocks[flatten_mapping({i, j})];
-        while(current != nullptr) {
-          std::cout << current << " -> ";
-          current = blk_get_next(current);
-        }
-        std::cout << "END" << std::endl;
-      }
-    } else {
-      printf("FREE-LIST (%02ld): ", i);
-      BlockHeader *current = _blocks[i];
-      current = reinterpret_cast<BlockHeader *>(JSMallocUtil::from_offset(_block_start, false, reinterpret_cast<uint64_t>(_blocks[i].load())));
-
-      while(current != nullptr) {
-        std::cout << current << " -> ";
-        current = blk_get_next(current);
-      }
-
-      std::cout << "END" << std::endl;
-    }
+    fprintf(out, "%12zu %12lu %12lu %10lu %10lu %10lu %10lu %14zu %14zu\n",
+            c.min_size, c.allocs, c.frees, c.splits, c.coalesces, c.cas_retries, c.lock_waits, c.live_bytes, c.free_bytes);
   }
 }
 
-template<typename Config>
-uint64_t JSMallocBase<Config>::get_fl_bitmap() {
-  return _fl_bitmap;
-}
+double JSMallocFragmentation::index() {
+  if(free_bytes == 0 || largest_free_block >= free_bytes) {
+    return 0;
+  }
 
-template<typename Config>
-void JSMallocBase<Config>::initialize(void *pool, size_t pool_size, bool start_full) {
-  uintptr_t aligned_initial_block = JSMallocUtil::align_up((uintptr_t)pool, _alignment);
-  _block_start = aligned_initial_block;
+  return 1 - (double)largest_free_block / free_bytes;
+}
 
-  // The pool size is shrinked to the initial aligned block size. This wastes at maximum (_mbs - 1) bytes
-  size_t aligned_block_size = JSMallocUtil::align_down(pool_size - (aligned_initial_block - (uintptr_t)pool), _mbs);
-  _pool_size = aligned_block_size;
+void JSMallocFragmentation::add(const JSMallocFragmentation &other) {
+  free_bytes += other.free_bytes;
+  largest_free_block = std::max(largest_free_block, other.largest_free_block);
 
-  reset(start_full);
+  num_classes = std::max(num_classes, other.num_classes);
+  for(size_t i = 0; i < other.num_classes; i++) {
+    class_min_size[i] = other.class_min_size[i];
+    class_free_bytes[i] += other.class_free_bytes[i];
+  }
 }
 
-template<typename Config>
-void JSMallocBase<Config>::insert_block(BlockHeader *blk) {
-  Mapping mapping = get_mapping(blk->get_size());
-  uint32_t flat_mapping = flatten_mapping(mapping);
-
-  _list_lock.lock();
+JSMallocZ::JSMallocZ(void *pool, size_t pool_size, bool start_full, bool side_table)
+  : JSMallocBase(pool, side_table ? pool_size - side_table_size(pool_size) : pool_size, start_full) {
+  if(!side_table) {
+    return;
+  }
 
-  BlockHeader *head = _blocks[flat_mapping];
+  uintptr_t table_start = JSMallocUtil::align_up(_block_start + _pool_size, alignof(std::atomic<uint64_t>));
+  _num_bitmap_words = (_pool_size / _mbs + 63) / 64;
+  _start_bits = reinterpret_cast<std::atomic<uint64_t> *>(table_start);
+  _end_bits = _start_bits + _num_bitmap_words;
 
-  // Insert the block into its corresponding free-list
-  if(head != nullptr) {
-    blk_set_prev(head, blk);
+  for(size_t i = 0; i < 2 * _num_bitmap_words; i++) {
+    new(&_start_bits[i]) std::atomic<uint64_t>(0);
   }
 
-  blk_set_next(blk, head);
-  blk_set_prev(blk, nullptr);
-  _blocks[flat_mapping] = blk;
+  // A full pool starts out as one allocated block.
+  if(start_full) {
+    mark_allocated(_block_start, _pool_size);
+  }
+}
 
-  // Mark the block as free
-  blk->mark_free();
+JSMallocZ *JSMallocZ::create(void *pool, size_t pool_size, bool start_full, bool side_table) {
+  JSMallocZ *jsmallocz = reinterpret_cast<JSMallocZ *>(pool);
+  return new(jsmallocz) JSMallocZ(reinterpret_cast<void *>((uintptr_t)pool + sizeof(JSMallocZ)), pool_size - sizeof(JSMallocZ), start_full, side_table);
+}
 
-  update_bitmap(mapping, true);
+void *JSMallocZ::allocate(size_t size) {
+  JSMallocAlloc alloc = debug_allocate(size);
+  if(alloc.addr != nullptr && has_side_table()) {
+    mark_allocated((uintptr_t)alloc.addr, alloc.size);
+  }
 
-  _list_lock.unlock();
+  return alloc.addr;
 }
 
-template<typename Config>
-BlockHeader *JSMallocBase<Config>::find_block(size_t size) {
-  size_t aligned_size = align_size(size);
-  size_t target_size = aligned_size + (1UL << (JSMallocUtil::ilog2(aligned_size) - _sl_index_log2)) - 1;
+void *JSMallocZ::allocate_aligned(size_t size, size_t alignment) {
+  void *ptr = JSMallocBase::allocate_aligned(size, alignment);
+  if(ptr != nullptr && has_side_table()) {
+    // The block is at least the aligned size, but may be larger if the tail
+    // was too small to be split off.
+    BlockHeader *blk = reinterpret_cast<BlockHeader *>(ptr);
+    mark_allocated((uintptr_t)ptr, blk->get_size());
+  }
 
-  Mapping mapping = get_mapping(target_size);
+  return ptr;
+}
 
-  BlockHeader *blk = nullptr;
-  while(blk == nullptr) {
-    Mapping adjusted_mapping = adjust_available_mapping(mapping);
+size_t JSMallocZ::allocate_batch(size_t size, size_t n, void **out) {
+  n = JSMallocBase::allocate_batch(size, n, out);
 
-    if(adjusted_mapping.sl == Mapping::UNABLE_TO_FIND) {
-      return nullptr;
+  if(has_side_table()) {
+    // The last block also holds what was too small to split off.
+    for(size_t i = 0; i < n; i++) {
+      mark_allocated((uintptr_t)out[i], reinterpret_cast<BlockHeader *>(out[i])->get_size());
     }
+  }
 
-    blk = remove_block(nullptr, adjusted_mapping);
+  return n;
+}
+
+void JSMallocZ::free(void *ptr, size_t size) {
+  if(has_side_table()) {
+    free(ptr);
+    return;
   }
 
-  // If the block can be split, we split it in order to minimize internal fragmentation
-  if((blk->get_size() - aligned_size) >= (_mbs + _block_header_length)) {
-    BlockHeader *remainder_blk = split_block(blk, aligned_size);
-    insert_block(remainder_blk);
+  if(ptr == nullptr) {
+    return;
   }
 
-  return blk;
+  if(!ptr_in_pool((uintptr_t)ptr)) {
+    return;
+  }
+
+  // Blocks are never larger than the aligned size, since every tail that is
+  // left after aligning can be split off.
+  BlockHeader *blk = reinterpret_cast<BlockHeader *>(ptr);
+  blk->size = align_size(size);
+  insert_block(blk);
+  count_free(blk->get_size());
 }
 
-template<typename Config>
-BlockHeader *JSMallocBase<Config>::coalesce_blocks(BlockHeader *blk1, BlockHeader *blk2) {
-  size_t blk2_size = blk2->get_size();
-  if(blk1->is_free()) {
-    remove_block(blk1, get_mapping(blk1->get_size()));
+void JSMallocZ::free(void *ptr) {
+  uintptr_t start = (uintptr_t)ptr;
+  if(!has_side_table() || ptr == nullptr || !ptr_in_pool(start) || !JSMallocUtil::is_aligned(start, _mbs)) {
+    return;
   }
 
-  if(blk2->is_free()) {
-    remove_block(blk2, get_mapping(blk2_size));
+  // Claiming the start bit makes sure that only one thread frees the block.
+  size_t granule = (start - _block_start) / _mbs;
+  uint64_t mask = 1UL << (granule % 64);
+  if((_start_bits[granule / 64].fetch_and(~mask) & mask) == 0) {
+    return;
   }
 
-  bool blk2_is_last = blk2->is_last();
+  size_t size = lookup_size(start);
+  if(size == 0) {
+    return;
+  }
 
-  // Combine the blocks by adding the size of blk2 to blk1 and also the block
-  // header size
-  blk1->size += _block_header_length + blk2_size;
+  size_t last_granule = granule + size / _mbs - 1;
+  _end_bits[last_granule / 64].fetch_and(~(1UL << (last_granule % 64)));
 
-  if(blk2_is_last) {
-    blk1->mark_last();
-  } else if(!Config::DeferredCoalescing) {
-    // We only want to re-point the prev_phys_block ptr if we are not deferring
-    // coalescing
-    BlockHeader *next = get_next_phys_block(blk1);
-    next->prev_phys_block = blk1;
+  BlockHeader *blk = reinterpret_cast<BlockHeader *>(ptr);
+  blk->size = size;
+  insert_block(blk);
+  count_free(size);
+}
+
+size_t JSMallocZ::get_allocated_size(void *ptr) {
+  uintptr_t start = (uintptr_t)ptr;
+  if(!has_side_table() || ptr == nullptr || !ptr_in_pool(start) || !JSMallocUtil::is_aligned(start, _mbs)) {
+    return 0;
   }
 
-  return blk1;
-}
+  size_t granule = (start - _block_start) / _mbs;
+  if((_start_bits[granule / 64] & (1UL << (granule % 64))) == 0) {
+    return 0;
+  }
 
-template<typename Config>
-BlockHeader *JSMallocBase<Config>::remove_block(BlockHeader *blk, Mapping mapping) {
-  uint32_t flat_mapping = flatten_mapping(mapping);
-  BlockHeader *target = blk;
-  BlockHeader *next_blk, *prev_blk;
+  return lookup_size(start);
+}
 
-  _list_lock.lock();
+bool JSMallocZ::has_side_table() {
+  return _start_bits != nullptr;
+}
 
-  if(blk == nullptr) {
-    target = _blocks[flat_mapping];
+void JSMallocZ::free_range(void *start_ptr, size_t size) {
+  if(!has_side_table()) {
+    free(start_ptr, size);
+    return;
   }
 
-  if(target == nullptr) {
-    _list_lock.unlock();
-    return nullptr;
+  if(start_ptr == nullptr || !ptr_in_pool((uintptr_t)start_ptr)) {
+    return;
   }
 
-  next_blk = blk_get_next(target);
-  prev_blk = blk_get_prev(target);
+  // The range is trusted, so any allocation marks inside it are dropped.
+  clear_allocated((uintptr_t)start_ptr, size);
 
-  // If the block is the head in the free-list, we need to update the head
-  if(_blocks[flat_mapping] == target) {
-    _blocks[flat_mapping] = next_blk;
-  }
+  BlockHeader *blk = reinterpret_cast<BlockHeader *>(start_ptr);
+  blk->size = size;
+  insert_block(blk);
+  count_free(size);
+}
 
-  if(next_blk != nullptr) {
-    blk_set_prev(next_blk, prev_blk);
-  } else {
-    // If the block is the last one in the free-list, we mark it as empty
-    update_bitmap(mapping, false);
-  }
+void JSMallocZ::free_batch(const JSMallocRange *ranges, size_t n) {
+  PendingLists lists = {};
 
-  if(prev_blk != nullptr) {
-    blk_set_next(prev_blk, next_blk);
+  for(size_t i = 0; i < n; i++) {
+    if(ranges[i].start == nullptr || !ptr_in_pool((uintptr_t)ranges[i].start)) {
+      continue;
+    }
+
+    if(has_side_table()) {
+      clear_allocated((uintptr_t)ranges[i].start, ranges[i].size);
+    }
+
+    BlockHeader *blk = reinterpret_cast<BlockHeader *>(ranges[i].start);
+    blk->size = ranges[i].size;
+    link_pending_block(lists, blk);
+    count_free(ranges[i].size);
   }
 
-  _list_lock.unlock();
+  publish_pending_lists(lists);
+}
+
+size_t JSMallocZ::side_table_size(size_t pool_size) {
+  size_t num_bitmap_words = (pool_size / _mbs + 63) / 64;
+  return 2 * num_bitmap_words * sizeof(uint64_t) + alignof(std::atomic<uint64_t>) + _mbs;
+}
 
-  // Mark the block as used (no longer free)
-  target->mark_used();
+void JSMallocZ::mark_allocated(uintptr_t start, size_t size) {
+  size_t first_granule = (start - _block_start) / _mbs;
+  size_t last_granule = first_granule + size / _mbs - 1;
 
-  return target;
+  _start_bits[first_granule / 64].fetch_or(1UL << (first_granule % 64));
+  _end_bits[last_granule / 64].fetch_or(1UL << (last_granule % 64));
 }
 
-template<typename Config>
-BlockHeader *JSMallocBase<Config>::split_block(BlockHeader *blk, size_t size) {
-  size_t remainder_size = blk->get_size() - _block_header_length - size;
+void JSMallocZ::clear_allocated(uintptr_t start, size_t size) {
+  size_t first_granule = (start - _block_start) / _mbs;
+  size_t end_granule = first_granule + size / _mbs;
 
-  // Needs to be checked before setting new size
-  bool is_last = blk->is_last();
+  for(size_t granule = first_granule; granule < end_granule; ) {
+    size_t word = granule / 64;
+    size_t bits = std::min(end_granule - granule, 64 - granule % 64);
+    uint64_t mask = (bits == 64) ? ~0UL : ((1UL << bits) - 1) << (granule % 64);
 
-  // Shrink blk to size
-  blk->size = size;
+    _start_bits[word].fetch_and(~mask);
+    _end_bits[word].fetch_and(~mask);
 
-  // Use a portion of blk's memory for the new block
-  BlockHeader *remainder_blk = reinterpret_cast<BlockHeader *>((uintptr_t)blk + _block_header_length + blk->get_size());
-  remainder_blk->size = remainder_size;
-  if(!Config::DeferredCoalescing) {
-    remainder_blk->prev_phys_block = blk;
+    granule += bits;
   }
+}
 
-  if(is_last) {
-    blk->unmark_last();
-    remainder_blk->mark_last();
-  } else if(!Config::DeferredCoalescing) {
-    BlockHeader *next_phys = get_next_phys_block(remainder_blk);
-    next_phys->prev_phys_block = remainder_blk;
+size_t JSMallocZ::lookup_size(uintptr_t start) {
+  size_t first_granule = (start - _block_start) / _mbs;
+  size_t word = first_granule / 64;
+  uint64_t bits = _end_bits[word] & (~0UL << (first_granule % 64));
+
+  // Blocks of up to 64 granules are found in at most two words.
+  while(bits == 0 && ++word < _num_bitmap_words) {
+    bits = _end_bits[word];
   }
 
-  return remainder_blk;
+  if(bits == 0) {
+    return 0;
+  }
+
+  size_t last_granule = word * 64 + JSMallocUtil::ffs(bits);
+  return (last_granule - first_granule + 1) * _mbs;
 }
 
-template<typename Config>
-BlockHeader *JSMallocBase<Config>::get_next_phys_block(BlockHeader *blk) {
+BlockHeader *JSMallocZ::get_next_phys_block(BlockHeader *blk, std::map<void *, size_t> &allocmap) {
   if(blk == nullptr) {
     return nullptr;
   }
 
-  uintptr_t next = (uintptr_t)blk + _block_header_length + blk->get_size();
+  size_t step;
+  if(allocmap.find(blk) == allocmap.end()) {
+    step = blk->get_size();
+  } else {
+    step = allocmap.find(blk)->second;
+  }
+
+  uintptr_t next = (uintptr_t)blk + step;
   return ptr_in_pool(next)
     ? (BlockHeader *)next
     : nullptr;
 }
 
-template<typename Config>
-BlockHeader *JSMallocBase<Config>::get_block_containing_address(uintptr_t address) {
-  uintptr_t target_addr = (uintptr_t)address;
-  BlockHeader *current = reinterpret_cast<BlockHeader *>(_block_start);
+// Returns the index of the first bit at or after from that is equal to set,
+// or limit if there is none.
+static size_t find_next_bit(const uint64_t *bits, size_t from, size_t limit, bool set) {
+  if(from >= limit) {
+    return limit;
+  }
 
-  while(current != nullptr) {
-    uintptr_t start = (uintptr_t)current;
-    uintptr_t end = start + _block_header_length + current->get_size();
+  size_t word = from / 64;
+  uint64_t invert = set ? 0 : ~0UL;
+  uint64_t current = (bits[word] ^ invert) & (~0UL << (from % 64));
 
-    if(target_addr >= start && target_addr <= end) {
-      return current;
+  while(current == 0) {
+    if(++word * 64 >= limit) {
+      return limit;
     }
 
-    current = get_next_phys_block(current);
+    current = bits[word] ^ invert;
   }
 
-  return nullptr;
-}
-
-template<typename Config>
-bool JSMallocBase<Config>::ptr_in_pool(uintptr_t ptr) {
-  return ptr >= _block_start && ptr < (_block_start + _pool_size);
+  return std::min(word * 64 + JSMallocUtil::ffs(current), limit);
 }
 
-template<typename Config>
-size_t JSMallocBase<Config>::align_size(size_t size) {
-  if(size == 0) {
-    size = 1;
-  }
-
-  return JSMallocUtil::align_up(size, _mbs);
-}
+void JSMallocZ::coalesce(const uint64_t *live_map, size_t num_threads) {
+  detach_free_lists(live_map);
 
-template<>
-BlockHeader *JSMallocBase<BaseConfig>::blk_get_next(BlockHeader *blk) {
-  return reinterpret_cast<BlockHeader *>(blk->f1);
-}
+  // Stripes cover whole words of the live map, so no two workers share one.
+  num_threads = std::max(num_threads, 1UL);
+  size_t limit = num_granules();
+  size_t stripe_size = std::max(JSMallocUtil::align_up((limit + num_threads - 1) / num_threads, 64), 64UL);
+  size_t num_stripes = (limit + stripe_size - 1) / stripe_size;
 
-template<>
-BlockHeader *JSMallocBase<BaseConfig>::blk_get_prev(BlockHeader *blk) {
-  return reinterpret_cast<BlockHeader *>(blk->f2);
-}
-
-template<>
-void JSMallocBase<BaseConfig>::blk_set_next(BlockHeader *blk, BlockHeader *next) {
-  blk->f1 = reinterpret_cast<uint64_t>(next);
-}
-
-template<>
-void JSMallocBase<BaseConfig>::blk_set_prev(BlockHeader *blk, BlockHeader *prev) {
-  blk->f2 = reinterpret_cast<uint64_t>(prev);
-}
-
-template <>
-Mapping JSMallocBase<BaseConfig>::get_mapping(size_t size) {
-  uint32_t fl = JSMallocUtil::ilog2(size);
-  uint32_t sl = (size >> (fl - _sl_index_log2)) ^ (1 << _sl_index_log2);
-  return {fl, sl};
-}
-
-template <>
-uint32_t JSMallocBase<BaseConfig>::flatten_mapping(Mapping mapping) {
-  return mapping.fl * _sl_index + mapping.sl;
-}
+  std::vector<CoalescingStripe> stripes(num_stripes);
+  for(size_t i = 0; i < num_stripes; i++) {
+    stripes[i].start = i * stripe_size;
+    stripes[i].end = std::min(limit, (i + 1) * stripe_size);
+  }
 
-template <>
-Mapping JSMallocBase<BaseConfig>::adjust_available_mapping(Mapping mapping) {
-  // If the first-level index is out of bounds, the request cannot be fulfilled
-  if(mapping.fl >= _fl_index) {
-    return {0, Mapping::UNABLE_TO_FIND};
+  std::vector<std::thread> workers;
+  for(size_t i = 1; i < num_stripes; i++) {
+    workers.emplace_back(&JSMallocZ::coalesce_stripe, this, live_map, std::ref(stripes[i]));
   }
 
-  uint32_t sl_map = _sl_bitmap[mapping.fl] & (~0UL << mapping.sl);
-  if(sl_map == 0) {
-    // No suitable block exists in the second level. Search in the next largest
-    // first-level instead
-    uint32_t fl_map = _fl_bitmap & (~0UL << (mapping.fl + 1));
-    if(fl_map == 0) {
-      // No suitable block exists
-      return {0, Mapping::UNABLE_TO_FIND};
-    }
+  if(num_stripes > 0) {
+    coalesce_stripe(live_map, stripes[0]);
+  }
 
-    mapping.fl = JSMallocUtil::ffs(fl_map);
-    sl_map = _sl_bitmap[mapping.fl];
+  for(std::thread &worker : workers) {
+    worker.join();
   }
 
-  mapping.sl = JSMallocUtil::ffs(sl_map);
+  // Stitch the runs at the stripe edges together, in address order.
+  PendingLists lists = {};
+  size_t open_start = limit;
 
-  return mapping;
-}
+  for(CoalescingStripe &stripe : stripes) {
+    if(stripe.leading_end == stripe.end) {
+      if(open_start == limit) {
+        open_start = stripe.start;
+      }
 
-template <>
-void JSMallocBase<BaseConfig>::update_bitmap(Mapping mapping, bool free_update) {
-  if(free_update) {
-    _fl_bitmap |= (1 << mapping.fl);
-    _sl_bitmap[mapping.fl] |= (1 << mapping.sl);
-  } else {
-    _sl_bitmap[mapping.fl] &= ~(1 << mapping.sl);
-    if(_sl_bitmap[mapping.fl] == 0) {
-      _fl_bitmap &= ~(1 << mapping.fl);
+      continue;
     }
-  }
-}
 
-JSMalloc *JSMalloc::create(void *pool, size_t pool_size, bool start_full) {
-  JSMalloc *jsmalloc = reinterpret_cast<JSMalloc *>(pool);
-  return new(jsmalloc) JSMalloc(reinterpret_cast<void *>((uintptr_t)pool + sizeof(JSMalloc)), pool_size - sizeof(JSMalloc), start_full);
-}
+    size_t leading_start = (open_start != limit) ? open_start : stripe.start;
+    if(leading_start < stripe.leading_end) {
+      add_coalesced_block(lists, leading_start, stripe.leading_end);
+    }
 
-void JSMalloc::free(void *ptr) {
-  if(ptr == nullptr) {
-    return;
+    open_start = (stripe.trailing_start < stripe.end) ? stripe.trailing_start : limit;
   }
 
-  if(!ptr_in_pool((uintptr_t)ptr)) {
-    return;
+  if(open_start != limit) {
+    add_coalesced_block(lists, open_start, limit);
   }
 
-  BlockHeader *blk = reinterpret_cast<BlockHeader *>((uintptr_t)ptr - _block_header_length);
-
-  BlockHeader *prev_blk = blk->prev_phys_block;
-  BlockHeader *next_blk = get_next_phys_block(blk);
+  // Concatenate the lists of all stripes, so that each free-list is
+  // published with a single swap.
+  for(CoalescingStripe &stripe : stripes) {
+    for(size_t i = 0; i < _num_lists + 1; i++) {
+      if(stripe.lists.heads[i] == nullptr) {
+        continue;
+      }
 
-  if(prev_blk != nullptr && prev_blk->is_free()) {
-    blk = coalesce_blocks(prev_blk, blk);
-  }
+      if(lists.tails[i] == nullptr) {
+        lists.heads[i] = stripe.lists.heads[i];
+      } else {
+        blk_set_next(lists.tails[i], stripe.lists.heads[i]);
+      }
+      lists.tails[i] = stripe.lists.tails[i];
+      lists.bytes[i] += stripe.lists.bytes[i];
+    }
 
-  if(next_blk != nullptr && next_blk->is_free()) {
-    blk = coalesce_blocks(blk, next_blk);
+    lists.fl_bitmap |= stripe.lists.fl_bitmap;
   }
 
-  insert_block(blk);
+  publish_pending_lists(lists);
 }
 
-size_t JSMalloc::get_allocated_size(void *address) {
-  BlockHeader *blk = reinterpret_cast<BlockHeader *>((uintptr_t)address - _block_header_length);
-  return blk->get_size();
-}
+void JSMallocZ::coalesce_stripe(const uint64_t *live_map, CoalescingStripe &stripe) {
+  stripe.lists = {};
+  stripe.leading_end = find_next_bit(live_map, stripe.start, stripe.end, true);
+  stripe.trailing_start = stripe.end;
 
-static uint32_t calculate_offset(BlockHeader *blk, uintptr_t start) {
-  return (blk == nullptr) ? std::numeric_limits<uint32_t>::max() : reinterpret_cast<uintptr_t>(blk) - start;
-}
+  if(stripe.leading_end == stripe.end) {
+    return;
+  }
 
-template<>
-BlockHeader *JSMallocBase<ZOptimizedConfig>::blk_get_next(BlockHeader *blk) {
-  return reinterpret_cast<BlockHeader *>(JSMallocUtil::from_offset(_block_start, true, blk->f1));
-}
+  // Runs touching either edge of the stripe are left to the stitching.
+  size_t granule = find_next_bit(live_map, stripe.leading_end, stripe.end, false);
+  while(granule < stripe.end) {
+    size_t end_granule = find_next_bit(live_map, granule, stripe.end, true);
+    if(end_granule == stripe.end) {
+      stripe.trailing_start = granule;
+      break;
+    }
 
-template<>
-BlockHeader *JSMallocBase<ZOptimizedConfig>::blk_get_prev(BlockHeader *blk) {
-  return reinterpret_cast<BlockHeader *>(JSMallocUtil::from_offset(_block_start, false, blk->f1));
+    add_coalesced_block(stripe.lists, granule, end_granule);
+    granule = find_next_bit(live_map, end_granule, stripe.end, false);
+  }
 }
 
-template<>
-void JSMallocBase<ZOptimizedConfig>::blk_set_next(BlockHeader *blk, BlockHeader *next) {
-  JSMallocUtil::set_offset(true, calculate_offset(next, _block_start), &blk->f1);
-}
+void JSMallocZ::begin_coalesce(const uint64_t *live_map) {
+  _coalesce_lock.lock();
 
-template<>
-void JSMallocBase<ZOptimizedConfig>::blk_set_prev(BlockHeader *blk, BlockHeader *prev) {
-  JSMallocUtil::set_offset(false, calculate_offset(prev, _block_start), &blk->f1);
-}
+  detach_free_lists(live_map);
 
-template <>
-Mapping JSMallocBase<ZOptimizedConfig>::get_mapping(size_t size) {
-  int fl = JSMallocUtil::ilog2(size);
-  int sl = size >> (fl - _sl_index_log2) ^ (1UL << _sl_index_log2);
-  size_t mapping = ((fl - _min_alloc_size_log2) << _sl_index_log2) + sl;
-  return {mapping > _num_lists ? _num_lists : mapping, 0};
-}
+  _coalesce_live_map = live_map;
+  _coalesce_cursor = 0;
+  _coalesce_run_start = NO_RUN;
 
-template <>
-uint32_t JSMallocBase<ZOptimizedConfig>::flatten_mapping(Mapping mapping) {
-  return mapping.fl;
+  _coalesce_lock.unlock();
 }
 
-template <>
-Mapping JSMallocBase<ZOptimizedConfig>::adjust_available_mapping(Mapping mapping) {
-  // If the first-level index is out of bounds, the request cannot be fulfilled
-  if(mapping.fl > _num_lists) {
-    return {0, Mapping::UNABLE_TO_FIND};
+bool JSMallocZ::coalesce_step(size_t quantum) {
+  // Another thread is already stepping, which counts as progress.
+  if(!_coalesce_lock.try_lock()) {
+    return true;
   }
 
-  uint64_t above_mapping = _fl_bitmap & (~0UL << mapping.fl);
-  if(above_mapping == 0) {
-    return {0, Mapping::UNABLE_TO_FIND};
+  if(_coalesce_live_map == nullptr) {
+    _coalesce_lock.unlock();
+    return false;
   }
 
-  mapping.fl = JSMallocUtil::ffs(above_mapping);
+  size_t limit = num_granules();
+  size_t step_end = std::min(limit, _coalesce_cursor + std::max(quantum, 1UL));
 
-  return mapping;
-}
+  while(_coalesce_cursor < step_end) {
+    if(_coalesce_run_start == NO_RUN) {
+      _coalesce_cursor = find_next_bit(_coalesce_live_map, _coalesce_cursor, step_end, false);
+      if(_coalesce_cursor < step_end) {
+        _coalesce_run_start = _coalesce_cursor;
+      }
+    } else {
+      // The run is only published once its end is known, since it might
+      // continue into the next quantum.
+      _coalesce_cursor = find_next_bit(_coalesce_live_map, _coalesce_cursor, step_end, true);
+      if(_coalesce_cursor < step_end) {
+        insert_block(init_coalesced_block(_coalesce_run_start, _coalesce_cursor));
+        _coalesce_run_start = NO_RUN;
+      }
+    }
+  }
 
-template <>
-void JSMallocBase<ZOptimizedConfig>::update_bitmap(Mapping mapping, bool free_update) {
-  if(free_update) {
-    _fl_bitmap |= (1UL << mapping.fl);
-  } else {
-    _fl_bitmap &= ~(1UL << mapping.fl);
+  bool done = _coalesce_cursor == limit;
+  if(done) {
+    if(_coalesce_run_start != NO_RUN) {
+      insert_block(init_coalesced_block(_coalesce_run_start, limit));
+    }
+
+    _coalesce_live_map = nullptr;
   }
-}
 
-template<>
-void JSMallocBase<ZOptimizedConfig>::insert_block(BlockHeader *blk) {
-  Mapping mapping = get_mapping(blk->get_size());
-  uint32_t flat_mapping = flatten_mapping(mapping);
-  BlockHeader *head, *new_head;
+  _coalesce_lock.unlock();
 
-  // Mark the block as free
-  blk->mark_free();
+  return !done;
+}
 
-  do {
-    head = _blocks[flat_mapping].load();
-    BlockHeader *offset = head;
+void JSMallocZ::detach_free_lists(const uint64_t *live_map) {
+  // The bitmap is cleared first, so that a block inserted concurrently
+  // either ends up in a detached list or sets its bit again.
+  _fl_bitmap = 0;
 
+  for(size_t i = 0; i < _num_lists + 1; i++) {
+    BlockHeader *head = _blocks[i].exchange(nullptr);
     if(head == nullptr) {
-      offset = reinterpret_cast<BlockHeader *>(std::numeric_limits<uint64_t>::max());
+      continue;
     }
 
-    blk_set_next(blk, reinterpret_cast<BlockHeader *>(JSMallocUtil::from_offset(_block_start, false, reinterpret_cast<uint64_t>(offset))));
+    BlockHeader *blk = reinterpret_cast<BlockHeader *>(JSMallocUtil::from_offset(_block_start, false, reinterpret_cast<uint64_t>(head)));
+    while(blk != nullptr) {
+      BlockHeader *next_blk = blk_get_next(blk);
+      count_free_bytes({i, 0}, blk->get_size(), false);
 
-    uint64_t version = 1;
-    new_head = reinterpret_cast<BlockHeader *>(version);
-    JSMallocUtil::set_offset(false, calculate_offset(blk, _block_start), reinterpret_cast<uint64_t *>(&new_head));
-  } while(!_blocks[flat_mapping].compare_exchange_strong(head, new_head));
+      size_t granule = ((uintptr_t)blk - _block_start) / _mbs;
+      if((live_map[granule / 64] & (1UL << (granule % 64))) != 0) {
+        insert_block(blk);
+      }
 
-  // Update bitmap to indicate level has a free block
-  _fl_bitmap.fetch_or(1UL << mapping.fl);
+      blk = next_blk;
+    }
+  }
 }
 
-template<>
-BlockHeader *JSMallocBase<ZOptimizedConfig>::remove_block(BlockHeader *target_blk, Mapping mapping) {
-  // blk should always be nullptr for the optimized allocator since we only
-  // allow removing the head of the free-list, not a block in the middle
-  (void)target_blk;
+BlockHeader *JSMallocZ::init_coalesced_block(size_t granule, size_t end_granule) {
+  uintptr_t start = _block_start + granule * _mbs;
+  size_t size = (end_granule - granule) * _mbs;
 
-  uint32_t flat_mapping = flatten_mapping(mapping);
-  BlockHeader *head = _blocks[flat_mapping].load();
-  if(head == nullptr) {
-    return nullptr;
+  // Objects in the run are dead, so their side table marks are stale.
+  if(has_side_table()) {
+    clear_allocated(start, size);
   }
 
-  uint64_t head_bits = reinterpret_cast<uint64_t>(head);
-  uint32_t version = JSMallocUtil::get_bits(head_bits, true);
-  BlockHeader *actual_head = reinterpret_cast<BlockHeader *>(JSMallocUtil::from_offset(_block_start, false, head_bits));
+  BlockHeader *blk = reinterpret_cast<BlockHeader *>(start);
+  blk->size = size;
+  count_stat(stats_class(get_mapping(size)), StatCoalesces);
 
-  BlockHeader *next_blk = (actual_head == nullptr)
-    ? nullptr
-    : blk_get_next(actual_head);
+  return blk;
+}
 
-  BlockHeader *new_head = reinterpret_cast<BlockHeader *>(version + 1);
-  JSMallocUtil::set_offset(false, calculate_offset(next_blk, _block_start), reinterpret_cast<uint64_t *>(&new_head));
+void JSMallocZ::add_coalesced_block(PendingLists &lists, size_t granule, size_t end_granule) {
+  link_pending_block(lists, init_coalesced_block(granule, end_granule));
+}
 
-  if(!_blocks[flat_mapping].compare_exchange_strong(head, new_head)) {
-    return nullptr;
-  }
+void JSMallocZ::link_pending_block(PendingLists &lists, BlockHeader *blk) {
+  blk->mark_free();
+  blk_set_next(blk, nullptr);
 
-  if(next_blk == nullptr) {
-    _fl_bitmap.fetch_and(~(1UL << mapping.fl));
-  }
+  Mapping mapping = get_mapping(blk->get_size());
+  uint32_t flat_mapping = flatten_mapping(mapping);
 
-  return actual_head;
+  if(lists.tails[flat_mapping] == nullptr) {
+    lists.heads[flat_mapping] = blk;
+  } else {
+    blk_set_next(lists.tails[flat_mapping], blk);
+  }
+  lists.tails[flat_mapping] = blk;
+  lists.bytes[flat_mapping] += blk->get_size();
+  lists.fl_bitmap |= 1UL << mapping.fl;
 }
 
-JSMallocZ *JSMallocZ::create(void *pool, size_t pool_size, bool start_full) {
-  JSMallocZ *jsmallocz = reinterpret_cast<JSMallocZ *>(pool);
-  return new(jsmallocz) JSMallocZ(reinterpret_cast<void *>((uintptr_t)pool + sizeof(JSMallocZ)), pool_size - sizeof(JSMallocZ), start_full);
-}
+void JSMallocZ::publish_pending_lists(PendingLists &lists) {
+  for(size_t i = 0; i < _num_lists + 1; i++) {
+    if(lists.heads[i] == nullptr) {
+      continue;
+    }
 
-void JSMallocZ::free(void *ptr, size_t size) {
-  if(ptr == nullptr) {
-    return;
-  }
+    // Blocks freed while coalescing are appended behind the new blocks.
+    count_free_bytes({i, 0}, lists.bytes[i], true);
 
-  if(!ptr_in_pool((uintptr_t)ptr)) {
-    return;
-  }
+    BlockHeader *head, *new_head;
+    while(true) {
+      head = _blocks[i].load();
+      uint64_t head_bits = reinterpret_cast<uint64_t>(head);
+      BlockHeader *actual_head = (head == nullptr)
+        ? nullptr
+        : reinterpret_cast<BlockHeader *>(JSMallocUtil::from_offset(_block_start, false, head_bits));
+      blk_set_next(lists.tails[i], actual_head);
 
-  BlockHeader *blk = reinterpret_cast<BlockHeader *>(ptr);
-  blk->size = size;
-  insert_block(blk);
-}
+      uint64_t version = (head == nullptr) ? 1 : JSMallocUtil::get_bits(head_bits, true) + 1;
+      new_head = reinterpret_cast<BlockHeader *>(version);
+      JSMallocUtil::set_offset(false, JSMallocUtil::calculate_offset(_block_start, lists.heads[i]), reinterpret_cast<uint64_t *>(&new_head));
 
-void JSMallocZ::free_range(void *start_ptr, size_t size) {
-  free(start_ptr, size);
-}
+      if(_blocks[i].compare_exchange_strong(head, new_head)) {
+        break;
+      }
 
-BlockHeader *JSMallocZ::get_next_phys_block(BlockHeader *blk, std::map<void *, size_t> &allocmap) {
-  if(blk == nullptr) {
-    return nullptr;
+      count_stat(stats_class({i, 0}), StatCASRetries);
+    }
   }
 
-  size_t step;
-  if(allocmap.find(blk) == allocmap.end()) {
-    step = blk->get_size();
-  } else {
-    step = allocmap.find(blk)->second;
-  }
+  _fl_bitmap.fetch_or(lists.fl_bitmap);
+}
 
-  uintptr_t next = (uintptr_t)blk + step;
-  return ptr_in_pool(next)
-    ? (BlockHeader *)next
-    : nullptr;
+size_t JSMallocZ::num_granules() {
+  return _pool_size / _mbs;
 }
 
 void JSMallocZ::coalesce(std::map<void *, size_t> &allocmap) {
@@ -672,6 +695,7 @@ void JSMallocZ::coalesce(std::map<void *, size_t> &allocmap) {
   _fl_bitmap = 0;
   for(size_t i = 0; i < _num_lists + 1; i++) {
     _blocks[i] = nullptr;
+    _free_bytes[i] = 0;
   }
 
   BlockHeader *current_blk = reinterpret_cast<BlockHeader *>(_block_start);
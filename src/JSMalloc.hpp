@@ -7,21 +7,36 @@
 #include <atomic>
 #include <cstddef>
 #include <cstdint>
+#include <cstdio>
 #include <limits>
 #include <map>
 #include <mutex>
+#include <type_traits>
 
+// Only size is part of the header of a used block, the other fields overlap
+// the start of the payload and are only valid while the block is free.
+// Configurations with immediate coalescing also end every free block with a
+// copy of its size (a boundary tag), which lets the next block find it.
 class BlockHeader {
 private:
-  static const size_t _BlockFreeMask = 1;
-  static const size_t _BlockLastMask = 1 << 1;
+  // The flags are kept in the upper bits, since payload sizes are not always
+  // a multiple of 16.
+  static const size_t _BlockFreeMask = 1UL << 63;
+  static const size_t _BlockLastMask = 1UL << 62;
+  // The whole pages inside the block have been returned to the OS and read
+  // back as zero, until the block is written to or coalesced.
+  static const size_t _BlockPurgedMask = 1UL << 61;
+  // The block was already free at the previous purge epoch.
+  static const size_t _BlockIdleMask = 1UL << 60;
+  // The previous physical block is free and ends with a boundary tag.
+  static const size_t _BlockPrevFreeMask = 1UL << 59;
+  static const size_t _BlockFlagsMask = _BlockFreeMask | _BlockLastMask | _BlockPurgedMask | _BlockIdleMask | _BlockPrevFreeMask;
 
 public: 
   // size does not include header size, represents usable chunk of the block.
   size_t size;
   uint64_t f1;
   uint64_t f2;
-  BlockHeader *prev_phys_block;
 
   size_t get_size();
 
@@ -33,24 +48,187 @@ public:
 
   void mark_last();
   void unmark_last();
+
+  bool is_purged();
+  void mark_purged();
+
+  bool is_idle();
+  void mark_idle();
+
+  // Clears the purged and idle flags, e.g. when the block is written to.
+  void mark_dirty();
+
+  bool is_prev_free();
+  void mark_prev_free();
+  void unmark_prev_free();
 };
 
-struct Mapping;
+// Contains first- and second-level index to segregated lists
+// In the case of the optimized version, only the fl mapping is used.
+struct Mapping {
+  static const uint32_t UNABLE_TO_FIND = std::numeric_limits<uint32_t>::max();
+  size_t fl, sl;
+};
 
 struct JSMallocAlloc {
   void *addr;
   size_t size;
 };
 
+struct JSMallocRange {
+  void *start;
+  size_t size;
+};
+
+struct JSMallocRegion {
+  uintptr_t start;
+  size_t size;
+};
+
+// The counters of one size class, which covers the blocks of one first-level
+// index. Bytes do not include block headers.
+struct JSMallocClassStats {
+  // The smallest block size in the class.
+  size_t min_size;
+  uint64_t allocs;
+  uint64_t frees;
+  uint64_t splits;
+  uint64_t coalesces;
+  uint64_t cas_retries;
+  uint64_t lock_waits;
+  // The total size of all blocks that have been allocated, and of the
+  // requests they were allocated for.
+  size_t allocated_bytes;
+  size_t requested_bytes;
+  // Only approximate for a single class, since blocks can be freed in another
+  // class than the one they were allocated in.
+  size_t live_bytes;
+  size_t free_bytes;
+
+  void add(const JSMallocClassStats &other);
+};
+
+// A snapshot of the counters of one or more allocators, along the lines of
+// mallinfo2. Counters are read while other threads keep running, so the
+// snapshot is only exact if the allocators are idle.
+struct JSMallocStats {
+  static const size_t MaxClasses = 64;
+
+  // The size of the pool and all regions.
+  size_t pool_bytes;
+  JSMallocClassStats total;
+  size_t num_classes;
+  JSMallocClassStats classes[MaxClasses];
+
+  // Adds the counters of other, whose classes must cover the same sizes.
+  void add(const JSMallocStats &other);
+
+  // Writes the totals, followed by one line for every class that is in use.
+  void print(FILE *out);
+};
+
+// The external fragmentation of the free memory of one or more allocators,
+// which is read from the bitmaps and the byte counts of the free-lists.
+struct JSMallocFragmentation {
+  size_t free_bytes;
+  // Lock-free free-lists are not walked, so for them this is only the
+  // smallest size that fits in the largest non-empty free-list.
+  size_t largest_free_block;
+  // Free bytes per size class, with the classes of JSMallocStats.
+  size_t num_classes;
+  size_t class_min_size[JSMallocStats::MaxClasses];
+  size_t class_free_bytes[JSMallocStats::MaxClasses];
+
+  // 0 if all free memory is in the largest block, and approaches 1 as less
+  // of it can be used for a single allocation.
+  double index();
+
+  // Adds the free memory of another allocator. The largest block is the
+  // largest of either, since blocks of different allocators cannot be merged.
+  void add(const JSMallocFragmentation &other);
+};
+
+// Supplies additional memory regions to an allocator whose pool is exhausted.
+// map_region should return size bytes aligned to alignment, or nullptr. The
+// bytes have to be a mapping of their own, since a region that cannot be used
+// is given back with munmap.
+struct JSMallocRegionProvider {
+  void *(*map_region)(void *context, size_t size, size_t alignment);
+  void *context;
+};
+
+// Maps the chunks of a set of regions to a small value, e.g. the index of the
+// region they belong to. Regions must be aligned to and be a multiple of
+// ChunkSize, so that every chunk belongs to exactly one region. Chunks are
+// never removed, which lets lookups and inserts be done without locks.
+class JSMallocRegionMap {
+public:
+  static const size_t ChunkShift = 26;
+  static const size_t ChunkSize = 1UL << ChunkShift;
+  static const size_t Capacity = 2048;
+  static const uint32_t NOT_FOUND = std::numeric_limits<uint32_t>::max();
+
+  void clear();
+
+  // Returns false if the map is too full to register all chunks.
+  bool insert(uintptr_t start, size_t size, uint16_t value);
+  uint32_t lookup(uintptr_t address);
+
+private:
+  // Each entry packs (chunk number << 16) | (value + 1), where 0 means empty.
+  std::atomic<uint64_t> _entries[Capacity];
+};
+
+// The header of the statistics counters of one thread for one allocator,
+// which follow it. A block is only written by the thread that holds it, so
+// counting needs no atomic read-modify-writes. Blocks are handed back when
+// their thread exits or needs the cache entry for another allocator, and are
+// then reused by other threads, since only the sums of the counters are read.
+struct JSMallocThreadStats {
+  JSMallocThreadStats *next;
+  std::atomic<bool> in_use;
+};
+
+// The blocks that the calling thread holds, for a few allocators. Allocators
+// are told apart by ids, since a new one can be placed at the address of an
+// old one.
+class JSMallocThreadStatsCache {
+public:
+  static const size_t NumEntries = 16;
+
+  static uint64_t next_id();
+
+  // Returns nullptr if no block is cached for the allocator.
+  static JSMallocThreadStats *lookup(uint64_t id);
+
+  // Caches a block that the thread holds, and hands back the one it replaces.
+  static void insert(uint64_t id, JSMallocThreadStats *stats);
+
+private:
+  struct Entry {
+    uint64_t id;
+    JSMallocThreadStats *stats;
+  };
+
+  struct Cache {
+    Entry entries[NumEntries];
+    // Whether the blocks are handed back when the thread exits.
+    bool registered;
+  };
+
+  static Cache &cache();
+
+  static void create_key();
+  static void release(void *cache);
+};
+
 constexpr size_t BLOCK_HEADER_LENGTH_SMALL = 0;
-constexpr size_t BLOCK_HEADER_LENGTH = sizeof(BlockHeader);
+constexpr size_t BLOCK_HEADER_LENGTH = sizeof(BlockHeader::size);
 
+// The members are defined in JSMalloc.inline.hpp, which has to be included to
+// use any other Config than BaseConfig and ZOptimizedConfig.
 template <typename Config>
 class JSMallocBase {
-private:
-  size_t _internal_fragmentation = 0;
-  size_t _allocated = 0;
-
 public:
   JSMallocBase(void *pool, size_t pool_size, bool start_full);
 
@@ -58,8 +236,39 @@ public:
   void *allocate(size_t size);
   JSMallocAlloc debug_allocate(size_t size);
 
+  // Allocates size bytes aligned to alignment, which must be a power of two.
+  // The leading slack of the found block is returned as a free block.
+  void *allocate_aligned(size_t size, size_t alignment);
+
+  // Allocates up to n blocks of size bytes by carving them out of a single
+  // free block, which only requires one list removal. The rest of that block
+  // is returned as one remainder. Returns the number of blocks written to
+  // out, which is less than n if no block large enough for the whole batch
+  // could be found.
+  size_t allocate_batch(size_t size, size_t n, void **out);
+
+  // The fraction of all bytes allocated so far that were not requested.
   double internal_fragmentation();
 
+  // Sums the per-thread counters of every size class into stats. Blocks in
+  // thread caches and allocation buffers count as live, and blocks that are
+  // reclaimed by JSMallocZ::coalesce are not counted as freed.
+  void stats(JSMallocStats &stats);
+
+  // Requires Config::CollectStats for the byte counts of the free-lists.
+  // Only the lists marked in the bitmaps are read, and only the largest of
+  // them is walked, so this is cheap enough to be called periodically.
+  void fragmentation(JSMallocFragmentation &fragmentation);
+
+  // Lets the allocator add new regions from provider when no suitable block
+  // can be found. Only supported for configurations with immediate
+  // coalescing, since every region ends with a block marked as last.
+  void set_region_provider(JSMallocRegionProvider provider);
+  size_t num_regions();
+
+  // A provider callback that maps anonymous memory.
+  static void *mmap_region(void *context, size_t size, size_t alignment);
+
   // TODO: Should be removed. Used for debugging.
   void print_phys_blks();
   void print_blk(BlockHeader *blk);
@@ -69,40 +278,152 @@ public:
 protected:
   JSMallocBase() {}
 
-  static const size_t _min_alloc_size_log2 = 4;
-  static const size_t _min_alloc_size = 2 << _min_alloc_size_log2;
+  static const size_t _min_alloc_size_log2 = __builtin_ctzl(Config::MBS);
   static const size_t _alignment = 8;
 
   static const size_t _fl_index = Config::FirstLevelIndex;
   static const size_t _sl_index_log2 = Config::SecondLevelIndexLog2;
-  static const size_t _sl_index = (1 << _sl_index_log2);
+  static const size_t _sl_index = (1UL << _sl_index_log2);
   static const size_t _num_lists = _fl_index * _sl_index;
   static const size_t _mbs = Config::MBS;
   static const size_t _block_header_length = Config::BlockHeaderLength;
 
+  // Second-level bitmaps are only as wide as they need to be.
+  typedef typename std::conditional<(_sl_index > 32), uint64_t, uint32_t>::type SLBitmap;
+
+  static_assert(_mbs >= _alignment && (_mbs & (_mbs - 1)) == 0, "MBS must be a power of two of at least 8");
+  static_assert(_block_header_length % _alignment == 0, "The header length must keep payloads word-aligned");
+  static_assert(_sl_index_log2 <= 6, "Second-level bitmaps are at most 64 bits wide");
+  static_assert(!Config::UseSecondLevels || _fl_index <= 64, "The first-level bitmap is 64 bits wide");
+  static_assert(Config::UseSecondLevels || _num_lists < 64, "Without second levels, every list and the large-list share the 64-bit first-level bitmap");
+  static_assert(Config::UseSecondLevels || _mbs >= _sl_index, "Without second levels, the smallest size class must be split into _sl_index lists");
+  static_assert(Config::DeferredCoalescing != Config::UseSecondLevels, "Lock-free free-lists use a single level, and locked free-lists use two");
+  static_assert(Config::DeferredCoalescing || _block_header_length >= sizeof(BlockHeader::size), "Immediate coalescing needs the size in the header");
+  static_assert(!Config::DeferredCoalescing || _mbs >= 2 * sizeof(uint64_t), "Blocks without a header must hold the size and the links");
+
+  // Free blocks have to hold the fields of BlockHeader that are not part of
+  // the header, and the boundary tag if there is one.
+  static const size_t _footer_length = Config::DeferredCoalescing ? 0 : sizeof(uint64_t);
+  static const size_t _min_payload_size = Config::DeferredCoalescing ? 1 : sizeof(BlockHeader) - _block_header_length + _footer_length;
+
+  // The smallest block that can be split off, including its header.
+  static const size_t _min_block_size = ((_block_header_length + _min_payload_size + _mbs - 1) & ~(_mbs - 1));
+
+  // The initial region, which is given to the constructor.
   uintptr_t _block_start;
   size_t _pool_size;
 
+  // Regions after the initial one are aligned to JSMallocRegionMap::ChunkSize
+  // and registered in _region_map, which gives O(1) pointer-to-region lookups.
+  static const size_t _max_regions = 64;
+  static const size_t _max_region_size = 1UL << 30;
+
+  JSMallocRegion _regions[_max_regions];
+  std::atomic<size_t> _num_regions;
+  size_t _next_region_size;
+  JSMallocRegionProvider _region_provider;
+  JSMallocRegionMap _region_map;
+  std::mutex _grow_lock;
+
   std::atomic<uint64_t> _fl_bitmap;
-  uint32_t _sl_bitmap[Config::UseSecondLevels ? _fl_index : 0];
+  SLBitmap _sl_bitmap[Config::UseSecondLevels ? _fl_index : 0];
 
   // We add an extra list for the optimized "large-list".
   std::atomic<BlockHeader*> _blocks[_num_lists + 1];
 
-  std::mutex _list_lock;
+  // Configurations with immediate coalescing protect their free-lists with
+  // one lock per first-level index. Block headers are protected by a set of
+  // striped locks, indexed by the address of the header, which have to be
+  // held when modifying a header or reading the header of a neighbour. The
+  // stripe locks are always taken before any list lock.
+  static const size_t _num_list_locks = Config::DeferredCoalescing ? 0 : _fl_index;
+  static const size_t _num_phys_locks = Config::DeferredCoalescing ? 1 : 64;
+  static const size_t _phys_lock_shift = 12;
+  static const size_t _max_locked_blocks = 5;
+
+  std::mutex _list_locks[_num_list_locks];
+  std::mutex _phys_locks[_num_phys_locks];
+
+  // Number of blocks that are temporarily outside of the free-lists while
+  // being split or coalesced. A failed search is only reported if no blocks
+  // are in flight. The counters are per thread slot to avoid contention.
+  struct alignas(64) InFlightCounter {
+    std::atomic<size_t> count;
+  };
+
+  static const size_t _num_thread_slots = 16;
+  InFlightCounter _in_flight[_num_thread_slots];
+
+  // Statistics are counted per thread and size class, where the last class
+  // holds the blocks above the largest first-level index. Classes do not
+  // follow the second level, since counters for every free-list would take
+  // over 70 KiB per thread and allocator with BaseConfig. Frees are counted
+  // by the freeing thread, so the counters of a single thread may wrap
+  // around, but their sums do not.
+  enum StatCounter {
+    StatAllocs,
+    StatFrees,
+    StatSplits,
+    StatCoalesces,
+    StatCASRetries,
+    StatLockWaits,
+    StatAllocatedBytes,
+    StatRequestedBytes,
+    StatFreedBytes,
+    NumStatCounters
+  };
+
+  static const size_t _num_stat_classes = _fl_index + 1;
+  static_assert(_num_stat_classes <= JSMallocStats::MaxClasses, "Every class has to fit in a snapshot");
+
+  struct StatsBlock : JSMallocThreadStats {
+    std::atomic<uint64_t> counters[_num_stat_classes][NumStatCounters];
+    // Waits for the stripe locks, which do not belong to a class.
+    std::atomic<uint64_t> phys_lock_waits;
+  };
+
+  // Every block that has been mapped for this allocator. Blocks are never
+  // removed, so the list can be walked without locks.
+  std::atomic<JSMallocThreadStats *> _thread_stats;
+  uint64_t _stats_id;
+
+  // The number of bytes in every free-list.
+  std::atomic<size_t> _free_bytes[Config::CollectStats ? _num_lists + 1 : 0];
 
   void initialize(void *pool, size_t pool_size, bool start_full);
 
+  // Adds a region large enough for an allocation of size bytes. Returns true
+  // if the allocation should be retried, which is also the case if another
+  // thread has added a region since num_regions_seen was read.
+  bool grow(size_t size, size_t num_regions_seen);
+
   void insert_block(BlockHeader *blk);
 
   BlockHeader *find_block(size_t size);
 
+  // The last list of ZOptimizedConfig holds every block above the largest
+  // size class, in no particular order, so its head might not fit. Searches
+  // that list for a block of at least aligned_size, starting from blk.
+  BlockHeader *find_large_block(BlockHeader *blk, size_t aligned_size);
+
   // Coalesces two blocks into one and returns a pointer to the coalesced block.
+  // Neither of the blocks may be in a free-list.
   BlockHeader *coalesce_blocks(BlockHeader *blk1, BlockHeader *blk2);
 
   // If blk is not nullptr, blk is removed, otherwise the head of the free-list
-  // corresponding to mapping is removed.
-  BlockHeader *remove_block(BlockHeader *blk, Mapping mapping);
+  // corresponding to mapping is removed if it is at least min_size bytes.
+  // Returns nullptr if blk is no longer free or no longer in the free-list
+  // corresponding to mapping.
+  BlockHeader *remove_block(BlockHeader *blk, Mapping mapping, size_t min_size = 0);
+
+  // Configurations with deferred coalescing only ever push and pop the heads
+  // of their free-lists, which is done with a CAS on a versioned head.
+  void insert_block_lock_free(BlockHeader *blk);
+  BlockHeader *remove_block_lock_free(Mapping mapping, size_t min_size);
+
+  // Removes the head of the list that size itself maps to if it fits, which
+  // find_block otherwise skips by rounding up to the next size class.
+  BlockHeader *find_exact_block(size_t size, Mapping good_fit_mapping);
 
   // size is the number of bytes that should remain in blk. blk is shrinked to
   // size and a new block with the remaining blk->size - size is returned.
@@ -110,13 +431,45 @@ protected:
 
   BlockHeader *get_next_phys_block(BlockHeader *blk);
 
+  // Returns the previous physical block if it is free, otherwise nullptr.
+  BlockHeader *get_prev_phys_block(BlockHeader *blk);
+
+  // Writes the boundary tag of blk if it is free, and updates the prev-free
+  // flag of the next block. The stripe of the next block has to be locked.
+  void set_boundary_tag(BlockHeader *blk, bool free);
+
   BlockHeader *get_block_containing_address(uintptr_t address);
 
   bool ptr_in_pool(uintptr_t ptr);
 
+  // Locks the stripes covering the given headers (nullptr entries are
+  // ignored) in ascending order. At most _max_locked_blocks headers can be
+  // passed. Returns the number of distinct stripes written to stripes.
+  size_t lock_phys_blocks(BlockHeader *const *blks, size_t n, size_t *stripes);
+  void unlock_phys_blocks(const size_t *stripes, size_t num_stripes);
+
+  size_t thread_slot();
+  std::atomic<size_t> &in_flight_counter();
+  bool blocks_in_flight();
+
+  // The block of the calling thread, which is claimed on first use.
+  StatsBlock *thread_stats();
+  StatsBlock *claim_thread_stats();
+  static void add_stat(std::atomic<uint64_t> &counter, uint64_t n);
+
+  size_t stats_class(Mapping mapping);
+  size_t stats_class_min_size(size_t stats_class);
+  void count_stat(size_t stats_class, StatCounter counter, uint64_t n = 1);
+  void count_allocation(size_t allocated_size, size_t requested_size);
+  void count_free(size_t size);
+  void count_free_bytes(Mapping mapping, size_t size, bool insert);
+
+  // Takes the lock of a free-list, and counts the wait if it is held.
+  void lock_list(size_t fl);
+
   size_t align_size(size_t size);
 
-  // The following methods are calculated differently depending on the configuration.
+  // The following methods are calculated from the geometry of the configuration.
   inline BlockHeader *blk_get_next(BlockHeader *blk);
   inline BlockHeader *blk_get_prev(BlockHeader *blk);
   inline void blk_set_next(BlockHeader *blk, BlockHeader *next);
@@ -132,9 +485,11 @@ class BaseConfig {
 public:
   static const size_t FirstLevelIndex = 32;
   static const size_t SecondLevelIndexLog2 = 5;
-  static const size_t MBS = 32;
+  static const size_t MBS = 16;
   static const bool UseSecondLevels = true;
   static const bool DeferredCoalescing = false;
+  static const bool ExactFitProbe = true;
+  static const bool CollectStats = true;
   static const size_t BlockHeaderLength = BLOCK_HEADER_LENGTH;
 };
 
@@ -145,38 +500,235 @@ public:
   static const size_t MBS = 16;
   static const bool UseSecondLevels = false;
   static const bool DeferredCoalescing = true;
+  static const bool ExactFitProbe = true;
+  static const bool CollectStats = true;
   static const size_t BlockHeaderLength = BLOCK_HEADER_LENGTH_SMALL;
 };
 
-class JSMalloc : public JSMallocBase<BaseConfig> {
+// The allocator for configurations with immediate coalescing, which can free
+// blocks from their address alone. JSMalloc is the one for BaseConfig.
+template<typename Config>
+class JSMallocT : public JSMallocBase<Config> {
+  friend class JSMallocThreadCache;
+
+  static_assert(!Config::DeferredCoalescing, "Blocks are freed and resized with immediate coalescing");
+
 public:
-  JSMalloc(void *pool, size_t pool_size, bool start_full = false)
-    : JSMallocBase(pool, pool_size, start_full) {}
+  using JSMallocBase<Config>::allocate;
+
+  JSMallocT(void *pool, size_t pool_size, bool start_full = false)
+    : JSMallocBase<Config>(pool, pool_size, start_full) {}
 
-  static JSMalloc *create(void *pool, size_t pool_size, bool start_full = false);
+  static JSMallocT *create(void *pool, size_t pool_size, bool start_full = false);
 
   void free(void *ptr);
 
+  // Resizes the block at ptr to size bytes. Shrinking splits off the tail of
+  // the block, and growing absorbs the next physical block if it is free and
+  // large enough, both without moving the data. Otherwise the data is moved
+  // to a new block. Returns nullptr and leaves ptr untouched on failure.
+  void *reallocate(void *ptr, size_t size);
+
+  // Same as allocate, but the memory is zeroed. Pages that have been purged
+  // are known to be zero and are not touched.
+  void *allocate_zeroed(size_t size);
+
+  // Whole pages inside free blocks of at least min_block_size bytes are
+  // returned to the OS with madvise once they have stayed free for a full
+  // purge epoch. An epoch ends when threshold bytes have been freed into such
+  // blocks or decay_ms milliseconds have passed since the previous epoch.
+  // Purging is disabled by default, and requires that the pool and all
+  // regions are private anonymous memory.
+  void set_purge_policy(size_t threshold, uint64_t decay_ms, size_t min_block_size);
+
+  // Ends the current purge epoch. If all is true, every large free block is
+  // purged regardless of how long it has been free. Returns the number of
+  // bytes purged.
+  size_t purge(bool all = false);
+
+  // Total number of bytes returned to the OS.
+  size_t purged_bytes();
+
   size_t get_allocated_size(void *address);
+
+protected:
+  using JSMallocBase<Config>::_fl_index;
+  using JSMallocBase<Config>::_sl_index;
+  using JSMallocBase<Config>::_block_header_length;
+  using JSMallocBase<Config>::_footer_length;
+  using JSMallocBase<Config>::_min_block_size;
+  using JSMallocBase<Config>::_max_locked_blocks;
+  using JSMallocBase<Config>::_num_phys_locks;
+  using JSMallocBase<Config>::_phys_lock_shift;
+  using JSMallocBase<Config>::_phys_locks;
+  using JSMallocBase<Config>::_list_locks;
+  using JSMallocBase<Config>::_fl_bitmap;
+  using JSMallocBase<Config>::_blocks;
+
+  using JSMallocBase<Config>::get_mapping;
+  using JSMallocBase<Config>::flatten_mapping;
+  using JSMallocBase<Config>::align_size;
+  using JSMallocBase<Config>::ptr_in_pool;
+  using JSMallocBase<Config>::insert_block;
+  using JSMallocBase<Config>::remove_block;
+  using JSMallocBase<Config>::split_block;
+  using JSMallocBase<Config>::coalesce_blocks;
+  using JSMallocBase<Config>::get_next_phys_block;
+  using JSMallocBase<Config>::get_prev_phys_block;
+  using JSMallocBase<Config>::blk_get_next;
+  using JSMallocBase<Config>::lock_phys_blocks;
+  using JSMallocBase<Config>::unlock_phys_blocks;
+  using JSMallocBase<Config>::in_flight_counter;
+  using JSMallocBase<Config>::count_allocation;
+  using JSMallocBase<Config>::count_free;
+
+private:
+  bool resize_in_place(BlockHeader *blk, size_t aligned_size);
+
+  size_t _purge_threshold = 0;
+  uint64_t _purge_decay_ms = 0;
+  size_t _purge_min_block_size = 0;
+
+  std::atomic<size_t> _dirty_bytes{0};
+  std::atomic<uint64_t> _last_purge_ms{0};
+  std::atomic<size_t> _purged_bytes{0};
+  std::mutex _purge_lock;
+
+  // Called after freeing size bytes into a block of at least
+  // _purge_min_block_size bytes. Starts a new epoch if the policy says so.
+  void maybe_purge(size_t size);
+
+  // Must be called with _purge_lock held.
+  size_t purge_free_blocks(bool all);
+
+  // The whole pages in the payload of blk that are purged, which leaves out
+  // the free-list links and the boundary tag.
+  void get_purge_range(BlockHeader *blk, uintptr_t *start, uintptr_t *end);
 };
 
+typedef JSMallocT<BaseConfig> JSMalloc;
+
 class JSMallocZ : public JSMallocBase<ZOptimizedConfig> {
+  friend class JSMallocAllocationBuffer;
+
 public:
-  JSMallocZ(void *pool, size_t pool_size, bool start_full)
-    : JSMallocBase(pool, pool_size, start_full) {}
+  // With side_table set, the first and last granule (MBS bytes) of every
+  // allocated block are marked in two bitmaps, which are carved from the end
+  // of the pool. Blocks can then be sized, validated and freed from their
+  // address alone, while still having no header. The table costs two bits
+  // per granule.
+  JSMallocZ(void *pool, size_t pool_size, bool start_full, bool side_table = false);
 
-  static JSMallocZ *create(void *pool, size_t pool_size, bool start_full);
+  static JSMallocZ *create(void *pool, size_t pool_size, bool start_full, bool side_table = false);
 
+  void *allocate(size_t size);
+  void *allocate_aligned(size_t size, size_t alignment);
+  size_t allocate_batch(size_t size, size_t n, void **out);
+
+  // size is the size that was requested when ptr was allocated. With the side
+  // table, size is ignored and looked up instead.
   void free(void *ptr, size_t size);
 
+  // Requires the side table. Pointers that are not the start of an allocated
+  // block, e.g. double frees, are ignored.
+  void free(void *ptr);
+
+  // Requires the side table. Returns 0 if ptr is not the start of an
+  // allocated block.
+  size_t get_allocated_size(void *ptr);
+
+  bool has_side_table();
+
   // This assumes that the range that is described by (address -> (address + range))
   // contains one allocated block and no more.
   void free_range(void *start_ptr, size_t size);
 
+  // Same as calling free_range for every range, but the ranges are linked
+  // into private chains per free-list first, so that each free-list head and
+  // the bitmap are only updated once.
+  void free_batch(const JSMallocRange *ranges, size_t n);
+
   // Manually trigger block coalescing.
   void coalesce(std::map<void *, size_t> &allocmap);
 
+  // Rebuilds the free-lists from live_map, which has one bit per granule (MBS
+  // bytes) of the pool, starting at the first block. A set bit means that the
+  // granule belongs to a live object, and every run of clear bits becomes one
+  // free block. The pool is split into num_threads stripes that are scanned
+  // concurrently, and the runs crossing stripe boundaries are stitched
+  // together afterwards. The old free-lists describe dead memory as well, so
+  // they are emptied first and allocations fail until the new lists are
+  // published. Blocks freed in the meantime are kept.
+  void coalesce(const uint64_t *live_map, size_t num_threads = 1);
+
+  // Incremental version of coalesce, which keeps the allocator usable while
+  // the pool is swept. begin_coalesce empties the free-lists, and every call
+  // to coalesce_step scans at most quantum granules and publishes the free
+  // blocks behind the cursor right away. Allocations only fail if not enough
+  // has been swept yet. live_map must stay valid until coalesce_step returns
+  // false. Steps may be called from any thread, but only one runs at a time.
+  void begin_coalesce(const uint64_t *live_map);
+  bool coalesce_step(size_t quantum);
+
+  // The number of bits in the live map passed to coalesce.
+  size_t num_granules();
+
 private:
+  std::atomic<uint64_t> *_start_bits = nullptr;
+  std::atomic<uint64_t> *_end_bits = nullptr;
+  size_t _num_bitmap_words = 0;
+
+  // Free blocks linked per free-list, but not yet published.
+  struct PendingLists {
+    BlockHeader *heads[_num_lists + 1];
+    BlockHeader *tails[_num_lists + 1];
+    size_t bytes[_num_lists + 1];
+    uint64_t fl_bitmap;
+  };
+
+  // A stripe of granules, and the free runs at its edges which may continue
+  // into the neighbouring stripes.
+  struct CoalescingStripe {
+    size_t start;
+    size_t end;
+    // End of the free run at the start of the stripe.
+    size_t leading_end;
+    // Start of the free run that reaches the end of the stripe.
+    size_t trailing_start;
+    PendingLists lists;
+  };
+
+  static size_t side_table_size(size_t pool_size);
+
+  // State of the incremental coalescer. _coalesce_run_start is the start of
+  // a free run whose end has not been reached yet, or NO_RUN.
+  static const size_t NO_RUN = std::numeric_limits<size_t>::max();
+
+  std::mutex _coalesce_lock;
+  const uint64_t *_coalesce_live_map = nullptr;
+  size_t _coalesce_cursor = 0;
+  size_t _coalesce_run_start = NO_RUN;
+
+  // Empties the free-lists. Blocks that were freed after live_map was taken
+  // are live in it and are inserted again.
+  void detach_free_lists(const uint64_t *live_map);
+
+  void coalesce_stripe(const uint64_t *live_map, CoalescingStripe &stripe);
+  BlockHeader *init_coalesced_block(size_t granule, size_t end_granule);
+  void add_coalesced_block(PendingLists &lists, size_t granule, size_t end_granule);
+  void link_pending_block(PendingLists &lists, BlockHeader *blk);
+
+  // Splices every pending list onto its free-list with a single CAS, and
+  // updates _fl_bitmap once.
+  void publish_pending_lists(PendingLists &lists);
+
+  void mark_allocated(uintptr_t start, size_t size);
+  void clear_allocated(uintptr_t start, size_t size);
+
+  // The size of the block starting at start, found by scanning the end
+  // bitmap forward from its first granule.
+  size_t lookup_size(uintptr_t start);
+
   BlockHeader *get_next_phys_block(BlockHeader *blk, std::map<void *, size_t> &allocmap);
 };
 
@@ -0,0 +1,1746 @@
+
+// Author: Joel Sikström
+
+#ifndef JSMALLOC_INLINE_HPP
+#define JSMALLOC_INLINE_HPP
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <new>
+#include <thread>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "JSMalloc.hpp"
+#include "JSMallocUtil.inline.hpp"
+
+// Every member of JSMallocBase and JSMallocT. The allocation and free paths
+// are inlined into the translation units that include this file, and a
+// Config of their own is instantiated there as well. JSMalloc.cpp explicitly
+// instantiates BaseConfig and ZOptimizedConfig, so code that only uses
+// JSMalloc and JSMallocZ can include JSMalloc.hpp alone and link against
+// out-of-line copies.
+
+JSMALLOC_ALWAYS_INLINE size_t BlockHeader::get_size() {
+  return size & ~_BlockFlagsMask;
+}
+
+JSMALLOC_ALWAYS_INLINE bool BlockHeader::is_free() {
+  return (size & _BlockFreeMask) == _BlockFreeMask;
+}
+
+JSMALLOC_ALWAYS_INLINE bool BlockHeader::is_last() {
+  return (size & _BlockLastMask) == _BlockLastMask;
+}
+
+JSMALLOC_ALWAYS_INLINE void BlockHeader::mark_free() {
+    size |= _BlockFreeMask;
+}
+
+JSMALLOC_ALWAYS_INLINE void BlockHeader::mark_used() {
+    size &= ~_BlockFreeMask;
+}
+
+JSMALLOC_ALWAYS_INLINE void BlockHeader::mark_last() {
+  size |= _BlockLastMask;
+}
+
+JSMALLOC_ALWAYS_INLINE void BlockHeader::unmark_last() {
+  size &= ~_BlockLastMask;
+}
+
+JSMALLOC_ALWAYS_INLINE bool BlockHeader::is_purged() {
+  return (size & _BlockPurgedMask) == _BlockPurgedMask;
+}
+
+JSMALLOC_ALWAYS_INLINE void BlockHeader::mark_purged() {
+  size |= _BlockPurgedMask;
+}
+
+JSMALLOC_ALWAYS_INLINE bool BlockHeader::is_idle() {
+  return (size & _BlockIdleMask) == _BlockIdleMask;
+}
+
+JSMALLOC_ALWAYS_INLINE void BlockHeader::mark_idle() {
+  size |= _BlockIdleMask;
+}
+
+JSMALLOC_ALWAYS_INLINE void BlockHeader::mark_dirty() {
+  size &= ~(_BlockPurgedMask | _BlockIdleMask);
+}
+
+JSMALLOC_ALWAYS_INLINE bool BlockHeader::is_prev_free() {
+  return (size & _BlockPrevFreeMask) == _BlockPrevFreeMask;
+}
+
+JSMALLOC_ALWAYS_INLINE void BlockHeader::mark_prev_free() {
+  size |= _BlockPrevFreeMask;
+}
+
+JSMALLOC_ALWAYS_INLINE void BlockHeader::unmark_prev_free() {
+  size &= ~_BlockPrevFreeMask;
+}
+
+// Lock-free free-lists pack both links into f1 as 32-bit offsets from
+// _block_start, so that a list head fits in one word together with its
+// version. The other free-lists link blocks with plain pointers.
+template<typename Config>
+JSMALLOC_ALWAYS_INLINE BlockHeader *JSMallocBase<Config>::blk_get_next(BlockHeader *blk) {
+  if(Config::DeferredCoalescing) {
+    return reinterpret_cast<BlockHeader *>(JSMallocUtil::from_offset(_block_start, true, blk->f1));
+  }
+
+  return reinterpret_cast<BlockHeader *>(blk->f1);
+}
+
+template<typename Config>
+JSMALLOC_ALWAYS_INLINE BlockHeader *JSMallocBase<Config>::blk_get_prev(BlockHeader *blk) {
+  if(Config::DeferredCoalescing) {
+    return reinterpret_cast<BlockHeader *>(JSMallocUtil::from_offset(_block_start, false, blk->f1));
+  }
+
+  return reinterpret_cast<BlockHeader *>(blk->f2);
+}
+
+template<typename Config>
+JSMALLOC_ALWAYS_INLINE void JSMallocBase<Config>::blk_set_next(BlockHeader *blk, BlockHeader *next) {
+  if(Config::DeferredCoalescing) {
+    JSMallocUtil::set_offset(true, JSMallocUtil::calculate_offset(_block_start, next), &blk->f1);
+  } else {
+    blk->f1 = reinterpret_cast<uint64_t>(next);
+  }
+}
+
+template<typename Config>
+JSMALLOC_ALWAYS_INLINE void JSMallocBase<Config>::blk_set_prev(BlockHeader *blk, BlockHeader *prev) {
+  if(Config::DeferredCoalescing) {
+    JSMallocUtil::set_offset(false, JSMallocUtil::calculate_offset(_block_start, prev), &blk->f1);
+  } else {
+    blk->f2 = reinterpret_cast<uint64_t>(prev);
+  }
+}
+
+template<typename Config>
+JSMALLOC_ALWAYS_INLINE Mapping JSMallocBase<Config>::get_mapping(size_t size) {
+  if(!Config::UseSecondLevels) {
+    // All lists are numbered from the smallest size class in fl, and every
+    // block above the largest class goes to the large-list at _num_lists.
+    size_t fl = JSMallocUtil::ilog2(size);
+    size_t sl = (size >> (fl - _sl_index_log2)) ^ _sl_index;
+    size_t mapping = ((fl - _min_alloc_size_log2) << _sl_index_log2) + sl;
+    return {mapping > _num_lists ? _num_lists : mapping, 0};
+  }
+
+  // Sizes below _sl_index are all kept in the first first-level index, with
+  // one second-level list per size.
+  if(size < _sl_index) {
+    return {0, size};
+  }
+
+  size_t fl = JSMallocUtil::ilog2(size);
+  size_t sl = (size >> (fl - _sl_index_log2)) ^ _sl_index;
+  return {fl, sl};
+}
+
+template<typename Config>
+JSMALLOC_ALWAYS_INLINE uint32_t JSMallocBase<Config>::flatten_mapping(Mapping mapping) {
+  return Config::UseSecondLevels ? mapping.fl * _sl_index + mapping.sl : mapping.fl;
+}
+
+template<typename Config>
+JSMALLOC_ALWAYS_INLINE Mapping JSMallocBase<Config>::adjust_available_mapping(Mapping mapping) {
+  if(!Config::UseSecondLevels) {
+    // If the list is out of bounds, the request cannot be fulfilled
+    if(mapping.fl > _num_lists) {
+      return {0, Mapping::UNABLE_TO_FIND};
+    }
+
+    uint64_t above_mapping = _fl_bitmap & (~0UL << mapping.fl);
+    if(above_mapping == 0) {
+      return {0, Mapping::UNABLE_TO_FIND};
+    }
+
+    mapping.fl = JSMallocUtil::ffs(above_mapping);
+
+    return mapping;
+  }
+
+  // If the first-level index is out of bounds, the request cannot be fulfilled
+  if(mapping.fl >= _fl_index) {
+    return {0, Mapping::UNABLE_TO_FIND};
+  }
+
+  SLBitmap sl_map = _sl_bitmap[mapping.fl] & (~static_cast<SLBitmap>(0) << mapping.sl);
+  if(sl_map == 0) {
+    // No suitable block exists in the second level. Search in the next largest
+    // first-level instead
+    uint64_t fl_map = (mapping.fl + 1 < 64) ? _fl_bitmap & (~0UL << (mapping.fl + 1)) : 0;
+    if(fl_map == 0) {
+      // No suitable block exists
+      return {0, Mapping::UNABLE_TO_FIND};
+    }
+
+    mapping.fl = JSMallocUtil::ffs(fl_map);
+    sl_map = _sl_bitmap[mapping.fl];
+  }
+
+  mapping.sl = JSMallocUtil::ffs(sl_map);
+
+  return mapping;
+}
+
+template<typename Config>
+JSMALLOC_ALWAYS_INLINE void JSMallocBase<Config>::update_bitmap(Mapping mapping, bool free_update) {
+  if(!Config::UseSecondLevels) {
+    if(free_update) {
+      _fl_bitmap |= (1UL << mapping.fl);
+    } else {
+      _fl_bitmap &= ~(1UL << mapping.fl);
+    }
+
+    return;
+  }
+
+  // The second-level bitmap and the bit of the first-level bitmap for
+  // mapping.fl are only modified while holding the list lock of mapping.fl.
+  if(free_update) {
+    _fl_bitmap.fetch_or(1UL << mapping.fl);
+    _sl_bitmap[mapping.fl] |= (static_cast<SLBitmap>(1) << mapping.sl);
+  } else {
+    _sl_bitmap[mapping.fl] &= ~(static_cast<SLBitmap>(1) << mapping.sl);
+    if(_sl_bitmap[mapping.fl] == 0) {
+      _fl_bitmap.fetch_and(~(1UL << mapping.fl));
+    }
+  }
+}
+
+template<typename Config>
+JSMALLOC_ALWAYS_INLINE size_t JSMallocBase<Config>::align_size(size_t size) {
+  if(size < _min_payload_size) {
+    size = _min_payload_size;
+  }
+
+  // The header and payload together are a multiple of _mbs, which keeps the
+  // payload of the next block aligned as well.
+  return JSMallocUtil::align_up(size + _block_header_length, _mbs) - _block_header_length;
+}
+
+template<typename Config>
+JSMALLOC_ALWAYS_INLINE bool JSMallocBase<Config>::ptr_in_pool(uintptr_t ptr) {
+  if(JSMALLOC_LIKELY(ptr >= _block_start && ptr < (_block_start + _pool_size))) {
+    return true;
+  }
+
+  if(_num_regions.load(std::memory_order_relaxed) == 1) {
+    return false;
+  }
+
+  uint32_t region = _region_map.lookup(ptr);
+  return region != JSMallocRegionMap::NOT_FOUND
+    && ptr >= _regions[region].start
+    && ptr < _regions[region].start + _regions[region].size;
+}
+
+template<typename Config>
+JSMALLOC_ALWAYS_INLINE BlockHeader *JSMallocBase<Config>::get_next_phys_block(BlockHeader *blk) {
+  if(blk == nullptr) {
+    return nullptr;
+  }
+
+  uintptr_t next = (uintptr_t)blk + _block_header_length + blk->get_size();
+
+  // Regions are not contiguous, so the last block of every region is marked.
+  if(_block_header_length > 0) {
+    return blk->is_last() ? nullptr : (BlockHeader *)next;
+  }
+
+  return ptr_in_pool(next)
+    ? (BlockHeader *)next
+    : nullptr;
+}
+
+template<typename Config>
+JSMALLOC_ALWAYS_INLINE BlockHeader *JSMallocBase<Config>::get_prev_phys_block(BlockHeader *blk) {
+  if(!blk->is_prev_free()) {
+    return nullptr;
+  }
+
+  size_t prev_size = *reinterpret_cast<uint64_t *>((uintptr_t)blk - _footer_length);
+  return reinterpret_cast<BlockHeader *>((uintptr_t)blk - prev_size - _block_header_length);
+}
+
+template<typename Config>
+inline void JSMallocBase<Config>::set_boundary_tag(BlockHeader *blk, bool free) {
+  if(Config::DeferredCoalescing) {
+    return;
+  }
+
+  BlockHeader *next_blk = get_next_phys_block(blk);
+
+  if(free) {
+    uintptr_t footer = (uintptr_t)blk + _block_header_length + blk->get_size() - _footer_length;
+    *reinterpret_cast<uint64_t *>(footer) = blk->get_size();
+  }
+
+  if(next_blk != nullptr) {
+    if(free) {
+      next_blk->mark_prev_free();
+    } else {
+      next_blk->unmark_prev_free();
+    }
+  }
+}
+
+template<typename Config>
+inline size_t JSMallocBase<Config>::lock_phys_blocks(BlockHeader *const *blks, size_t n, size_t *stripes) {
+  size_t num_stripes = 0;
+
+  // Insertion sort of the distinct stripe indices.
+  for(size_t i = 0; i < n; i++) {
+    if(blks[i] == nullptr) {
+      continue;
+    }
+
+    size_t stripe = ((uintptr_t)blks[i] >> _phys_lock_shift) % _num_phys_locks;
+    size_t pos = 0;
+    while(pos < num_stripes && stripes[pos] < stripe) {
+      pos++;
+    }
+
+    if(pos < num_stripes && stripes[pos] == stripe) {
+      continue;
+    }
+
+    for(size_t j = num_stripes; j > pos; j--) {
+      stripes[j] = stripes[j - 1];
+    }
+    stripes[pos] = stripe;
+    num_stripes++;
+  }
+
+  for(size_t i = 0; i < num_stripes; i++) {
+    if(!Config::CollectStats || JSMallocUtil::is_single_threaded()) {
+      _phys_locks[stripes[i]].lock();
+    } else if(JSMALLOC_UNLIKELY(!_phys_locks[stripes[i]].try_lock())) {
+      add_stat(thread_stats()->phys_lock_waits, 1);
+      _phys_locks[stripes[i]].lock();
+    }
+  }
+
+  return num_stripes;
+}
+
+template<typename Config>
+inline void JSMallocBase<Config>::unlock_phys_blocks(const size_t *stripes, size_t num_stripes) {
+  for(size_t i = num_stripes; i > 0; i--) {
+    _phys_locks[stripes[i - 1]].unlock();
+  }
+}
+
+template<typename Config>
+JSMALLOC_ALWAYS_INLINE size_t JSMallocBase<Config>::thread_slot() {
+  // Any thread-unique address works for picking a slot.
+  static thread_local char thread_slot_marker;
+
+  return ((uintptr_t)&thread_slot_marker >> 12) % _num_thread_slots;
+}
+
+template<typename Config>
+JSMALLOC_ALWAYS_INLINE std::atomic<size_t> &JSMallocBase<Config>::in_flight_counter() {
+  return _in_flight[thread_slot()].count;
+}
+
+template<typename Config>
+inline bool JSMallocBase<Config>::blocks_in_flight() {
+  for(size_t i = 0; i < _num_thread_slots; i++) {
+    if(_in_flight[i].count.load() > 0) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+template<typename Config>
+JSMALLOC_ALWAYS_INLINE size_t JSMallocBase<Config>::stats_class(Mapping mapping) {
+  size_t stats_class = flatten_mapping(mapping) >> _sl_index_log2;
+  return stats_class < _num_stat_classes ? stats_class : _num_stat_classes - 1;
+}
+
+JSMALLOC_ALWAYS_INLINE JSMallocThreadStatsCache::Cache &JSMallocThreadStatsCache::cache() {
+  static thread_local Cache cache;
+  return cache;
+}
+
+JSMALLOC_ALWAYS_INLINE JSMallocThreadStats *JSMallocThreadStatsCache::lookup(uint64_t id) {
+  Entry &entry = cache().entries[id % NumEntries];
+  return entry.id == id ? entry.stats : nullptr;
+}
+
+template<typename Config>
+JSMALLOC_ALWAYS_INLINE typename JSMallocBase<Config>::StatsBlock *JSMallocBase<Config>::thread_stats() {
+  JSMallocThreadStats *stats = JSMallocThreadStatsCache::lookup(_stats_id);
+  if(JSMALLOC_UNLIKELY(stats == nullptr)) {
+    return claim_thread_stats();
+  }
+
+  return static_cast<StatsBlock *>(stats);
+}
+
+// Only the thread that holds a block writes to it, so a plain add is enough.
+// The counters are atomic so that stats can read them at the same time.
+template<typename Config>
+JSMALLOC_ALWAYS_INLINE void JSMallocBase<Config>::add_stat(std::atomic<uint64_t> &counter, uint64_t n) {
+  counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+template<typename Config>
+JSMALLOC_ALWAYS_INLINE void JSMallocBase<Config>::count_stat(size_t stats_class, StatCounter counter, uint64_t n) {
+  if(Config::CollectStats) {
+    add_stat(thread_stats()->counters[stats_class][counter], n);
+  }
+}
+
+template<typename Config>
+JSMALLOC_ALWAYS_INLINE void JSMallocBase<Config>::count_allocation(size_t allocated_size, size_t requested_size) {
+  if(Config::CollectStats) {
+    std::atomic<uint64_t> *counters = thread_stats()->counters[stats_class(get_mapping(allocated_size))];
+    add_stat(counters[StatAllocs], 1);
+    add_stat(counters[StatAllocatedBytes], allocated_size);
+    add_stat(counters[StatRequestedBytes], requested_size);
+  }
+}
+
+template<typename Config>
+JSMALLOC_ALWAYS_INLINE void JSMallocBase<Config>::count_free(size_t size) {
+  if(Config::CollectStats) {
+    std::atomic<uint64_t> *counters = thread_stats()->counters[stats_class(get_mapping(size))];
+    add_stat(counters[StatFrees], 1);
+    add_stat(counters[StatFreedBytes], size);
+  }
+}
+
+// Locked free-lists are only modified with their list lock held, which
+// protects their byte counts as well, so they do not need atomic adds.
+template<typename Config>
+JSMALLOC_ALWAYS_INLINE void JSMallocBase<Config>::count_free_bytes(Mapping mapping, size_t size, bool insert) {
+  if(Config::CollectStats) {
+    std::atomic<size_t> &bytes = _free_bytes[flatten_mapping(mapping)];
+    if(!Config::DeferredCoalescing) {
+      size_t current = bytes.load(std::memory_order_relaxed);
+      bytes.store(insert ? current + size : current - size, std::memory_order_relaxed);
+    } else if(insert) {
+      bytes.fetch_add(size, std::memory_order_relaxed);
+    } else {
+      bytes.fetch_sub(size, std::memory_order_relaxed);
+    }
+  }
+}
+
+template<typename Config>
+JSMALLOC_ALWAYS_INLINE void JSMallocBase<Config>::lock_list(size_t fl) {
+  if(Config::DeferredCoalescing) {
+    return;
+  }
+
+  // Waits are counted through a failed try_lock, which cannot happen while
+  // the process is single-threaded, and would cost glibc's single-threaded
+  // fast path of lock.
+  if(!Config::CollectStats || JSMallocUtil::is_single_threaded()) {
+    _list_locks[fl].lock();
+  } else if(JSMALLOC_UNLIKELY(!_list_locks[fl].try_lock())) {
+    count_stat(stats_class({fl, 0}), StatLockWaits);
+    _list_locks[fl].lock();
+  }
+}
+
+template<typename Config>
+inline void JSMallocBase<Config>::insert_block_lock_free(BlockHeader *blk) {
+  Mapping mapping = get_mapping(blk->get_size());
+  uint32_t flat_mapping = flatten_mapping(mapping);
+  BlockHeader *head, *new_head;
+
+  // Mark the block as free
+  blk->mark_free();
+
+  // Counted before the block is visible, so that the bytes of a free-list
+  // never drop below zero when the block is removed.
+  count_free_bytes(mapping, blk->get_size(), true);
+
+  while(true) {
+    head = _blocks[flat_mapping].load();
+    BlockHeader *offset = head;
+
+    if(head == nullptr) {
+      offset = reinterpret_cast<BlockHeader *>(std::numeric_limits<uint64_t>::max());
+    }
+
+    blk_set_next(blk, reinterpret_cast<BlockHeader *>(JSMallocUtil::from_offset(_block_start, false, reinterpret_cast<uint64_t>(offset))));
+
+    uint64_t version = 1;
+    new_head = reinterpret_cast<BlockHeader *>(version);
+    JSMallocUtil::set_offset(false, JSMallocUtil::calculate_offset(_block_start, blk), reinterpret_cast<uint64_t *>(&new_head));
+
+    if(_blocks[flat_mapping].compare_exchange_strong(head, new_head)) {
+      break;
+    }
+
+    count_stat(stats_class(mapping), StatCASRetries);
+  }
+
+  // Update bitmap to indicate level has a free block
+  _fl_bitmap.fetch_or(1UL << mapping.fl);
+}
+
+template<typename Config>
+inline BlockHeader *JSMallocBase<Config>::remove_block_lock_free(Mapping mapping, size_t min_size) {
+  uint32_t flat_mapping = flatten_mapping(mapping);
+  BlockHeader *head = _blocks[flat_mapping].load();
+  if(head == nullptr) {
+    return nullptr;
+  }
+
+  uint64_t head_bits = reinterpret_cast<uint64_t>(head);
+  uint32_t version = JSMallocUtil::get_bits(head_bits, true);
+  BlockHeader *actual_head = reinterpret_cast<BlockHeader *>(JSMallocUtil::from_offset(_block_start, false, head_bits));
+  if(actual_head != nullptr && actual_head->get_size() < min_size) {
+    return nullptr;
+  }
+
+  BlockHeader *next_blk = (actual_head == nullptr)
+    ? nullptr
+    : blk_get_next(actual_head);
+
+  BlockHeader *new_head = reinterpret_cast<BlockHeader *>(version + 1);
+  JSMallocUtil::set_offset(false, JSMallocUtil::calculate_offset(_block_start, next_blk), reinterpret_cast<uint64_t *>(&new_head));
+
+  if(!_blocks[flat_mapping].compare_exchange_strong(head, new_head)) {
+    count_stat(stats_class(mapping), StatCASRetries);
+    return nullptr;
+  }
+
+  if(actual_head != nullptr) {
+    count_free_bytes(mapping, actual_head->get_size(), false);
+  }
+
+  if(next_blk == nullptr) {
+    _fl_bitmap.fetch_and(~(1UL << mapping.fl));
+
+    // A block inserted before the bit was cleared would otherwise be hidden.
+    BlockHeader *current_head = _blocks[flat_mapping].load();
+    if(current_head != nullptr && JSMallocUtil::from_offset(_block_start, false, reinterpret_cast<uint64_t>(current_head)) != nullptr) {
+      _fl_bitmap.fetch_or(1UL << mapping.fl);
+    }
+  }
+
+  return actual_head;
+}
+
+template<typename Config>
+inline void JSMallocBase<Config>::insert_block(BlockHeader *blk) {
+  if(Config::DeferredCoalescing) {
+    insert_block_lock_free(blk);
+    return;
+  }
+
+  Mapping mapping = get_mapping(blk->get_size());
+  uint32_t flat_mapping = flatten_mapping(mapping);
+
+  // The block is not visible to other threads until it is in the free-list.
+  set_boundary_tag(blk, true);
+
+  lock_list(mapping.fl);
+
+  BlockHeader *head = _blocks[flat_mapping];
+
+  // Insert the block into its corresponding free-list
+  if(head != nullptr) {
+    blk_set_prev(head, blk);
+  }
+
+  blk_set_next(blk, head);
+  blk_set_prev(blk, nullptr);
+  _blocks[flat_mapping] = blk;
+
+  // Mark the block as free
+  blk->mark_free();
+
+  update_bitmap(mapping, true);
+  count_free_bytes(mapping, blk->get_size(), true);
+
+  _list_locks[mapping.fl].unlock();
+}
+
+template<typename Config>
+inline BlockHeader *JSMallocBase<Config>::remove_block(BlockHeader *blk, Mapping mapping, size_t min_size) {
+  if(Config::DeferredCoalescing) {
+    return remove_block_lock_free(mapping, min_size);
+  }
+
+  uint32_t flat_mapping = flatten_mapping(mapping);
+  BlockHeader *target = blk;
+  BlockHeader *next_blk, *prev_blk;
+
+  lock_list(mapping.fl);
+
+  if(blk == nullptr) {
+    target = _blocks[flat_mapping];
+    if(target != nullptr && target->get_size() < min_size) {
+      target = nullptr;
+    }
+  } else if(!blk->is_free() || flatten_mapping(get_mapping(blk->get_size())) != flat_mapping) {
+    // Another thread has already removed the block, which can happen if it was
+    // allocated or coalesced after the caller read its header.
+    target = nullptr;
+  }
+
+  if(target == nullptr) {
+    _list_locks[mapping.fl].unlock();
+    return nullptr;
+  }
+
+  next_blk = blk_get_next(target);
+  prev_blk = blk_get_prev(target);
+
+  // If the block is the head in the free-list, we need to update the head
+  if(_blocks[flat_mapping] == target) {
+    _blocks[flat_mapping] = next_blk;
+  }
+
+  if(next_blk != nullptr) {
+    blk_set_prev(next_blk, prev_blk);
+  }
+
+  if(prev_blk != nullptr) {
+    blk_set_next(prev_blk, next_blk);
+  }
+
+  // If the block was the only one in the free-list, we mark it as empty
+  if(_blocks[flat_mapping] == nullptr) {
+    update_bitmap(mapping, false);
+  }
+
+  // Mark the block as used (no longer free). This has to be done while holding
+  // the list lock, since it is what other threads validate against.
+  target->mark_used();
+  count_free_bytes(mapping, target->get_size(), false);
+
+  _list_locks[mapping.fl].unlock();
+
+  return target;
+}
+
+template<typename Config>
+inline BlockHeader *JSMallocBase<Config>::split_block(BlockHeader *blk, size_t size) {
+  size_t remainder_size = blk->get_size() - _block_header_length - size;
+  count_stat(stats_class(get_mapping(blk->get_size())), StatSplits);
+
+  // Needs to be checked before setting new size
+  bool is_last = blk->is_last();
+  bool is_purged = blk->is_purged();
+  bool is_prev_free = blk->is_prev_free();
+
+  // Shrink blk to size
+  blk->size = size;
+  if(is_prev_free) {
+    blk->mark_prev_free();
+  }
+
+  // Use a portion of blk's memory for the new block. Neither blk nor the
+  // remainder is in a free-list.
+  BlockHeader *remainder_blk = reinterpret_cast<BlockHeader *>((uintptr_t)blk + _block_header_length + blk->get_size());
+  remainder_blk->size = remainder_size;
+
+  if(is_last) {
+    blk->unmark_last();
+    remainder_blk->mark_last();
+  } else if(!Config::DeferredCoalescing) {
+    set_boundary_tag(remainder_blk, false);
+  }
+
+  // The whole pages of both halves are a subset of the pages of blk, except
+  // for the page holding the new header, which is only partially in either.
+  if(is_purged) {
+    blk->mark_purged();
+    remainder_blk->mark_purged();
+  }
+
+  return remainder_blk;
+}
+
+template<typename Config>
+inline BlockHeader *JSMallocBase<Config>::coalesce_blocks(BlockHeader *blk1, BlockHeader *blk2) {
+  size_t blk2_size = blk2->get_size();
+  bool blk2_is_last = blk2->is_last();
+
+  // Combine the blocks by adding the size of blk2 to blk1 and also the block
+  // header size
+  blk1->size += _block_header_length + blk2_size;
+
+  // blk2's header is now part of the payload, so the block is no longer clean.
+  blk1->mark_dirty();
+
+  if(blk2_is_last) {
+    blk1->mark_last();
+  } else if(!Config::DeferredCoalescing) {
+    // blk1 is not in a free-list until it is inserted.
+    set_boundary_tag(blk1, false);
+  }
+
+  count_stat(stats_class(get_mapping(blk1->get_size())), StatCoalesces);
+
+  return blk1;
+}
+
+template<typename Config>
+inline BlockHeader *JSMallocBase<Config>::find_exact_block(size_t size, Mapping good_fit_mapping) {
+  Mapping mapping = get_mapping(size);
+  uint32_t flat_mapping = flatten_mapping(mapping);
+
+  // The good-fit search already covers the list if rounding up did not
+  // change the size class. Empty lists are skipped without taking their lock.
+  if(flat_mapping == flatten_mapping(good_fit_mapping) || _blocks[flat_mapping].load(std::memory_order_relaxed) == nullptr) {
+    return nullptr;
+  }
+
+  in_flight_counter()++;
+
+  BlockHeader *blk = remove_block(nullptr, mapping, size);
+  if(blk == nullptr) {
+    in_flight_counter()--;
+  }
+
+  return blk;
+}
+
+template<typename Config>
+inline BlockHeader *JSMallocBase<Config>::find_block(size_t size) {
+  size_t aligned_size = align_size(size);
+  size_t target_size = aligned_size;
+  if(aligned_size >= _sl_index) {
+    target_size += (1UL << (JSMallocUtil::ilog2(aligned_size) - _sl_index_log2)) - 1;
+  }
+
+  Mapping mapping = get_mapping(target_size);
+
+  BlockHeader *blk = nullptr;
+  if(Config::ExactFitProbe && target_size != aligned_size) {
+    blk = find_exact_block(aligned_size, mapping);
+  }
+
+  while(blk == nullptr) {
+    Mapping adjusted_mapping = adjust_available_mapping(mapping);
+
+    if(JSMALLOC_UNLIKELY(adjusted_mapping.sl == Mapping::UNABLE_TO_FIND)) {
+      // A suitable block might be missing only because another thread is
+      // splitting or coalescing it.
+      if(blocks_in_flight()) {
+        std::this_thread::yield();
+        continue;
+      }
+
+      return nullptr;
+    }
+
+    in_flight_counter()++;
+
+    blk = remove_block(nullptr, adjusted_mapping);
+
+    if(JSMALLOC_UNLIKELY(blk == nullptr)) {
+      in_flight_counter()--;
+    }
+  }
+
+  if(Config::DeferredCoalescing && JSMALLOC_UNLIKELY(blk->get_size() < aligned_size)) {
+    blk = find_large_block(blk, aligned_size);
+    if(blk == nullptr) {
+      in_flight_counter()--;
+      return nullptr;
+    }
+  }
+
+  // If the block can be split, we split it in order to minimize internal fragmentation
+  bool split = (blk->get_size() - aligned_size) >= _min_block_size;
+  if(Config::DeferredCoalescing) {
+    if(split) {
+      insert_block(split_block(blk, aligned_size));
+    }
+  } else {
+    // blk is no longer in a free-list, so the stripes to lock are stable. The
+    // next block has to be told that blk is no longer free even if it is not
+    // split.
+    BlockHeader *remainder_blk = split ? reinterpret_cast<BlockHeader *>((uintptr_t)blk + _block_header_length + aligned_size) : nullptr;
+    BlockHeader *blks[] = {blk, remainder_blk, get_next_phys_block(blk)};
+    size_t stripes[_max_locked_blocks];
+    size_t num_stripes = lock_phys_blocks(blks, 3, stripes);
+
+    if(split) {
+      insert_block(split_block(blk, aligned_size));
+    } else {
+      set_boundary_tag(blk, false);
+    }
+
+    unlock_phys_blocks(stripes, num_stripes);
+  }
+
+  in_flight_counter()--;
+
+  return blk;
+}
+
+template<typename Config>
+JSMALLOC_ALWAYS_INLINE JSMallocAlloc JSMallocBase<Config>::debug_allocate(size_t size) {
+  size_t num_regions_seen = _num_regions.load();
+  BlockHeader *blk = find_block(size);
+
+  while(JSMALLOC_UNLIKELY(blk == nullptr) && grow(size, num_regions_seen)) {
+    num_regions_seen = _num_regions.load();
+    blk = find_block(size);
+  }
+
+  if(JSMALLOC_UNLIKELY(blk == nullptr)) {
+    return {nullptr, 0};
+  }
+
+  size_t allocated_size = blk->get_size();
+  count_allocation(allocated_size, size);
+
+  // Make sure addresses are aligned to the word-size (8-bytes).
+  // TODO: This might not be necessary if everything is already aligned, and
+  // should take into account that the block size might be smaller than expected.
+  uintptr_t blk_start = (uintptr_t)blk + _block_header_length;
+  return {(void *)blk_start, allocated_size};
+}
+
+template<typename Config>
+JSMALLOC_ALWAYS_INLINE void *JSMallocBase<Config>::allocate(size_t size) {
+  return debug_allocate(size).addr;
+}
+
+template<typename Config>
+JSMallocBase<Config>::JSMallocBase(void *pool, size_t pool_size, bool start_full) {
+  initialize(pool, pool_size, start_full);
+}
+
+template<typename Config>
+void JSMallocBase<Config>::reset(bool initial_block_allocated) {
+  // Initialize bitmap and blocks
+  _fl_bitmap = 0;
+  for(size_t i = 0; i < _fl_index; i++) {
+    if(Config::UseSecondLevels) {
+      _sl_bitmap[i] = 0;
+    }
+
+    for(size_t j = 0; j < _sl_index; j++) {
+      _blocks[i * _sl_index + j] = nullptr;
+    }
+  }
+  _blocks[_num_lists] = nullptr;
+
+  for(size_t i = 0; i < _num_thread_slots; i++) {
+    _in_flight[i].count = 0;
+  }
+
+  if(Config::CollectStats) {
+    for(JSMallocThreadStats *stats = _thread_stats.load(); stats != nullptr; stats = stats->next) {
+      StatsBlock *blk = static_cast<StatsBlock *>(stats);
+      for(size_t i = 0; i < _num_stat_classes; i++) {
+        for(size_t j = 0; j < NumStatCounters; j++) {
+          blk->counters[i][j] = 0;
+        }
+      }
+      blk->phys_lock_waits = 0;
+    }
+
+    for(size_t i = 0; i < _num_lists + 1; i++) {
+      _free_bytes[i] = 0;
+    }
+  }
+
+  BlockHeader *blk = reinterpret_cast<BlockHeader *>(_block_start);
+
+  if(!initial_block_allocated) {
+    blk->size = _pool_size - _block_header_length;
+
+    // Marked before it is inserted, so that the boundary tag does not look
+    // for a block after the pool.
+    if(_block_header_length > 0) {
+      blk->mark_last();
+    }
+
+    insert_block(blk);
+
+  } else if(_block_header_length > 0) {
+      blk->mark_used();
+      blk->unmark_prev_free();
+      blk->mark_last();
+  }
+}
+
+template<typename Config>
+void *JSMallocBase<Config>::allocate_aligned(size_t size, size_t alignment) {
+  if(alignment <= _mbs) {
+    return allocate(size);
+  }
+
+  if(!JSMallocUtil::is_aligned(alignment, alignment)) {
+    return nullptr;
+  }
+
+  // In the worst case, a whole free block has to fit in front of the aligned
+  // payload.
+  size_t aligned_size = align_size(size);
+  if(aligned_size > std::numeric_limits<size_t>::max() / 2 - alignment) {
+    return nullptr;
+  }
+  size_t search_size = aligned_size + alignment + _min_block_size;
+
+  size_t num_regions_seen = _num_regions.load();
+  BlockHeader *blk = find_block(search_size);
+
+  while(blk == nullptr && grow(search_size, num_regions_seen)) {
+    num_regions_seen = _num_regions.load();
+    blk = find_block(search_size);
+  }
+
+  if(blk == nullptr) {
+    return nullptr;
+  }
+
+  uintptr_t payload = (uintptr_t)blk + _block_header_length;
+  uintptr_t aligned_payload = JSMallocUtil::align_up(payload, alignment);
+  if(aligned_payload != payload && aligned_payload - payload < _min_block_size) {
+    aligned_payload = JSMallocUtil::align_up(payload + _min_block_size, alignment);
+  }
+
+  BlockHeader *aligned_blk = reinterpret_cast<BlockHeader *>(aligned_payload - _block_header_length);
+  BlockHeader *tail_blk = reinterpret_cast<BlockHeader *>(aligned_payload + aligned_size);
+  BlockHeader *next_blk = nullptr;
+  size_t stripes[_max_locked_blocks];
+  size_t num_stripes = 0;
+
+  // blk is not in any free-list, but find_block has just inserted the block
+  // after it, which the tail is merged with. Its neighbours are read and
+  // validated the same way as in JSMalloc::free.
+  while(!Config::DeferredCoalescing) {
+    next_blk = get_next_phys_block(blk);
+    BlockHeader *next_next_blk = (next_blk != nullptr && next_blk->is_free()) ? get_next_phys_block(next_blk) : nullptr;
+
+    BlockHeader *blks[] = {blk, aligned_blk, tail_blk, next_blk, next_next_blk};
+    num_stripes = lock_phys_blocks(blks, 5, stripes);
+
+    if(next_blk == nullptr || !next_blk->is_free() || get_next_phys_block(next_blk) == next_next_blk) {
+      in_flight_counter()++;
+      break;
+    }
+
+    unlock_phys_blocks(stripes, num_stripes);
+  }
+
+  // The leading slack is returned as a free block.
+  if(aligned_blk != blk) {
+    aligned_blk = split_block(blk, aligned_payload - _block_header_length - payload);
+    insert_block(blk);
+  }
+
+  if((aligned_blk->get_size() - aligned_size) >= _min_block_size) {
+    tail_blk = split_block(aligned_blk, aligned_size);
+
+    if(next_blk != nullptr && remove_block(next_blk, get_mapping(next_blk->get_size())) != nullptr) {
+      tail_blk = coalesce_blocks(tail_blk, next_blk);
+    }
+
+    insert_block(tail_blk);
+  }
+
+  if(!Config::DeferredCoalescing) {
+    in_flight_counter()--;
+    unlock_phys_blocks(stripes, num_stripes);
+  }
+
+  count_allocation(aligned_blk->get_size(), size);
+
+  return reinterpret_cast<void *>(aligned_payload);
+}
+
+template<typename Config>
+size_t JSMallocBase<Config>::allocate_batch(size_t size, size_t n, void **out) {
+  size_t aligned_size = align_size(size);
+  size_t stride = aligned_size + _block_header_length;
+
+  if(n == 0 || stride > std::numeric_limits<size_t>::max() / n) {
+    return 0;
+  }
+
+  // Halve the batch until a block that fits all of it is found. find_block
+  // has already split off the rest of the block as a single remainder.
+  BlockHeader *blk = nullptr;
+  while(n > 0) {
+    blk = find_block(n * stride - _block_header_length);
+    if(blk != nullptr) {
+      break;
+    }
+
+    n /= 2;
+  }
+
+  if(n == 0) {
+    return 0;
+  }
+
+  // The blocks are carved front to back. None of them are visible in any
+  // free-list, and the new headers can only be reached through the block
+  // after the batch, so only the stripes of blk and that block are locked.
+  size_t stripes[_max_locked_blocks];
+  size_t num_stripes = 0;
+  if(!Config::DeferredCoalescing) {
+    BlockHeader *blks[] = {blk, get_next_phys_block(blk)};
+    num_stripes = lock_phys_blocks(blks, 2, stripes);
+  }
+
+  for(size_t i = 0; i < n; i++) {
+    BlockHeader *next_blk = (i + 1 < n) ? split_block(blk, aligned_size) : nullptr;
+    count_allocation(blk->get_size(), size);
+    out[i] = reinterpret_cast<void *>((uintptr_t)blk + _block_header_length);
+    blk = next_blk;
+  }
+
+  if(!Config::DeferredCoalescing) {
+    unlock_phys_blocks(stripes, num_stripes);
+  }
+
+  return n;
+}
+
+template<typename Config>
+double JSMallocBase<Config>::internal_fragmentation() {
+  JSMallocStats snapshot;
+  stats(snapshot);
+
+  if(snapshot.total.allocated_bytes == 0) {
+    return 0;
+  }
+
+  return 1 - (double)snapshot.total.requested_bytes / snapshot.total.allocated_bytes;
+}
+
+template<typename Config>
+void JSMallocBase<Config>::stats(JSMallocStats &stats) {
+  stats = {};
+  stats.num_classes = _num_stat_classes;
+
+  for(size_t i = 0; i < _num_regions.load(); i++) {
+    stats.pool_bytes += _regions[i].size;
+  }
+
+  if(!Config::CollectStats) {
+    return;
+  }
+
+  uint64_t counters[_num_stat_classes][NumStatCounters] = {};
+  uint64_t phys_lock_waits = 0;
+  for(JSMallocThreadStats *stats = _thread_stats.load(std::memory_order_acquire); stats != nullptr; stats = stats->next) {
+    StatsBlock *blk = static_cast<StatsBlock *>(stats);
+    for(size_t i = 0; i < _num_stat_classes; i++) {
+      for(size_t j = 0; j < NumStatCounters; j++) {
+        counters[i][j] += blk->counters[i][j].load(std::memory_order_relaxed);
+      }
+    }
+    phys_lock_waits += blk->phys_lock_waits.load(std::memory_order_relaxed);
+  }
+
+  uint64_t freed_bytes = 0;
+  for(size_t i = 0; i < _num_stat_classes; i++) {
+    JSMallocClassStats &class_stats = stats.classes[i];
+
+    class_stats.min_size = stats_class_min_size(i);
+    class_stats.allocs = counters[i][StatAllocs];
+    class_stats.frees = counters[i][StatFrees];
+    class_stats.splits = counters[i][StatSplits];
+    class_stats.coalesces = counters[i][StatCoalesces];
+    class_stats.cas_retries = counters[i][StatCASRetries];
+    class_stats.lock_waits = counters[i][StatLockWaits];
+    class_stats.allocated_bytes = counters[i][StatAllocatedBytes];
+    class_stats.requested_bytes = counters[i][StatRequestedBytes];
+
+    // Blocks are often freed in a different class than the one they were
+    // allocated in, since they are coalesced or resized in between, so a
+    // class can have freed more than it allocated.
+    uint64_t class_allocated_bytes = counters[i][StatAllocatedBytes];
+    uint64_t class_freed_bytes = counters[i][StatFreedBytes];
+    class_stats.live_bytes = class_allocated_bytes > class_freed_bytes ? class_allocated_bytes - class_freed_bytes : 0;
+    freed_bytes += class_freed_bytes;
+
+    size_t first_list = i << _sl_index_log2;
+    size_t last_list = std::min(first_list + _sl_index, _num_lists + 1);
+    for(size_t list = first_list; list < last_list; list++) {
+      class_stats.free_bytes += _free_bytes[list].load(std::memory_order_relaxed);
+    }
+
+    stats.total.add(class_stats);
+  }
+
+  // Only the sum over all classes is exact. It can still come out negative
+  // while other threads run, since the blocks are not read at once.
+  uint64_t allocated_bytes = stats.total.allocated_bytes;
+  stats.total.live_bytes = allocated_bytes > freed_bytes ? allocated_bytes - freed_bytes : 0;
+  stats.total.lock_waits += phys_lock_waits;
+}
+
+template<typename Config>
+typename JSMallocBase<Config>::StatsBlock *JSMallocBase<Config>::claim_thread_stats() {
+  // Blocks that have been handed back are reused first.
+  JSMallocThreadStats *stats = _thread_stats.load(std::memory_order_acquire);
+  for(; stats != nullptr; stats = stats->next) {
+    bool in_use = false;
+    if(!stats->in_use.load(std::memory_order_relaxed) &&
+       stats->in_use.compare_exchange_strong(in_use, true, std::memory_order_acquire)) {
+      break;
+    }
+  }
+
+  if(stats == nullptr) {
+    void *memory = mmap(nullptr, sizeof(StatsBlock), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(memory == MAP_FAILED) {
+      // The counts are dropped until a block can be mapped, since the
+      // threads that end up here share this one.
+      static StatsBlock discarded;
+      return &discarded;
+    }
+
+    stats = new(memory) StatsBlock();
+    stats->in_use.store(true, std::memory_order_relaxed);
+
+    JSMallocThreadStats *head = _thread_stats.load(std::memory_order_relaxed);
+    do {
+      stats->next = head;
+    } while(!_thread_stats.compare_exchange_weak(head, stats, std::memory_order_release, std::memory_order_relaxed));
+  }
+
+  JSMallocThreadStatsCache::insert(_stats_id, stats);
+
+  return static_cast<StatsBlock *>(stats);
+}
+
+template<typename Config>
+void JSMallocBase<Config>::fragmentation(JSMallocFragmentation &fragmentation) {
+  fragmentation = {};
+  fragmentation.num_classes = _num_stat_classes;
+  for(size_t i = 0; i < _num_stat_classes; i++) {
+    fragmentation.class_min_size[i] = stats_class_min_size(i);
+  }
+
+  if(!Config::CollectStats) {
+    return;
+  }
+
+  // Lists are visited in ascending order, so the last one is the largest.
+  size_t largest_list = _num_lists + 1;
+  auto add_list = [&](size_t list) {
+    size_t bytes = _free_bytes[list].load(std::memory_order_relaxed);
+    fragmentation.class_free_bytes[list >> _sl_index_log2] += bytes;
+    fragmentation.free_bytes += bytes;
+    largest_list = list;
+  };
+
+  uint64_t fl_map = _fl_bitmap.load();
+  while(fl_map != 0) {
+    size_t fl = JSMallocUtil::ffs(fl_map);
+    fl_map &= fl_map - 1;
+
+    if(!Config::UseSecondLevels) {
+      add_list(fl);
+      continue;
+    }
+
+    SLBitmap sl_map = _sl_bitmap[fl];
+    while(sl_map != 0) {
+      add_list(flatten_mapping({fl, JSMallocUtil::ffs(sl_map)}));
+      sl_map &= sl_map - 1;
+    }
+  }
+
+  if(largest_list > _num_lists) {
+    return;
+  }
+
+  if(Config::DeferredCoalescing) {
+    // The blocks of a lock-free list can be allocated while they are read.
+    if(largest_list == _num_lists) {
+      fragmentation.largest_free_block = 1UL << (_fl_index + _min_alloc_size_log2);
+    } else {
+      size_t fl = (largest_list >> _sl_index_log2) + _min_alloc_size_log2;
+      size_t sl = largest_list & (_sl_index - 1);
+      fragmentation.largest_free_block = (1UL << fl) + (sl << (fl - _sl_index_log2));
+    }
+  } else {
+    size_t fl = largest_list / _sl_index;
+    lock_list(fl);
+
+    for(BlockHeader *blk = _blocks[largest_list]; blk != nullptr; blk = blk_get_next(blk)) {
+      fragmentation.largest_free_block = std::max(fragmentation.largest_free_block, blk->get_size());
+    }
+
+    _list_locks[fl].unlock();
+  }
+}
+
+template<typename Config>
+size_t JSMallocBase<Config>::stats_class_min_size(size_t stats_class) {
+  if(Config::UseSecondLevels) {
+    return (stats_class == 0) ? 0 : 1UL << stats_class;
+  }
+
+  return 1UL << (stats_class + _min_alloc_size_log2);
+}
+
+template<typename Config>
+void JSMallocBase<Config>::set_region_provider(JSMallocRegionProvider provider) {
+  _region_provider = provider;
+}
+
+template<typename Config>
+size_t JSMallocBase<Config>::num_regions() {
+  return _num_regions.load();
+}
+
+template<typename Config>
+void *JSMallocBase<Config>::mmap_region(void *context, size_t size, size_t alignment) {
+  (void)context;
+
+  // Over-allocate and trim the excess to get an aligned mapping.
+  size_t mapping_size = size + alignment;
+  void *mapping = mmap(nullptr, mapping_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if(mapping == MAP_FAILED) {
+    return nullptr;
+  }
+
+  uintptr_t start = JSMallocUtil::align_up((uintptr_t)mapping, alignment);
+  size_t head = start - (uintptr_t)mapping;
+  size_t tail = mapping_size - head - size;
+
+  if(head > 0) {
+    munmap(mapping, head);
+  }
+
+  if(tail > 0) {
+    munmap(reinterpret_cast<void *>(start + size), tail);
+  }
+
+  return reinterpret_cast<void *>(start);
+}
+
+template<typename Config>
+void JSMallocBase<Config>::print_blk(BlockHeader *blk) {
+  std::cout << "Block (@ " << blk << ")\n" 
+            << " size=" << blk->get_size() << "\n"
+            << " LF=" << (blk->is_last() ? "1" : "0") << (blk->is_free() ? "1" : "0") << " (not accurate)\n";
+
+  if(!Config::DeferredCoalescing) {
+    std::cout << " phys_prev=" << get_prev_phys_block(blk) << "\n";
+  }
+
+  if(blk->is_free()) {
+    std::cout << " next=" << blk_get_next(blk) << ","
+              << " prev=" << blk_get_prev(blk)
+              << std::endl;
+  }
+}
+
+template<typename Config>
+void JSMallocBase<Config>::print_phys_blks() {
+  for(size_t i = 0; i < _num_regions; i++) {
+    BlockHeader *current = reinterpret_cast<BlockHeader *>(_regions[i].start);
+
+    while(current != nullptr) {
+      print_blk(current);
+      current = get_next_phys_block(current);
+    }
+  }
+}
+
+template<typename Config>
+void JSMallocBase<Config>::print_free_lists() {
+  for(size_t i = 0; i < 64; i++) {
+    if((_fl_bitmap & (1UL << i)) == 0) {
+      continue;
+    }
+
+    if(Config::UseSecondLevels) {
+      for(size_t j = 0; j < _sl_index; j++) {
+        if((_sl_bitmap[i] & (static_cast<SLBitmap>(1) << j)) == 0) {
+          continue;
+        }
+
+        printf("FREE-LIST (%02u): ", flatten_mapping({i, j}));
+        BlockHeader *current = _blocks[flatten_mapping({i, j})];
+        while(current != nullptr) {
+          std::cout << current << " -> ";
+          current = blk_get_next(current);
+        }
+        std::cout << "END" << std::endl;
+      }
+    } else {
+      printf("FREE-LIST (%02ld): ", i);
+      BlockHeader *current = _blocks[i];
+      current = reinterpret_cast<BlockHeader *>(JSMallocUtil::from_offset(_block_start, false, reinterpret_cast<uint64_t>(_blocks[i].load())));
+
+      while(current != nullptr) {
+        std::cout << current << " -> ";
+        current = blk_get_next(current);
+      }
+
+      std::cout << "END" << std::endl;
+    }
+  }
+}
+
+template<typename Config>
+uint64_t JSMallocBase<Config>::get_fl_bitmap() {
+  return _fl_bitmap;
+}
+
+template<typename Config>
+void JSMallocBase<Config>::initialize(void *pool, size_t pool_size, bool start_full) {
+  // Blocks are placed so that their payloads start at a multiple of _mbs.
+  // align_size keeps the header and payload of every block a multiple of
+  // _mbs, so this holds for all following blocks. allocate_aligned relies on it.
+  uintptr_t aligned_initial_block = JSMallocUtil::align_up((uintptr_t)pool + _block_header_length, _mbs) - _block_header_length;
+  _block_start = aligned_initial_block;
+
+  // The pool size is shrinked to the initial aligned block size. This wastes at maximum (_mbs - 1) bytes
+  size_t aligned_block_size = JSMallocUtil::align_down(pool_size - (aligned_initial_block - (uintptr_t)pool), _mbs);
+  _pool_size = aligned_block_size;
+
+  _regions[0] = {_block_start, _pool_size};
+  _num_regions = 1;
+  _next_region_size = JSMallocRegionMap::ChunkSize;
+  _region_provider = {nullptr, nullptr};
+  _region_map.clear();
+
+  _thread_stats = nullptr;
+  _stats_id = JSMallocThreadStatsCache::next_id();
+
+  reset(start_full);
+}
+
+template<typename Config>
+bool JSMallocBase<Config>::grow(size_t size, size_t num_regions_seen) {
+  if(Config::DeferredCoalescing || _region_provider.map_region == nullptr) {
+    return false;
+  }
+
+  std::lock_guard<std::mutex> guard(_grow_lock);
+
+  size_t num_regions = _num_regions.load();
+  if(num_regions != num_regions_seen) {
+    return true;
+  }
+
+  if(num_regions == _max_regions) {
+    return false;
+  }
+
+  // The region's block must stay below 1 << _fl_index to be indexable, so
+  // regions are never larger than the largest chunk-aligned size below it.
+  const size_t max_region_size = (_fl_index < 64 ? 1UL << _fl_index : 1UL << 63) - JSMallocRegionMap::ChunkSize;
+
+  // Leave room for the good-fit round-up in find_block and the header.
+  size_t required_size = align_size(size);
+  if(required_size > max_region_size) {
+    return false;
+  }
+  required_size += (required_size >> 3) + _min_block_size;
+  if(required_size > max_region_size) {
+    return false;
+  }
+
+  size_t region_size = JSMallocUtil::align_up(std::max(required_size, _next_region_size), JSMallocRegionMap::ChunkSize);
+  region_size = std::min(region_size, max_region_size);
+  void *region = _region_provider.map_region(_region_provider.context, region_size, JSMallocRegionMap::ChunkSize);
+  if(region == nullptr) {
+    return false;
+  }
+
+  uintptr_t region_start = (uintptr_t)region;
+  if(!_region_map.insert(region_start, region_size, num_regions)) {
+    munmap(region, region_size);
+    return false;
+  }
+
+  // The block is placed the same way as the initial one in initialize.
+  uintptr_t blk_start = JSMallocUtil::align_up(region_start + _block_header_length, _mbs) - _block_header_length;
+  size_t blk_length = JSMallocUtil::align_down(region_start + region_size - blk_start, _mbs);
+  _regions[num_regions] = {blk_start, blk_length};
+
+  _next_region_size = std::min(_next_region_size * 2, static_cast<size_t>(_max_region_size));
+
+  // The region's only block has no previous block and is marked as last, so
+  // coalescing never crosses into another region.
+  BlockHeader *blk = reinterpret_cast<BlockHeader *>(blk_start);
+  blk->size = blk_length - _block_header_length;
+  blk->mark_last();
+
+  // Publish the region before its block can be allocated.
+  _num_regions.store(num_regions + 1);
+
+  insert_block(blk);
+
+  return true;
+}
+
+template<typename Config>
+BlockHeader *JSMallocBase<Config>::find_large_block(BlockHeader *blk, size_t aligned_size) {
+  Mapping mapping = get_mapping(blk->get_size());
+
+  // Blocks that are too small are set aside until one that fits is found,
+  // and are put back afterwards. They count as in flight meanwhile.
+  BlockHeader *rejected = nullptr;
+  while(blk != nullptr && blk->get_size() < aligned_size) {
+    blk_set_next(blk, rejected);
+    rejected = blk;
+
+    blk = nullptr;
+    while(blk == nullptr && (_fl_bitmap & (1UL << mapping.fl)) != 0) {
+      blk = remove_block(nullptr, mapping);
+    }
+  }
+
+  while(rejected != nullptr) {
+    BlockHeader *next = blk_get_next(rejected);
+    insert_block(rejected);
+    rejected = next;
+  }
+
+  return blk;
+}
+
+template<typename Config>
+BlockHeader *JSMallocBase<Config>::get_block_containing_address(uintptr_t address) {
+  uintptr_t target_addr = (uintptr_t)address;
+  BlockHeader *current = reinterpret_cast<BlockHeader *>(_block_start);
+
+  while(current != nullptr) {
+    uintptr_t start = (uintptr_t)current;
+    uintptr_t end = start + _block_header_length + current->get_size();
+
+    if(target_addr >= start && target_addr <= end) {
+      return current;
+    }
+
+    current = get_next_phys_block(current);
+  }
+
+  return nullptr;
+}
+
+template<typename Config>
+JSMallocT<Config> *JSMallocT<Config>::create(void *pool, size_t pool_size, bool start_full) {
+  JSMallocT *jsmalloc = reinterpret_cast<JSMallocT *>(pool);
+  return new(jsmalloc) JSMallocT(reinterpret_cast<void *>((uintptr_t)pool + sizeof(JSMallocT)), pool_size - sizeof(JSMallocT), start_full);
+}
+
+template<typename Config>
+inline void JSMallocT<Config>::free(void *ptr) {
+  if(JSMALLOC_UNLIKELY(ptr == nullptr)) {
+    return;
+  }
+
+  if(JSMALLOC_UNLIKELY(!ptr_in_pool((uintptr_t)ptr))) {
+    return;
+  }
+
+  BlockHeader *blk = reinterpret_cast<BlockHeader *>((uintptr_t)ptr - _block_header_length);
+  BlockHeader *prev_blk, *next_blk, *next_next_blk;
+  size_t stripes[_max_locked_blocks];
+  size_t num_stripes;
+
+  // The neighbours are first read without holding any locks, and are validated
+  // again once the stripes covering them (and the block after next_blk, whose
+  // prev-free flag is updated if next_blk is coalesced) are locked. The
+  // previous block can only be found while it is free.
+  while(true) {
+    prev_blk = get_prev_phys_block(blk);
+    next_blk = get_next_phys_block(blk);
+    next_next_blk = (next_blk != nullptr && next_blk->is_free()) ? get_next_phys_block(next_blk) : nullptr;
+
+    BlockHeader *blks[] = {prev_blk, blk, next_blk, next_next_blk};
+    num_stripes = lock_phys_blocks(blks, 4, stripes);
+
+    bool next_valid = next_blk == nullptr || !next_blk->is_free() || get_next_phys_block(next_blk) == next_next_blk;
+    if(get_prev_phys_block(blk) == prev_blk && next_valid) {
+      break;
+    }
+
+    unlock_phys_blocks(stripes, num_stripes);
+  }
+
+  in_flight_counter()++;
+
+  // The block has been written to by its owner.
+  size_t freed_size = blk->get_size();
+  blk->mark_dirty();
+
+  // remove_block only succeeds if the neighbour is still free, which makes
+  // it safe to coalesce with.
+  if(prev_blk != nullptr && remove_block(prev_blk, get_mapping(prev_blk->get_size())) != nullptr) {
+    blk = coalesce_blocks(prev_blk, blk);
+  }
+
+  if(next_blk != nullptr && remove_block(next_blk, get_mapping(next_blk->get_size())) != nullptr) {
+    blk = coalesce_blocks(blk, next_blk);
+  }
+
+  insert_block(blk);
+
+  in_flight_counter()--;
+
+  size_t coalesced_size = blk->get_size();
+
+  unlock_phys_blocks(stripes, num_stripes);
+
+  count_free(freed_size);
+
+  if(_purge_threshold != 0 && coalesced_size >= _purge_min_block_size) {
+    maybe_purge(freed_size);
+  }
+}
+
+template<typename Config>
+void *JSMallocT<Config>::reallocate(void *ptr, size_t size) {
+  if(ptr == nullptr) {
+    return allocate(size);
+  }
+
+  if(!ptr_in_pool((uintptr_t)ptr)) {
+    return nullptr;
+  }
+
+  BlockHeader *blk = reinterpret_cast<BlockHeader *>((uintptr_t)ptr - _block_header_length);
+  size_t old_size = blk->get_size();
+  if(resize_in_place(blk, align_size(size))) {
+    // Counted as a free and an allocation, like a moved block.
+    count_free(old_size);
+    count_allocation(blk->get_size(), size);
+    return ptr;
+  }
+
+  void *new_ptr = allocate(size);
+  if(new_ptr == nullptr) {
+    return nullptr;
+  }
+
+  memcpy(new_ptr, ptr, std::min(blk->get_size(), size));
+  free(ptr);
+
+  return new_ptr;
+}
+
+template<typename Config>
+bool JSMallocT<Config>::resize_in_place(BlockHeader *blk, size_t aligned_size) {
+  // The header of the tail that would be split off, inside blk or the block
+  // after it.
+  BlockHeader *remainder_blk = reinterpret_cast<BlockHeader *>((uintptr_t)blk + _block_header_length + aligned_size);
+  BlockHeader *next_blk, *next_next_blk;
+  size_t stripes[_max_locked_blocks];
+  size_t num_stripes;
+
+  // Same as in free, blk's own header is stable since the caller owns it.
+  while(true) {
+    next_blk = get_next_phys_block(blk);
+    next_next_blk = (next_blk != nullptr && next_blk->is_free()) ? get_next_phys_block(next_blk) : nullptr;
+
+    BlockHeader *blks[] = {blk, remainder_blk, next_blk, next_next_blk};
+    num_stripes = lock_phys_blocks(blks, 4, stripes);
+
+    if(next_blk == nullptr || !next_blk->is_free() || get_next_phys_block(next_blk) == next_next_blk) {
+      break;
+    }
+
+    unlock_phys_blocks(stripes, num_stripes);
+  }
+
+  in_flight_counter()++;
+
+  // The block has been written to, so the tail must not be treated as purged.
+  blk->mark_dirty();
+
+  bool resized = true;
+  bool grown = false;
+  if(aligned_size > blk->get_size()) {
+    resized = false;
+
+    if(next_blk != nullptr && next_blk->is_free() &&
+       blk->get_size() + _block_header_length + next_blk->get_size() >= aligned_size &&
+       remove_block(next_blk, get_mapping(next_blk->get_size())) != nullptr) {
+      coalesce_blocks(blk, next_blk);
+      resized = true;
+      grown = true;
+    }
+  }
+
+  if(resized && blk->get_size() - aligned_size >= _min_block_size) {
+    BlockHeader *tail_blk = split_block(blk, aligned_size);
+
+    // When shrinking, the tail is merged with a free successor. When growing,
+    // the successor has already been absorbed.
+    if(!grown && next_blk != nullptr && remove_block(next_blk, get_mapping(next_blk->get_size())) != nullptr) {
+      tail_blk = coalesce_blocks(tail_blk, next_blk);
+    }
+
+    insert_block(tail_blk);
+  }
+
+  in_flight_counter()--;
+
+  unlock_phys_blocks(stripes, num_stripes);
+
+  return resized;
+}
+
+template<typename Config>
+void *JSMallocT<Config>::allocate_zeroed(size_t size) {
+  void *ptr = allocate(size);
+  if(ptr == nullptr) {
+    return nullptr;
+  }
+
+  BlockHeader *blk = reinterpret_cast<BlockHeader *>((uintptr_t)ptr - _block_header_length);
+  uintptr_t start = (uintptr_t)ptr;
+  uintptr_t end = start + size;
+
+  if(blk->is_purged()) {
+    uintptr_t zero_start, zero_end;
+    get_purge_range(blk, &zero_start, &zero_end);
+
+    if(zero_start < zero_end) {
+      memset(ptr, 0, std::min(end, zero_start) - start);
+      if(end > zero_end) {
+        memset(reinterpret_cast<void *>(zero_end), 0, end - zero_end);
+      }
+
+      return ptr;
+    }
+  }
+
+  memset(ptr, 0, size);
+
+  return ptr;
+}
+
+template<typename Config>
+void JSMallocT<Config>::set_purge_policy(size_t threshold, uint64_t decay_ms, size_t min_block_size) {
+  _purge_min_block_size = std::max(min_block_size, 2 * JSMallocUtil::page_size());
+  _purge_decay_ms = decay_ms;
+  _purge_threshold = threshold;
+  _last_purge_ms = JSMallocUtil::current_time_ms();
+}
+
+template<typename Config>
+size_t JSMallocT<Config>::purge(bool all) {
+  _purge_lock.lock();
+  size_t purged = purge_free_blocks(all);
+  _purge_lock.unlock();
+
+  return purged;
+}
+
+template<typename Config>
+size_t JSMallocT<Config>::purged_bytes() {
+  return _purged_bytes;
+}
+
+template<typename Config>
+void JSMallocT<Config>::maybe_purge(size_t size) {
+  size_t dirty_bytes = _dirty_bytes.fetch_add(size) + size;
+  if(dirty_bytes < _purge_threshold && JSMallocUtil::current_time_ms() - _last_purge_ms < _purge_decay_ms) {
+    return;
+  }
+
+  // Only one thread purges at a time, the others keep going.
+  if(_purge_lock.try_lock()) {
+    purge_free_blocks(false);
+    _purge_lock.unlock();
+  }
+}
+
+template<typename Config>
+size_t JSMallocT<Config>::purge_free_blocks(bool all) {
+  size_t page_size = JSMallocUtil::page_size();
+  size_t min_block_size = std::max(_purge_min_block_size, 2 * page_size);
+  size_t purged = 0;
+
+  for(size_t fl = get_mapping(min_block_size).fl; fl < _fl_index; fl++) {
+    if((_fl_bitmap & (1UL << fl)) == 0) {
+      continue;
+    }
+
+    // Holding the list lock keeps the blocks in the lists free.
+    _list_locks[fl].lock();
+
+    for(size_t sl = 0; sl < _sl_index; sl++) {
+      Mapping mapping = {fl, sl};
+
+      for(BlockHeader *blk = _blocks[flatten_mapping(mapping)]; blk != nullptr; blk = blk_get_next(blk)) {
+        if(blk->is_purged() || blk->get_size() < min_block_size) {
+          continue;
+        }
+
+        // The prev-free flag shares the size word, and is set by the previous
+        // block with only the stripe of this block locked. Stripes are locked
+        // before list locks, so a busy stripe is not waited for and the block
+        // is left for the next epoch instead.
+        std::mutex &stripe_lock = _phys_locks[((uintptr_t)blk >> _phys_lock_shift) % _num_phys_locks];
+        if(!stripe_lock.try_lock()) {
+          continue;
+        }
+
+        // Blocks are given one epoch to be reused before they are purged.
+        if(!all && !blk->is_idle()) {
+          blk->mark_idle();
+          stripe_lock.unlock();
+          continue;
+        }
+
+        uintptr_t start, end;
+        get_purge_range(blk, &start, &end);
+
+        if(start < end && madvise(reinterpret_cast<void *>(start), end - start, MADV_DONTNEED) == 0) {
+          blk->mark_purged();
+          purged += end - start;
+        }
+
+        stripe_lock.unlock();
+      }
+    }
+
+    _list_locks[fl].unlock();
+  }
+
+  _purged_bytes += purged;
+  _dirty_bytes = 0;
+  _last_purge_ms = JSMallocUtil::current_time_ms();
+
+  return purged;
+}
+
+template<typename Config>
+void JSMallocT<Config>::get_purge_range(BlockHeader *blk, uintptr_t *start, uintptr_t *end) {
+  size_t page_size = JSMallocUtil::page_size();
+  uintptr_t payload = (uintptr_t)blk + _block_header_length;
+
+  *start = JSMallocUtil::align_up((uintptr_t)blk + sizeof(BlockHeader), page_size);
+  *end = JSMallocUtil::align_down(payload + blk->get_size() - _footer_length, page_size);
+}
+
+template<typename Config>
+size_t JSMallocT<Config>::get_allocated_size(void *address) {
+  BlockHeader *blk = reinterpret_cast<BlockHeader *>((uintptr_t)address - _block_header_length);
+  return blk->get_size();
+}
+
+#endif // JSMALLOC_INLINE_HPP
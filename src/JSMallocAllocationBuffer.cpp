@@ -0,0 +1,61 @@
+
+// Author: Joel Sikström
+
+#include "JSMalloc.inline.hpp"
+#include "JSMallocAllocationBuffer.hpp"
+
+void *JSMallocAllocationBuffer::allocate(JSMallocZ *allocator, size_t size) {
+  size_t aligned_size = allocator->align_size(size);
+  if(aligned_size > MaxBumpSize) {
+    return allocator->allocate(size);
+  }
+
+  if(_end - _top < aligned_size && !refill(allocator)) {
+    return allocator->allocate(size);
+  }
+
+  void *ptr = reinterpret_cast<void *>(_top);
+  _top += aligned_size;
+
+  // Each object is counted as its own allocation, since it is freed as one.
+  allocator->count_allocation(aligned_size, size);
+
+  if(allocator->has_side_table()) {
+    allocator->mark_allocated((uintptr_t)ptr, aligned_size);
+  }
+
+  return ptr;
+}
+
+void JSMallocAllocationBuffer::retire(JSMallocZ *allocator) {
+  // The tail was never counted as an allocation, so it is inserted directly
+  // instead of being freed.
+  if(_top < _end) {
+    BlockHeader *blk = reinterpret_cast<BlockHeader *>(_top);
+    blk->size = _end - _top;
+    allocator->insert_block(blk);
+  }
+
+  _top = 0;
+  _end = 0;
+}
+
+size_t JSMallocAllocationBuffer::remaining() {
+  return _end - _top;
+}
+
+bool JSMallocAllocationBuffer::refill(JSMallocZ *allocator) {
+  // The buffer itself is neither recorded in the side table nor counted in
+  // the statistics, only the objects bumped out of it are.
+  BlockHeader *blk = allocator->find_block(BufferSize);
+  if(blk == nullptr) {
+    return false;
+  }
+
+  retire(allocator);
+
+  _top = (uintptr_t)blk;
+  _end = _top + blk->get_size();
+
+  return true;
+}
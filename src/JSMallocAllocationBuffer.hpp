@@ -0,0 +1,41 @@
+
+// Author: Joel Sikström
+
+#ifndef JSMALLOC_ALLOCATION_BUFFER_HPP
+#define JSMALLOC_ALLOCATION_BUFFER_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+#include "JSMalloc.hpp"
+
+// A per-thread allocation buffer in front of a JSMallocZ instance, similar to
+// a TLAB. A large block is taken from the allocator, and small requests are
+// served by bumping a pointer through it. Since JSMallocZ blocks have no
+// header, the objects are regular blocks that can be freed with free(ptr,
+// size), free_range or the side table, or reclaimed by coalescing. The
+// unused tail is handed back with free_range when the buffer is retired.
+//
+// The class is intentionally trivially constructible so that it can be used
+// as a zero-initialized thread_local.
+class JSMallocAllocationBuffer {
+public:
+  static const size_t BufferSize = 64 * 1024;
+  // Larger requests are passed on to the allocator.
+  static const size_t MaxBumpSize = BufferSize / 8;
+
+  void *allocate(JSMallocZ *allocator, size_t size);
+
+  // Returns the unused tail of the buffer to the allocator.
+  void retire(JSMallocZ *allocator);
+
+  size_t remaining();
+
+private:
+  uintptr_t _top;
+  uintptr_t _end;
+
+  bool refill(JSMallocZ *allocator);
+};
+
+#endif // JSMALLOC_ALLOCATION_BUFFER_HPP
@@ -0,0 +1,185 @@
+
+// Author: Joel Sikström
+
+#include <sched.h>
+#include <sys/mman.h>
+
+#include "JSMalloc.inline.hpp"
+#include "JSMallocArena.hpp"
+
+std::atomic<size_t> JSMallocArenas::_next_thread(0);
+
+// Slots are assigned once per thread and policy, so that a thread keeps using
+// the same arena even if it migrates to another CPU.
+static thread_local size_t cpu_slot = std::numeric_limits<size_t>::max();
+static thread_local size_t round_robin_slot = std::numeric_limits<size_t>::max();
+
+JSMallocArenas::JSMallocArenas(void *pool, size_t pool_size, size_t num_arenas, ArenaBinding binding) {
+  if(num_arenas == 0) {
+    num_arenas = 1;
+  } else if(num_arenas > MaxArenas) {
+    num_arenas = MaxArenas;
+  }
+
+  _num_arenas = num_arenas;
+  _binding = binding;
+  _arena_start = JSMallocUtil::align_up((uintptr_t)pool, alignof(JSMalloc));
+  _arena_size = JSMallocUtil::align_down((pool_size - (_arena_start - (uintptr_t)pool)) / num_arenas, alignof(JSMalloc));
+
+  _region_map.clear();
+
+  for(size_t i = 0; i < _num_arenas; i++) {
+    void *arena_pool = reinterpret_cast<void *>(_arena_start + i * _arena_size);
+    _arenas[i] = JSMalloc::create(arena_pool, _arena_size);
+    _slabs[i] = nullptr;
+
+    _contexts[i] = {this, static_cast<uint16_t>(i)};
+    _arenas[i]->set_region_provider({map_arena_region, &_contexts[i]});
+  }
+}
+
+JSMallocArenas *JSMallocArenas::create(void *pool, size_t pool_size, size_t num_arenas, ArenaBinding binding) {
+  JSMallocArenas *arenas = reinterpret_cast<JSMallocArenas *>(pool);
+  return new(arenas) JSMallocArenas(reinterpret_cast<void *>((uintptr_t)pool + sizeof(JSMallocArenas)), pool_size - sizeof(JSMallocArenas), num_arenas, binding);
+}
+
+void *JSMallocArenas::allocate(size_t size) {
+  size_t slot = thread_slot();
+
+  // Fall back to the other arenas if the thread's own arena is exhausted.
+  for(size_t i = 0; i < _num_arenas; i++) {
+    void *ptr = _arenas[(slot + i) % _num_arenas]->allocate(size);
+    if(ptr != nullptr) {
+      return ptr;
+    }
+  }
+
+  return nullptr;
+}
+
+void *JSMallocArenas::allocate_aligned(size_t size, size_t alignment) {
+  size_t slot = thread_slot();
+
+  for(size_t i = 0; i < _num_arenas; i++) {
+    void *ptr = _arenas[(slot + i) % _num_arenas]->allocate_aligned(size, alignment);
+    if(ptr != nullptr) {
+      return ptr;
+    }
+  }
+
+  return nullptr;
+}
+
+void JSMallocArenas::free(void *ptr) {
+  JSMalloc *owner = get_owner(ptr);
+  if(owner != nullptr) {
+    owner->free(ptr);
+  }
+}
+
+JSMalloc *JSMallocArenas::get_arena() {
+  return _arenas[thread_slot() % _num_arenas];
+}
+
+JSMalloc *JSMallocArenas::get_owner(void *ptr) {
+  size_t index = owner_index(ptr);
+  return index < _num_arenas ? _arenas[index] : nullptr;
+}
+
+bool JSMallocArenas::enable_slabs(size_t cutoff) {
+  for(size_t i = 0; i < _num_arenas; i++) {
+    if(_slabs[i] == nullptr) {
+      _slabs[i] = JSMallocSlabs::create(_arenas[i], cutoff);
+      if(_slabs[i] == nullptr) {
+        return false;
+      }
+    }
+  }
+
+  return true;
+}
+
+JSMallocSlabs *JSMallocArenas::get_slabs() {
+  return _slabs[thread_slot() % _num_arenas];
+}
+
+JSMallocSlabs *JSMallocArenas::get_owner_slabs(void *ptr) {
+  size_t index = owner_index(ptr);
+  return index < _num_arenas ? _slabs[index] : nullptr;
+}
+
+size_t JSMallocArenas::num_arenas() {
+  return _num_arenas;
+}
+
+void JSMallocArenas::stats(JSMallocStats &stats) {
+  stats = {};
+
+  for(size_t i = 0; i < _num_arenas; i++) {
+    JSMallocStats arena_stats;
+    _arenas[i]->stats(arena_stats);
+    stats.add(arena_stats);
+  }
+}
+
+void JSMallocArenas::fragmentation(JSMallocFragmentation &fragmentation) {
+  fragmentation = {};
+
+  for(size_t i = 0; i < _num_arenas; i++) {
+    JSMallocFragmentation arena_fragmentation;
+    _arenas[i]->fragmentation(arena_fragmentation);
+    fragmentation.add(arena_fragmentation);
+  }
+}
+
+void JSMallocArenas::set_purge_policy(size_t threshold, uint64_t decay_ms, size_t min_block_size) {
+  for(size_t i = 0; i < _num_arenas; i++) {
+    _arenas[i]->set_purge_policy(threshold, decay_ms, min_block_size);
+  }
+}
+
+void *JSMallocArenas::map_arena_region(void *context, size_t size, size_t alignment) {
+  ArenaContext *arena_context = static_cast<ArenaContext *>(context);
+
+  void *region = JSMalloc::mmap_region(nullptr, size, alignment);
+  if(region == nullptr) {
+    return nullptr;
+  }
+
+  if(!arena_context->arenas->_region_map.insert((uintptr_t)region, size, arena_context->index)) {
+    munmap(region, size);
+    return nullptr;
+  }
+
+  return region;
+}
+
+size_t JSMallocArenas::owner_index(void *ptr) {
+  uintptr_t address = (uintptr_t)ptr;
+  if(address >= _arena_start) {
+    size_t index = (address - _arena_start) / _arena_size;
+    if(index < _num_arenas) {
+      return index;
+    }
+  }
+
+  uint32_t index = _region_map.lookup(address);
+  return index != JSMallocRegionMap::NOT_FOUND ? index : _num_arenas;
+}
+
+size_t JSMallocArenas::thread_slot() {
+  if(_binding == ArenaBinding::CPU) {
+    if(cpu_slot == std::numeric_limits<size_t>::max()) {
+      int cpu = sched_getcpu();
+      cpu_slot = (cpu < 0) ? _next_thread.fetch_add(1) : static_cast<size_t>(cpu);
+    }
+
+    return cpu_slot;
+  }
+
+  if(round_robin_slot == std::numeric_limits<size_t>::max()) {
+    round_robin_slot = _next_thread.fetch_add(1);
+  }
+
+  return round_robin_slot;
+}
@@ -0,0 +1,91 @@
+
+// Author: Joel Sikström
+
+#ifndef JSMALLOC_ARENA_HPP
+#define JSMALLOC_ARENA_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include "JSMalloc.hpp"
+#include "JSMallocSlab.hpp"
+
+enum class ArenaBinding {
+  // Threads are bound to the arena of the CPU they first allocate on.
+  CPU,
+  // Threads are bound to arenas in the order they first allocate.
+  RoundRobin
+};
+
+// Splits one pool into a number of equally sized JSMalloc arenas, each with
+// its own free-lists, bitmaps and lock. Threads are bound to an arena on
+// their first allocation, and pointers are routed back to their owning arena
+// using the address range of the pool, which is a constant-time lookup.
+// Arenas grow with regions mapped by the manager, which are registered in a
+// region map so that they can be routed in constant time as well.
+class JSMallocArenas {
+public:
+  static const size_t MaxArenas = 64;
+
+  JSMallocArenas(void *pool, size_t pool_size, size_t num_arenas, ArenaBinding binding);
+
+  static JSMallocArenas *create(void *pool, size_t pool_size, size_t num_arenas,
+                                ArenaBinding binding = ArenaBinding::CPU);
+
+  void *allocate(size_t size);
+  void *allocate_aligned(size_t size, size_t alignment);
+  void free(void *ptr);
+
+  // The arena the calling thread is bound to.
+  JSMalloc *get_arena();
+
+  // The arena that ptr was allocated from, or nullptr if ptr is not in any of
+  // the arenas.
+  JSMalloc *get_owner(void *ptr);
+
+  // Adds a slab front-end for requests of at most cutoff bytes to every
+  // arena. Returns false if any of them could not be created.
+  bool enable_slabs(size_t cutoff);
+
+  // The slabs of the calling thread's arena, or nullptr if not enabled.
+  JSMallocSlabs *get_slabs();
+
+  // The slabs of the arena that ptr was allocated from, if any.
+  JSMallocSlabs *get_owner_slabs(void *ptr);
+
+  size_t num_arenas();
+
+  // Sums the statistics of every arena.
+  void stats(JSMallocStats &stats);
+  void fragmentation(JSMallocFragmentation &fragmentation);
+
+  // Applies JSMalloc::set_purge_policy to every arena.
+  void set_purge_policy(size_t threshold, uint64_t decay_ms, size_t min_block_size);
+
+private:
+  struct ArenaContext {
+    JSMallocArenas *arenas;
+    uint16_t index;
+  };
+
+  size_t _num_arenas;
+  ArenaBinding _binding;
+  uintptr_t _arena_start;
+  size_t _arena_size;
+  JSMalloc *_arenas[MaxArenas];
+  JSMallocSlabs *_slabs[MaxArenas];
+  ArenaContext _contexts[MaxArenas];
+  JSMallocRegionMap _region_map;
+
+  static std::atomic<size_t> _next_thread;
+
+  size_t thread_slot();
+
+  // Returns _num_arenas if ptr is not in any of the arenas.
+  size_t owner_index(void *ptr);
+
+  static void *map_arena_region(void *context, size_t size, size_t alignment);
+};
+
+#endif // JSMALLOC_ARENA_HPP
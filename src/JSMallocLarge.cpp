@@ -0,0 +1,178 @@
+
+// Author: Joel Sikström
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "JSMallocLarge.hpp"
+#include "JSMallocUtil.inline.hpp"
+
+static size_t get_page_size() {
+  static const size_t page_size = sysconf(_SC_PAGESIZE);
+  return page_size;
+}
+
+void *JSMallocLargeObjects::allocate(size_t size) {
+  size_t mapping_size = get_mapping_size(size);
+  if(mapping_size == 0) {
+    return nullptr;
+  }
+
+  void *mapping = mmap(nullptr, mapping_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(mapping == MAP_FAILED) {
+    return nullptr;
+  }
+
+  _lock.lock();
+  bool inserted = insert((uintptr_t)mapping);
+  _lock.unlock();
+
+  if(!inserted) {
+    munmap(mapping, mapping_size);
+    return nullptr;
+  }
+
+  static_cast<Header *>(mapping)->mapping_size = mapping_size;
+
+  return reinterpret_cast<void *>((uintptr_t)mapping + HeaderSize);
+}
+
+bool JSMallocLargeObjects::free(void *ptr) {
+  if(!contains(ptr)) {
+    return false;
+  }
+
+  Header *header = get_header(ptr);
+  size_t mapping_size = header->mapping_size;
+
+  _lock.lock();
+  erase((uintptr_t)header);
+  _lock.unlock();
+
+  munmap(header, mapping_size);
+
+  return true;
+}
+
+void *JSMallocLargeObjects::reallocate(void *ptr, size_t size) {
+  size_t mapping_size = get_mapping_size(size);
+  if(mapping_size == 0) {
+    return nullptr;
+  }
+
+  Header *header = get_header(ptr);
+  size_t old_mapping_size = header->mapping_size;
+  if(mapping_size == old_mapping_size) {
+    return ptr;
+  }
+
+  // The entry is removed first, since another thread may map something at
+  // the old address as soon as mremap has moved the pages.
+  _lock.lock();
+  erase((uintptr_t)header);
+  _lock.unlock();
+
+  void *mapping = mremap(header, old_mapping_size, mapping_size, MREMAP_MAYMOVE);
+  bool remapped = mapping != MAP_FAILED;
+  if(!remapped) {
+    mapping = header;
+  }
+
+  // Can not fail, since the entry of ptr was just removed.
+  _lock.lock();
+  insert((uintptr_t)mapping);
+  _lock.unlock();
+
+  if(!remapped) {
+    return nullptr;
+  }
+
+  static_cast<Header *>(mapping)->mapping_size = mapping_size;
+
+  return reinterpret_cast<void *>((uintptr_t)mapping + HeaderSize);
+}
+
+bool JSMallocLargeObjects::contains(void *ptr) {
+  uintptr_t base = (uintptr_t)ptr - HeaderSize;
+
+  // Large objects always start right after a page-aligned header.
+  if(ptr == nullptr || !JSMallocUtil::is_aligned(base, get_page_size())) {
+    return false;
+  }
+
+  _lock.lock();
+  bool found = _entries[find_slot(base)] == base;
+  _lock.unlock();
+
+  return found;
+}
+
+size_t JSMallocLargeObjects::get_allocated_size(void *ptr) {
+  return get_header(ptr)->mapping_size - HeaderSize;
+}
+
+size_t JSMallocLargeObjects::num_objects() {
+  _lock.lock();
+  size_t num_objects = _num_objects;
+  _lock.unlock();
+
+  return num_objects;
+}
+
+JSMallocLargeObjects::Header *JSMallocLargeObjects::get_header(void *ptr) {
+  return reinterpret_cast<Header *>((uintptr_t)ptr - HeaderSize);
+}
+
+size_t JSMallocLargeObjects::get_mapping_size(size_t size) {
+  if(size > std::numeric_limits<size_t>::max() - HeaderSize - get_page_size()) {
+    return 0;
+  }
+
+  return JSMallocUtil::align_up(size + HeaderSize, get_page_size());
+}
+
+size_t JSMallocLargeObjects::find_slot(uintptr_t base) {
+  // Linear probing from a multiplicative hash of the page number. Returns the
+  // slot holding base, or the empty slot where it would be inserted.
+  size_t index = ((base >> 12) * 0x9E3779B97F4A7C15UL) >> (64 - CapacityLog2);
+
+  while(_entries[index] != 0 && _entries[index] != base) {
+    index = (index + 1) % Capacity;
+  }
+
+  return index;
+}
+
+bool JSMallocLargeObjects::insert(uintptr_t base) {
+  // Keep at least one slot empty so that probing always terminates.
+  if(_num_objects == Capacity - 1) {
+    return false;
+  }
+
+  _entries[find_slot(base)] = base;
+  _num_objects++;
+
+  return true;
+}
+
+bool JSMallocLargeObjects::erase(uintptr_t base) {
+  size_t index = find_slot(base);
+  if(_entries[index] != base) {
+    return false;
+  }
+
+  _entries[index] = 0;
+  _num_objects--;
+
+  // Shift back the following entries of the cluster that would no longer be
+  // reachable from their home slot.
+  size_t next = (index + 1) % Capacity;
+  while(_entries[next] != 0) {
+    uintptr_t entry = _entries[next];
+    _entries[next] = 0;
+    _entries[find_slot(entry)] = entry;
+    next = (next + 1) % Capacity;
+  }
+
+  return true;
+}
@@ -0,0 +1,61 @@
+
+// Author: Joel Sikström
+
+#ifndef JSMALLOC_LARGE_HPP
+#define JSMALLOC_LARGE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+// Serves large allocations from dedicated page-aligned mappings instead of
+// the TLSF pool, so that huge blocks never fragment the top first-level
+// lists, are returned to the OS as soon as they are freed, and can be resized
+// with mremap instead of being copied.
+//
+// Each mapping starts with a small header holding its size, followed by the
+// payload. The start of every mapping is kept in a fixed-size hash set, so
+// that the registry itself never has to allocate. The class is trivially
+// constructible and can be used as a zero-initialized global.
+class JSMallocLargeObjects {
+public:
+  static const size_t CapacityLog2 = 12;
+  static const size_t Capacity = 1UL << CapacityLog2;
+  static const size_t HeaderSize = 64;
+
+  // Returns nullptr if the mapping fails or the registry is full.
+  void *allocate(size_t size);
+
+  // Returns false if ptr is not a large object.
+  bool free(void *ptr);
+
+  // Resizes the mapping of ptr with mremap, which may move it without
+  // copying the payload. Returns nullptr and leaves ptr untouched on failure.
+  void *reallocate(void *ptr, size_t size);
+
+  bool contains(void *ptr);
+
+  // The usable size of the large object at ptr.
+  size_t get_allocated_size(void *ptr);
+
+  size_t num_objects();
+
+private:
+  struct Header {
+    size_t mapping_size;
+  };
+
+  std::mutex _lock;
+  uintptr_t _entries[Capacity];
+  size_t _num_objects;
+
+  static Header *get_header(void *ptr);
+  static size_t get_mapping_size(size_t size);
+
+  // The following methods must be called with _lock held.
+  size_t find_slot(uintptr_t base);
+  bool insert(uintptr_t base);
+  bool erase(uintptr_t base);
+};
+
+#endif // JSMALLOC_LARGE_HPP
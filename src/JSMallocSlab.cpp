@@ -0,0 +1,311 @@
+
+// Author: Joel Sikström
+
+#include <algorithm>
+#include <new>
+
+#include "JSMalloc.inline.hpp"
+#include "JSMallocSlab.hpp"
+
+JSMallocSlabs::JSMallocSlabs(JSMalloc *allocator, size_t cutoff) {
+  _allocator = allocator;
+  _cutoff = JSMallocUtil::align_down(std::min(cutoff, MaxCutoff), Granularity);
+  _num_slabs = 0;
+
+  for(size_t i = 0; i < NumClasses; i++) {
+    _classes[i].partial = nullptr;
+  }
+
+  for(size_t i = 0; i < RegistryCapacity; i++) {
+    _registry[i] = EMPTY;
+  }
+  _registry_version = 0;
+  _num_tombstones = 0;
+}
+
+JSMallocSlabs *JSMallocSlabs::create(JSMalloc *allocator, size_t cutoff) {
+  void *memory = allocator->allocate(sizeof(JSMallocSlabs));
+  if(memory == nullptr) {
+    return nullptr;
+  }
+
+  return new(memory) JSMallocSlabs(allocator, cutoff);
+}
+
+size_t JSMallocSlabs::cutoff() {
+  return _cutoff;
+}
+
+void *JSMallocSlabs::allocate(size_t size) {
+  if(size > _cutoff) {
+    return nullptr;
+  }
+
+  size_t class_index = (size == 0) ? 0 : (size - 1) / Granularity;
+  SizeClass &size_class = _classes[class_index];
+
+  size_class.lock.lock();
+
+  Slab *slab = size_class.partial;
+  if(slab == nullptr) {
+    slab = add_slab(class_index);
+    if(slab == nullptr) {
+      size_class.lock.unlock();
+      return nullptr;
+    }
+
+    link_slab(size_class, slab);
+  }
+
+  size_t word = 0;
+  while(slab->free_bits[word] == 0) {
+    word++;
+  }
+
+  size_t bit = JSMallocUtil::ffs(slab->free_bits[word]);
+  slab->free_bits[word] &= ~(1UL << bit);
+  slab->num_free--;
+
+  // Full slabs are only found again through their objects.
+  if(slab->num_free == 0) {
+    unlink_slab(size_class, slab);
+  }
+
+  size_class.lock.unlock();
+
+  size_t index = word * 64 + bit;
+  return reinterpret_cast<void *>((uintptr_t)slab + ObjectsOffset + index * slab->object_size);
+}
+
+bool JSMallocSlabs::free(void *ptr) {
+  if(!contains(ptr)) {
+    return false;
+  }
+
+  Slab *slab = get_slab(ptr);
+  SizeClass &size_class = _classes[slab->object_size / Granularity - 1];
+
+  size_t offset = (uintptr_t)ptr - (uintptr_t)slab - ObjectsOffset;
+  size_t index = offset / slab->object_size;
+  uint64_t mask = 1UL << (index % 64);
+
+  size_class.lock.lock();
+
+  // Interior pointers and double frees are ignored.
+  if(offset % slab->object_size != 0 || index >= slab->num_objects || (slab->free_bits[index / 64] & mask) != 0) {
+    size_class.lock.unlock();
+    return true;
+  }
+
+  slab->free_bits[index / 64] |= mask;
+  slab->num_free++;
+
+  if(slab->num_free == 1) {
+    link_slab(size_class, slab);
+  }
+
+  // Empty slabs are given back, unless it is the only one with free objects,
+  // so that a single object going back and forth does not map a slab each time.
+  if(slab->num_free == slab->num_objects && (slab->next != nullptr || slab->prev != nullptr)) {
+    release_slab(size_class, slab);
+  }
+
+  size_class.lock.unlock();
+
+  return true;
+}
+
+bool JSMallocSlabs::contains(void *ptr) {
+  uintptr_t base = (uintptr_t)get_slab(ptr);
+  if(ptr == nullptr || (uintptr_t)ptr - base < ObjectsOffset) {
+    return false;
+  }
+
+  while(true) {
+    size_t version = _registry_version.load();
+    if(version % 2 == 0) {
+      bool found = registry_contains(base);
+      if(_registry_version.load() == version) {
+        return found;
+      }
+    }
+  }
+}
+
+size_t JSMallocSlabs::get_allocated_size(void *ptr) {
+  return get_slab(ptr)->object_size;
+}
+
+size_t JSMallocSlabs::num_slabs() {
+  return _num_slabs;
+}
+
+JSMallocSlabs::Slab *JSMallocSlabs::add_slab(size_t class_index) {
+  void *memory = _allocator->allocate_aligned(SlabSize, SlabSize);
+  if(memory == nullptr) {
+    return nullptr;
+  }
+
+  if(!register_slab((uintptr_t)memory)) {
+    _allocator->free(memory);
+    return nullptr;
+  }
+
+  Slab *slab = static_cast<Slab *>(memory);
+  slab->next = nullptr;
+  slab->prev = nullptr;
+  slab->object_size = (class_index + 1) * Granularity;
+  slab->num_objects = (SlabSize - ObjectsOffset) / slab->object_size;
+  slab->num_free = slab->num_objects;
+
+  for(size_t i = 0; i < NumBitmapWords; i++) {
+    size_t first = i * 64;
+    if(first >= slab->num_objects) {
+      slab->free_bits[i] = 0;
+    } else if(slab->num_objects - first >= 64) {
+      slab->free_bits[i] = ~0UL;
+    } else {
+      slab->free_bits[i] = (1UL << (slab->num_objects - first)) - 1;
+    }
+  }
+
+  _num_slabs++;
+
+  return slab;
+}
+
+void JSMallocSlabs::release_slab(SizeClass &size_class, Slab *slab) {
+  unlink_slab(size_class, slab);
+  unregister_slab((uintptr_t)slab);
+  _num_slabs--;
+
+  _allocator->free(slab);
+}
+
+void JSMallocSlabs::link_slab(SizeClass &size_class, Slab *slab) {
+  slab->prev = nullptr;
+  slab->next = size_class.partial;
+  if(size_class.partial != nullptr) {
+    size_class.partial->prev = slab;
+  }
+  size_class.partial = slab;
+}
+
+void JSMallocSlabs::unlink_slab(SizeClass &size_class, Slab *slab) {
+  if(slab->prev != nullptr) {
+    slab->prev->next = slab->next;
+  } else {
+    size_class.partial = slab->next;
+  }
+
+  if(slab->next != nullptr) {
+    slab->next->prev = slab->prev;
+  }
+
+  slab->next = nullptr;
+  slab->prev = nullptr;
+}
+
+JSMallocSlabs::Slab *JSMallocSlabs::get_slab(void *ptr) {
+  return reinterpret_cast<Slab *>(JSMallocUtil::align_down((uintptr_t)ptr, SlabSize));
+}
+
+size_t JSMallocSlabs::registry_index(uintptr_t base) {
+  return ((base >> SlabSizeLog2) * 0x9E3779B97F4A7C15UL) >> (64 - RegistryCapacityLog2);
+}
+
+bool JSMallocSlabs::registry_contains(uintptr_t base) {
+  size_t index = registry_index(base);
+  for(size_t probes = 0; probes < RegistryCapacity; probes++) {
+    uintptr_t entry = _registry[index].load();
+    if(entry == base) {
+      return true;
+    }
+
+    if(entry == EMPTY) {
+      return false;
+    }
+
+    index = (index + 1) % RegistryCapacity;
+  }
+
+  return false;
+}
+
+bool JSMallocSlabs::register_slab(uintptr_t base) {
+  std::lock_guard<std::mutex> guard(_registry_lock);
+
+  // Removed entries are left as tombstones, which inserts can reuse, so that
+  // lock-free lookups never stop early at a hole.
+  size_t index = registry_index(base);
+  for(size_t probes = 0; probes < RegistryCapacity; probes++) {
+    uintptr_t entry = _registry[index];
+    if(entry == EMPTY || entry == TOMBSTONE) {
+      _num_tombstones -= (entry == TOMBSTONE);
+      _registry[index] = base;
+      return true;
+    }
+
+    index = (index + 1) % RegistryCapacity;
+  }
+
+  return false;
+}
+
+void JSMallocSlabs::unregister_slab(uintptr_t base) {
+  std::lock_guard<std::mutex> guard(_registry_lock);
+
+  size_t index = registry_index(base);
+  for(size_t probes = 0; probes < RegistryCapacity; probes++) {
+    if(_registry[index] == base) {
+      _registry[index] = TOMBSTONE;
+      _num_tombstones++;
+      break;
+    }
+
+    index = (index + 1) % RegistryCapacity;
+  }
+
+  // Tombstones lengthen every lookup that misses, which is every free of a
+  // regular block, so they are dropped once there are too many of them.
+  if(_num_tombstones > RegistryCapacity / 8) {
+    rebuild_registry();
+  }
+}
+
+void JSMallocSlabs::rebuild_registry() {
+  _registry_version++;
+
+  for(size_t i = 0; i < RegistryCapacity; i++) {
+    if(_registry[i] == TOMBSTONE) {
+      _registry[i] = EMPTY;
+    }
+  }
+  _num_tombstones = 0;
+
+  // Starting after an empty entry, every entry is moved to the first empty
+  // entry from its home. Entries before it have already been placed, so an
+  // entry only ever moves towards its home.
+  size_t start = 0;
+  while(_registry[start] != EMPTY) {
+    start++;
+  }
+
+  for(size_t i = 1; i <= RegistryCapacity; i++) {
+    size_t index = (start + i) % RegistryCapacity;
+    uintptr_t entry = _registry[index];
+    if(entry == EMPTY) {
+      continue;
+    }
+
+    _registry[index] = EMPTY;
+
+    size_t target = registry_index(entry);
+    while(_registry[target] != EMPTY) {
+      target = (target + 1) % RegistryCapacity;
+    }
+    _registry[target] = entry;
+  }
+
+  _registry_version++;
+}
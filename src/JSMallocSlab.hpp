@@ -0,0 +1,114 @@
+
+// Author: Joel Sikström
+
+#ifndef JSMALLOC_SLAB_HPP
+#define JSMALLOC_SLAB_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+#include "JSMalloc.hpp"
+
+// A slab front-end for tiny allocations, which would otherwise pay for a
+// block header and be rounded up to the minimum payload of a block. Slabs are
+// SlabSize-aligned blocks taken from a JSMalloc instance, each holding
+// objects of a single size class without any per-object header. Free objects
+// are tracked in a bitmap at the start of the slab.
+//
+// The slab of an object is found by aligning its address down, and the slab
+// bases are kept in a hash set with lock-free lookups, so that objects can be
+// told apart from regular blocks of the same allocator when they are freed.
+class JSMallocSlabs {
+public:
+  static const size_t SlabSizeLog2 = 14;
+  static const size_t SlabSize = 1UL << SlabSizeLog2;
+
+  // Size classes are multiples of Granularity, up to MaxCutoff. Objects are
+  // Granularity apart, which keeps them aligned the way malloc has to.
+  static const size_t Granularity = 16;
+  static_assert(Granularity % alignof(max_align_t) == 0, "Slab objects must be aligned to max_align_t");
+  static const size_t MaxCutoff = 64;
+  static const size_t NumClasses = MaxCutoff / Granularity;
+
+  static const size_t RegistryCapacityLog2 = 13;
+  static const size_t RegistryCapacity = 1UL << RegistryCapacityLog2;
+
+  // Requests of at most cutoff bytes are served from slabs.
+  JSMallocSlabs(JSMalloc *allocator, size_t cutoff);
+
+  // Places the slab front-end in memory taken from allocator.
+  static JSMallocSlabs *create(JSMalloc *allocator, size_t cutoff);
+
+  size_t cutoff();
+
+  // Returns nullptr if size is above the cutoff or no slab could be added.
+  void *allocate(size_t size);
+
+  // Returns false if ptr is not a slab object, in which case it has to be
+  // freed by the allocator.
+  bool free(void *ptr);
+
+  bool contains(void *ptr);
+
+  // The size class of the slab object at ptr.
+  size_t get_allocated_size(void *ptr);
+
+  size_t num_slabs();
+
+private:
+  static const size_t MaxObjects = SlabSize / Granularity;
+  static const size_t NumBitmapWords = MaxObjects / 64;
+
+  static const uintptr_t EMPTY = 0;
+  static const uintptr_t TOMBSTONE = 1;
+
+  // Lives at the start of every slab, followed by the objects.
+  struct Slab {
+    Slab *next;
+    Slab *prev;
+    uint32_t object_size;
+    uint32_t num_objects;
+    uint32_t num_free;
+    // Set bits are free objects.
+    uint64_t free_bits[NumBitmapWords];
+  };
+
+  static const size_t ObjectsOffset = (sizeof(Slab) + Granularity - 1) & ~(Granularity - 1);
+
+  // Slabs with at least one free object, per size class.
+  struct SizeClass {
+    std::mutex lock;
+    Slab *partial;
+  };
+
+  JSMalloc *_allocator;
+  size_t _cutoff;
+  SizeClass _classes[NumClasses];
+  std::atomic<uintptr_t> _registry[RegistryCapacity];
+  std::atomic<size_t> _num_slabs;
+
+  // Serializes changes to the registry. The version is odd while the
+  // registry is rebuilt, and lookups that overlap a rebuild are retried.
+  std::mutex _registry_lock;
+  std::atomic<size_t> _registry_version;
+  size_t _num_tombstones;
+
+  Slab *add_slab(size_t class_index);
+  void release_slab(SizeClass &size_class, Slab *slab);
+
+  void link_slab(SizeClass &size_class, Slab *slab);
+  void unlink_slab(SizeClass &size_class, Slab *slab);
+
+  static Slab *get_slab(void *ptr);
+  static size_t registry_index(uintptr_t base);
+  bool registry_contains(uintptr_t base);
+  bool register_slab(uintptr_t base);
+  void unregister_slab(uintptr_t base);
+
+  // Drops all tombstones, must be called with _registry_lock held.
+  void rebuild_registry();
+};
+
+#endif // JSMALLOC_SLAB_HPP
@@ -0,0 +1,83 @@
+
+// Author: Joel Sikström
+
+#include "JSMalloc.inline.hpp"
+#include "JSMallocThreadCache.hpp"
+
+static void *cached_get_next(void *ptr) {
+  return *reinterpret_cast<void **>(ptr);
+}
+
+static void cached_set_next(void *ptr, void *next) {
+  *reinterpret_cast<void **>(ptr) = next;
+}
+
+void *JSMallocThreadCache::allocate(JSMalloc *allocator, size_t size) {
+  size_t aligned_size = allocator->align_size(size);
+  if(aligned_size >= MaxCachedSize) {
+    return allocator->allocate(size);
+  }
+
+  Bin &bin = _bins[allocator->flatten_mapping(allocator->get_mapping(aligned_size))];
+
+  if(bin.head == nullptr && !refill(allocator, bin, aligned_size)) {
+    return nullptr;
+  }
+
+  void *ptr = bin.head;
+  bin.head = cached_get_next(ptr);
+  bin.count--;
+
+  return ptr;
+}
+
+void JSMallocThreadCache::free(JSMalloc *allocator, void *ptr) {
+  if(ptr == nullptr || !allocator->ptr_in_pool((uintptr_t)ptr)) {
+    return;
+  }
+
+  size_t size = allocator->get_allocated_size(ptr);
+  if(size >= MaxCachedSize) {
+    allocator->free(ptr);
+    return;
+  }
+
+  Bin &bin = _bins[allocator->flatten_mapping(allocator->get_mapping(size))];
+
+  cached_set_next(ptr, bin.head);
+  bin.head = ptr;
+  bin.count++;
+
+  if(bin.count > MaxBinCount) {
+    flush_bin(allocator, bin, FlushCount);
+  }
+}
+
+void JSMallocThreadCache::flush(JSMalloc *allocator) {
+  for(size_t i = 0; i < NumBins; i++) {
+    flush_bin(allocator, _bins[i], 0);
+  }
+}
+
+bool JSMallocThreadCache::refill(JSMalloc *allocator, Bin &bin, size_t aligned_size) {
+  void *blocks[RefillCount];
+  size_t count = allocator->allocate_batch(aligned_size, RefillCount, blocks);
+
+  for(size_t i = 0; i < count; i++) {
+    cached_set_next(blocks[i], bin.head);
+    bin.head = blocks[i];
+  }
+  bin.count += count;
+
+  return count > 0;
+}
+
+void JSMallocThreadCache::flush_bin(JSMalloc *allocator, Bin &bin, uint32_t keep) {
+  while(bin.count > keep) {
+    void *ptr = bin.head;
+    bin.head = cached_get_next(ptr);
+    bin.count--;
+
+    allocator->free(ptr);
+  }
+}
@@ -0,0 +1,53 @@
+
+// Author: Joel Sikström
+
+#ifndef JSMALLOC_THREAD_CACHE_HPP
+#define JSMALLOC_THREAD_CACHE_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+#include "JSMalloc.hpp"
+
+// A per-thread cache of small blocks that sits in front of a JSMalloc
+// instance. Blocks are kept in singly linked lists (one per TLSF mapping) that
+// are threaded through the payload of the cached blocks. The cache is refilled
+// and flushed in batches, so that the common allocate/free pair never has to
+// touch the free-lists of the shared allocator.
+//
+// The class is intentionally trivially constructible so that it can be used
+// as a zero-initialized thread_local from within the malloc wrapper.
+class JSMallocThreadCache {
+public:
+  // Only blocks smaller than this are cached. Below this size every mapping
+  // of BaseConfig corresponds to exactly one aligned block size.
+  static const size_t MaxCachedSizeLog2 = 10;
+  static const size_t MaxCachedSize = 1UL << MaxCachedSizeLog2;
+
+  static const size_t NumBins = MaxCachedSizeLog2 << BaseConfig::SecondLevelIndexLog2;
+
+  // Number of blocks requested from the allocator when a bin is empty.
+  static const uint32_t RefillCount = 16;
+  // When a bin grows beyond MaxBinCount it is flushed down to FlushCount.
+  static const uint32_t MaxBinCount = 64;
+  static const uint32_t FlushCount = MaxBinCount / 2;
+
+  void *allocate(JSMalloc *allocator, size_t size);
+  void free(JSMalloc *allocator, void *ptr);
+
+  // Returns all cached blocks to the allocator.
+  void flush(JSMalloc *allocator);
+
+private:
+  struct Bin {
+    void *head;
+    uint32_t count;
+  };
+
+  Bin _bins[NumBins];
+
+  bool refill(JSMalloc *allocator, Bin &bin, size_t aligned_size);
+  void flush_bin(JSMalloc *allocator, Bin &bin, uint32_t keep);
+};
+
+#endif // JSMALLOC_THREAD_CACHE_HPP
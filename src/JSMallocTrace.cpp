@@ -0,0 +1,180 @@
+
+// Author: Joel Sikström
+
+#include <cstring>
+#include <limits>
+#include <new>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+
+#include "JSMallocTrace.hpp"
+
+constexpr const char *JSMallocTraceHeader::Magic;
+
+thread_local JSMallocTraceWriter::Buffer *JSMallocTraceWriter::_thread_buffer = nullptr;
+
+bool JSMallocTraceWriter::open(const char *filename) {
+  int fd = ::open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+  if(fd < 0) {
+    return false;
+  }
+
+  JSMallocTraceHeader header;
+  memcpy(header.magic, JSMallocTraceHeader::Magic, sizeof(header.magic));
+  header.version = JSMallocTraceHeader::Version;
+  header.record_size = sizeof(JSMallocTraceRecord);
+  header.timestamp_unit = timestamp_unit();
+  header.reserved = 0;
+
+  if(write(fd, &header, sizeof(header)) != sizeof(header) || pthread_key_create(&_thread_exit_key, thread_exit) != 0) {
+    close(fd);
+    return false;
+  }
+
+  _fd = fd;
+  return true;
+}
+
+bool JSMallocTraceWriter::is_open() {
+  return _fd >= 0;
+}
+
+void JSMallocTraceWriter::record(JSMallocTraceRecord::Op op, const void *address, size_t size) {
+  Buffer *buffer = _thread_buffer;
+  if(buffer == nullptr || buffer->writer != this) {
+    buffer = create_buffer();
+    if(buffer == nullptr) {
+      return;
+    }
+    _thread_buffer = buffer;
+  }
+
+  // Only flush competes for the buffer, and only briefly.
+  while(buffer->busy.exchange(true, std::memory_order_acquire)) {}
+
+  // Leave room for a timestamp and the record itself.
+  if(buffer->count + 2 > RecordsPerBuffer) {
+    write_buffer(buffer);
+  }
+
+  uint64_t now = timestamp();
+  if(buffer->count == 0 || now - buffer->last_timestamp > std::numeric_limits<uint32_t>::max()) {
+    append(buffer, JSMallocTraceRecord::Timestamp, now, 0, now);
+  }
+
+  append(buffer, op, (uint64_t)address, size, now);
+
+  buffer->busy.store(false, std::memory_order_release);
+}
+
+void JSMallocTraceWriter::flush() {
+  _buffers_lock.lock();
+
+  for(Buffer *buffer = _buffers; buffer != nullptr; buffer = buffer->next) {
+    if(!buffer->busy.exchange(true, std::memory_order_acquire)) {
+      write_buffer(buffer);
+      buffer->busy.store(false, std::memory_order_release);
+    }
+  }
+
+  _buffers_lock.unlock();
+}
+
+uint64_t JSMallocTraceWriter::timestamp() {
+#if defined(__x86_64__)
+  return __rdtsc();
+#else
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec * 1000000000UL + time.tv_nsec;
+#endif
+}
+
+JSMallocTraceHeader::TimestampUnit JSMallocTraceWriter::timestamp_unit() {
+#if defined(__x86_64__)
+  return JSMallocTraceHeader::Ticks;
+#else
+  return JSMallocTraceHeader::Nanoseconds;
+#endif
+}
+
+JSMallocTraceWriter::Buffer *JSMallocTraceWriter::create_buffer() {
+  void *memory = mmap(nullptr, BufferSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(memory == MAP_FAILED) {
+    return nullptr;
+  }
+
+  Buffer *buffer = new(memory) Buffer();
+  buffer->writer = this;
+  buffer->busy = false;
+  buffer->thread = _next_thread.fetch_add(1);
+  buffer->count = 0;
+  buffer->last_timestamp = 0;
+
+  _buffers_lock.lock();
+  buffer->next = _buffers;
+  _buffers = buffer;
+  _buffers_lock.unlock();
+
+  pthread_setspecific(_thread_exit_key, buffer);
+
+  return buffer;
+}
+
+void JSMallocTraceWriter::append(Buffer *buffer, uint8_t op, uint64_t address, uint64_t size, uint64_t now) {
+  JSMallocTraceRecord &record = buffer->records()[buffer->count++];
+  record.address = address;
+  record.size = size;
+  record.time_delta = (op == JSMallocTraceRecord::Timestamp) ? 0 : static_cast<uint32_t>(now - buffer->last_timestamp);
+  record.thread = buffer->thread;
+  record.op = op;
+  record.reserved = 0;
+
+  buffer->last_timestamp = now;
+}
+
+void JSMallocTraceWriter::write_buffer(Buffer *buffer) {
+  const char *data = reinterpret_cast<const char *>(buffer->records());
+  size_t remaining = buffer->count * sizeof(JSMallocTraceRecord);
+
+  while(remaining > 0) {
+    ssize_t written = write(_fd, data, remaining);
+    if(written <= 0) {
+      break;
+    }
+
+    data += written;
+    remaining -= written;
+  }
+
+  buffer->count = 0;
+}
+
+void JSMallocTraceWriter::thread_exit(void *ptr) {
+  Buffer *buffer = static_cast<Buffer *>(ptr);
+  JSMallocTraceWriter *writer = buffer->writer;
+
+  writer->_buffers_lock.lock();
+
+  Buffer **link = &writer->_buffers;
+  while(*link != buffer) {
+    link = &(*link)->next;
+  }
+  *link = buffer->next;
+
+  writer->_buffers_lock.unlock();
+
+  while(buffer->busy.exchange(true, std::memory_order_acquire)) {}
+  writer->write_buffer(buffer);
+
+  // Records made by later destructors of the thread go to a new buffer.
+  _thread_buffer = nullptr;
+  munmap(buffer, BufferSize);
+}
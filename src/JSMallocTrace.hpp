@@ -0,0 +1,111 @@
+
+// Author: Joel Sikström
+
+#ifndef JSMALLOC_TRACE_HPP
+#define JSMALLOC_TRACE_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+#include <pthread.h>
+
+// The binary allocation trace format. A trace file starts with a header,
+// followed by fixed-size records. Records are written in chunks, each from a
+// single thread, and every chunk starts with a Timestamp record, so that the
+// chunks of different threads can be interleaved in any order.
+struct JSMallocTraceHeader {
+  static constexpr const char *Magic = "JSMTRACE";
+  static const uint32_t Version = 1;
+
+  enum TimestampUnit : uint32_t {
+    Ticks = 0,
+    Nanoseconds = 1
+  };
+
+  char magic[8];
+  uint32_t version;
+  uint32_t record_size;
+  uint32_t timestamp_unit;
+  uint32_t reserved;
+};
+
+struct JSMallocTraceRecord {
+  enum Op : uint8_t {
+    Allocate = 1,
+    Free = 2,
+    // Sets the time of the thread to address, which happens at the start of
+    // every chunk and when a time delta does not fit in 32 bits.
+    Timestamp = 3
+  };
+
+  uint64_t address;
+  uint64_t size;
+  // Time since the previous record of the same thread.
+  uint32_t time_delta;
+  uint16_t thread;
+  uint8_t op;
+  uint8_t reserved;
+};
+
+static_assert(sizeof(JSMallocTraceHeader) == 24, "The header is part of the file format");
+static_assert(sizeof(JSMallocTraceRecord) == 24, "Records are part of the file format");
+
+// Writes a binary trace through per-thread buffers, which are written to the
+// file in one write(2) each when they are full, when their thread exits, and
+// when flush is called. Recording never allocates with malloc.
+class JSMallocTraceWriter {
+public:
+  static const size_t BufferSize = 64 * 1024;
+
+  // Creates filename and writes the header. Returns false on failure.
+  bool open(const char *filename);
+  bool is_open();
+
+  void record(JSMallocTraceRecord::Op op, const void *address, size_t size);
+
+  // Writes out the buffers of all threads. Buffers that are being appended to
+  // at the same time are skipped.
+  void flush();
+
+  static uint64_t timestamp();
+  static JSMallocTraceHeader::TimestampUnit timestamp_unit();
+
+private:
+  struct Buffer {
+    JSMallocTraceWriter *writer;
+    Buffer *next;
+    // Held while the buffer is appended to or written out.
+    std::atomic<bool> busy;
+    uint16_t thread;
+    uint32_t count;
+    uint64_t last_timestamp;
+
+    // The records follow the buffer header.
+    JSMallocTraceRecord *records() {
+      return reinterpret_cast<JSMallocTraceRecord *>(this + 1);
+    }
+  };
+
+  static const size_t RecordsPerBuffer = (BufferSize - sizeof(Buffer)) / sizeof(JSMallocTraceRecord);
+
+  int _fd = -1;
+  std::atomic<uint16_t> _next_thread{0};
+  pthread_key_t _thread_exit_key = 0;
+
+  std::mutex _buffers_lock;
+  Buffer *_buffers = nullptr;
+
+  static thread_local Buffer *_thread_buffer;
+
+  Buffer *create_buffer();
+  void append(Buffer *buffer, uint8_t op, uint64_t address, uint64_t size, uint64_t now);
+
+  // Must be called with buffer->busy held.
+  void write_buffer(Buffer *buffer);
+
+  static void thread_exit(void *buffer);
+};
+
+#endif // JSMALLOC_TRACE_HPP
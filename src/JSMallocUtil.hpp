@@ -7,11 +7,17 @@
 #include <cstdint>
 #include <cstdlib>
 
+#define JSMALLOC_ALWAYS_INLINE inline __attribute__((always_inline))
+#define JSMALLOC_LIKELY(x) __builtin_expect(!!(x), 1)
+#define JSMALLOC_UNLIKELY(x) __builtin_expect(!!(x), 0)
+
 class JSMallocUtil {
 public:
   static uint32_t get_bits(uint64_t value, bool lower);
   static void *from_offset(uintptr_t base, bool lower, uint64_t value);
   static void set_offset(bool lower, uint32_t offset, uint64_t *value);
+  // The offset of ptr from base, or the maximum value if ptr is nullptr.
+  static uint32_t calculate_offset(uintptr_t base, void *ptr);
 
   static uint64_t combine_halfwords(uint32_t upper, uint32_t lower);
 
@@ -26,6 +32,15 @@ public:
   static size_t ffs(size_t number);
   static size_t fls(size_t number);
   static size_t ilog2(size_t number);
+
+  // Whether the process is known to have a single thread. False if the C
+  // library cannot tell.
+  static bool is_single_threaded();
+
+  static size_t page_size();
+
+  // A coarse monotonic clock.
+  static uint64_t current_time_ms();
 };
 
 #endif // JSMALLOC_UTIL_HPP
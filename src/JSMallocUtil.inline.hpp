@@ -5,8 +5,15 @@
 #define JSMALLOC_UTIL_INLINE_HPP
 
 #include <climits>
+#include <ctime>
 #include <limits>
 
+#include <unistd.h>
+
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 32))
+#include <sys/single_threaded.h>
+#endif
+
 #include "JSMallocUtil.hpp"
 
 inline uint32_t JSMallocUtil::get_bits(uint64_t value, bool lower) {
@@ -32,6 +39,10 @@ inline void JSMallocUtil::set_offset(bool lower, uint32_t offset, uint64_t *valu
   }
 }
 
+inline uint32_t JSMallocUtil::calculate_offset(uintptr_t base, void *ptr) {
+  return (ptr == nullptr) ? std::numeric_limits<uint32_t>::max() : reinterpret_cast<uintptr_t>(ptr) - base;
+}
+
 inline uint64_t JSMallocUtil::combine_halfwords(uint32_t upper, uint32_t lower) {
   return (static_cast<uint64_t>(upper) << 32) | lower;
 }
@@ -60,4 +71,23 @@ inline size_t JSMallocUtil::ilog2(size_t number) {
   return JSMallocUtil::fls(number) - 1;
 }
 
+inline bool JSMallocUtil::is_single_threaded() {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 32))
+  return __libc_single_threaded;
+#else
+  return false;
+#endif
+}
+
+inline size_t JSMallocUtil::page_size() {
+  static const size_t size = sysconf(_SC_PAGESIZE);
+  return size;
+}
+
+inline uint64_t JSMallocUtil::current_time_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
 #endif // JSMALLOC_UTIL_INLINE_HPP
@@ -1,34 +1,251 @@
 
 #include <cerrno>
+#include <cstddef>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <limits>
 #include <fcntl.h>
+#include <malloc.h>
+#include <pthread.h>
 #include <sys/mman.h>
 #include <unistd.h>
 
-#include "JSMalloc.hpp"
+#include "JSMalloc.inline.hpp"
+#include "JSMallocArena.hpp"
+#include "JSMallocLarge.hpp"
+#include "JSMallocThreadCache.hpp"
+#include "JSMallocTrace.hpp"
 
-static const size_t MEMPOOL_SIZE = 1024 * 1000 * 2000;
+// The initial pool is kept small, arenas grow with additional regions.
+static const size_t MEMPOOL_SIZE = 64 * 1024 * 1024;
+
+// Free pages in blocks of at least PURGE_MIN_BLOCK_SIZE bytes are returned to
+// the OS after staying free for one epoch, which ends after PURGE_THRESHOLD
+// bytes have been freed or PURGE_DECAY_MS milliseconds have passed.
+static const size_t PURGE_THRESHOLD = 16 * 1024 * 1024;
+static const uint64_t PURGE_DECAY_MS = 1000;
+static const size_t PURGE_MIN_BLOCK_SIZE = 64 * 1024;
+
+// Allocations of at least this size get a mapping of their own, which realloc
+// resizes with mremap.
+static const size_t LARGE_OBJECT_THRESHOLD = 1024 * 1024;
+
+// Requests of at most SLAB_CUTOFF bytes are packed into slabs without a
+// block header. JSMALLOC_SLAB_CUTOFF overrides it, and 0 disables slabs.
+static const size_t SLAB_CUTOFF = 48;
 
 void *mempool = nullptr;
-static JSMalloc *jsmalloc = nullptr;
-static int log_file_fd = 0;
+static JSMallocArenas *arenas = nullptr;
+static JSMallocLargeObjects large_objects;
 
-extern "C" {
+// Records every allocation and free if LOG_ALLOC names a file to trace to.
+static JSMallocTraceWriter trace_writer;
+
+// Zero-initialized per-thread cache in front of the thread's arena. The
+// pthread key is only used to flush the cache back when a thread exits.
+static thread_local JSMallocThreadCache thread_cache;
+static thread_local bool thread_cache_registered = false;
+static pthread_key_t thread_cache_key;
+
+static void flush_thread_cache(void *cache) {
+  static_cast<JSMallocThreadCache *>(cache)->flush(arenas->get_arena());
+
+  // Re-register if the thread allocates again from a later destructor.
+  thread_cache_registered = false;
+}
+
+static JSMallocThreadCache *get_thread_cache() {
+  if(!thread_cache_registered) {
+    thread_cache_registered = true;
+    pthread_setspecific(thread_cache_key, &thread_cache);
+  }
 
-  void log_allocation_to_file(size_t size) {
-    const int max_len = 11;
-    char buffer[max_len];
-    int len = snprintf(buffer, max_len, "%lu\n", (unsigned long)size);
+  return &thread_cache;
+}
 
-    if(len >= 0 && len < max_len) {
-      if(write(log_file_fd, buffer, len) == -1) {
-        perror("failed to log");
-      }
+static void *arena_allocate(size_t size) {
+  JSMallocSlabs *slabs = arenas->get_slabs();
+  if(slabs != nullptr && size <= slabs->cutoff()) {
+    void *addr = slabs->allocate(size);
+    if(addr != nullptr) {
+      return addr;
     }
   }
 
+  void *addr = get_thread_cache()->allocate(arenas->get_arena(), size);
+
+  // The cache only serves the thread's own arena, so try the others.
+  if(addr == nullptr) {
+    addr = arenas->allocate(size);
+  }
+
+  return addr;
+}
+
+static void deallocate(void *addr) {
+  JSMallocSlabs *slabs = arenas->get_owner_slabs(addr);
+  if(slabs != nullptr && slabs->free(addr)) {
+    return;
+  }
+
+  // Blocks owned by other arenas bypass the cache and are returned directly.
+  JSMalloc *owner = arenas->get_owner(addr);
+  if(owner == arenas->get_arena()) {
+    get_thread_cache()->free(owner, addr);
+  } else if(owner != nullptr) {
+    owner->free(addr);
+  } else {
+    large_objects.free(addr);
+  }
+}
+
+// Copies the old allocation at ptr to newalloc and frees it.
+static void *move_allocation(void *newalloc, void *ptr, size_t old_size, size_t size) {
+  memcpy(newalloc, ptr, old_size < size ? old_size : size);
+  deallocate(ptr);
+
+  return newalloc;
+}
+
+static void *large_reallocate(void *ptr, size_t size) {
+  if(size >= LARGE_OBJECT_THRESHOLD) {
+    return large_objects.reallocate(ptr, size);
+  }
+
+  // Shrunk below the threshold, so the allocation goes back to the pool.
+  void *newalloc = arena_allocate(size);
+  if(newalloc == nullptr) {
+    return nullptr;
+  }
+
+  return move_allocation(newalloc, ptr, large_objects.get_allocated_size(ptr), size);
+}
+
+// Every block and slab object is aligned to alignof(max_align_t), so only
+// larger alignments need the aligned allocation path.
+static void *aligned_allocate(size_t alignment, size_t size) {
+  if(alignment <= alignof(max_align_t)) {
+    return arena_allocate(size);
+  }
+
+  // Large objects start right after a page-aligned header.
+  if(size >= LARGE_OBJECT_THRESHOLD && alignment <= JSMallocLargeObjects::HeaderSize) {
+    void *addr = large_objects.allocate(size);
+    if(addr != nullptr) {
+      return addr;
+    }
+  }
+
+  return arenas->allocate_aligned(size, alignment);
+}
+
+static bool is_power_of_two(size_t value) {
+  return value != 0 && (value & (value - 1)) == 0;
+}
+
+static void *allocate(size_t size) {
+  void *addr = nullptr;
+  if(size >= LARGE_OBJECT_THRESHOLD) {
+    addr = large_objects.allocate(size);
+  }
+
+  if(addr == nullptr) {
+    addr = arena_allocate(size);
+  }
+
+  if(addr == nullptr) {
+    errno = ENOMEM;
+  }
+
+  return addr;
+}
+
+static void *allocate_zeroed(size_t size) {
+  // Small blocks never contain a whole purged page.
+  if(size < JSMallocThreadCache::MaxCachedSize) {
+    void *ptr = allocate(size);
+    if(ptr != nullptr) {
+      memset(ptr, 0, size);
+    }
+
+    return ptr;
+  }
+
+  // Fresh mappings are already zeroed.
+  if(size >= LARGE_OBJECT_THRESHOLD) {
+    void *ptr = large_objects.allocate(size);
+    if(ptr != nullptr) {
+      return ptr;
+    }
+  }
+
+  void *ptr = arenas->get_arena()->allocate_zeroed(size);
+  if(ptr == nullptr) {
+    ptr = arenas->allocate(size);
+    if(ptr == nullptr) {
+      errno = ENOMEM;
+      return nullptr;
+    }
+
+    memset(ptr, 0, size);
+  }
+
+  return ptr;
+}
+
+static void *reallocate(void *ptr, size_t size) {
+  JSMalloc *owner = arenas->get_owner(ptr);
+  if(owner == nullptr) {
+    return large_objects.contains(ptr) ? large_reallocate(ptr, size) : nullptr;
+  }
+
+  // Slab objects have a fixed size class, so they are always moved.
+  JSMallocSlabs *slabs = arenas->get_owner_slabs(ptr);
+  if(slabs != nullptr && slabs->contains(ptr)) {
+    size_t old_size = slabs->get_allocated_size(ptr);
+    if(size <= old_size && size > old_size - JSMallocSlabs::Granularity) {
+      return ptr;
+    }
+
+    void *newalloc = allocate(size);
+    if(newalloc == nullptr) {
+      return nullptr;
+    }
+
+    return move_allocation(newalloc, ptr, old_size, size);
+  }
+
+  // Blocks that grow past the threshold are moved to a mapping of their
+  // own, so that later resizes do not have to copy.
+  if(size >= LARGE_OBJECT_THRESHOLD) {
+    void *newalloc = large_objects.allocate(size);
+    if(newalloc != nullptr) {
+      return move_allocation(newalloc, ptr, owner->get_allocated_size(ptr), size);
+    }
+  }
+
+  // The owner resizes in place when it can, and moves the block otherwise.
+  void *newalloc = owner->reallocate(ptr, size);
+  if(newalloc != nullptr) {
+    return newalloc;
+  }
+
+  // The owning arena is exhausted, so move the block to another one.
+  newalloc = arena_allocate(size);
+  if(newalloc == nullptr) {
+    return nullptr;
+  }
+
+  return move_allocation(newalloc, ptr, owner->get_allocated_size(ptr), size);
+}
+
+static void flush_trace() {
+  trace_writer.flush();
+}
+
+extern "C" {
+
   void initialize_jsmalloc() {
     mempool = static_cast<void *>(mmap(nullptr, MEMPOOL_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
     if(mempool == MAP_FAILED) {
@@ -36,75 +253,197 @@ extern "C" {
       exit(1);
     }
 
-    jsmalloc = JSMalloc::create(mempool, MEMPOOL_SIZE);
+    size_t num_arenas = sysconf(_SC_NPROCESSORS_ONLN);
+    const char *num_arenas_str = getenv("JSMALLOC_ARENAS");
+    if(num_arenas_str) {
+      num_arenas = strtoul(num_arenas_str, nullptr, 10);
+    }
+
+    const char *binding_str = getenv("JSMALLOC_ARENA_BINDING");
+    ArenaBinding binding = (binding_str && strcmp(binding_str, "rr") == 0)
+      ? ArenaBinding::RoundRobin
+      : ArenaBinding::CPU;
+
+    arenas = JSMallocArenas::create(mempool, MEMPOOL_SIZE, num_arenas, binding);
+    arenas->set_purge_policy(PURGE_THRESHOLD, PURGE_DECAY_MS, PURGE_MIN_BLOCK_SIZE);
+
+    size_t slab_cutoff = SLAB_CUTOFF;
+    const char *slab_cutoff_str = getenv("JSMALLOC_SLAB_CUTOFF");
+    if(slab_cutoff_str) {
+      slab_cutoff = strtoul(slab_cutoff_str, nullptr, 10);
+    }
+
+    if(slab_cutoff > 0) {
+      arenas->enable_slabs(slab_cutoff);
+    }
+    pthread_key_create(&thread_cache_key, flush_thread_cache);
 
+    // The buffers of threads that are still running at exit are written out
+    // by flush_trace.
     const char *log_file_name = getenv("LOG_ALLOC");
-    if(log_file_name) {
-      log_file_fd = creat(log_file_name, 0644);
+    if(log_file_name && trace_writer.open(log_file_name)) {
+      atexit(flush_trace);
     }
   }
 
   void *calloc(size_t nmemb, size_t size) {
-    if(jsmalloc == nullptr) {
+    if(arenas == nullptr) {
       initialize_jsmalloc();
     }
 
-    void *ptr = malloc(nmemb * size);
-    if(ptr != nullptr) {
-      memset(ptr, 0, nmemb * size);
+    size_t total_size;
+    if(__builtin_mul_overflow(nmemb, size, &total_size)) {
+      errno = ENOMEM;
+      return nullptr;
+    }
+
+    void *ptr = allocate_zeroed(total_size);
+
+    if(ptr != nullptr && trace_writer.is_open()) {
+      trace_writer.record(JSMallocTraceRecord::Allocate, ptr, total_size);
     }
 
     return ptr;
   }
 
   void *malloc(size_t size) {
-    if(jsmalloc == nullptr) {
+    if(arenas == nullptr) {
       initialize_jsmalloc();
     }
 
-    if(log_file_fd != 0) {
-      log_allocation_to_file(size);
-    }
-
-    void *addr = jsmalloc->allocate(size);
+    void *addr = allocate(size);
 
-    if(addr == nullptr) {
-      errno = ENOMEM;
+    if(addr != nullptr && trace_writer.is_open()) {
+      trace_writer.record(JSMallocTraceRecord::Allocate, addr, size);
     }
 
     return addr;
   }
 
   void free(void *addr) {
-    if(jsmalloc == nullptr) {
+    if(arenas == nullptr) {
       initialize_jsmalloc();
     }
 
-    jsmalloc->free(addr);
+    if(addr != nullptr && trace_writer.is_open()) {
+      trace_writer.record(JSMallocTraceRecord::Free, addr, 0);
+    }
+
+    deallocate(addr);
   }
 
   void *realloc(void *ptr, size_t size) {
-    if(jsmalloc == nullptr) {
+    if(arenas == nullptr) {
       initialize_jsmalloc();
     }
 
     if(ptr == NULL) {
       return malloc(size);
-    } else if(ptr == NULL && size == 0) {
+    }
+
+    void *newalloc = reallocate(ptr, size);
+
+    // A resize is traced as a free followed by an allocation, even if the
+    // block stays in place.
+    if(newalloc != nullptr && trace_writer.is_open()) {
+      trace_writer.record(JSMallocTraceRecord::Free, ptr, 0);
+      trace_writer.record(JSMallocTraceRecord::Allocate, newalloc, size);
+    }
+
+    return newalloc;
+  }
+
+  int posix_memalign(void **memptr, size_t alignment, size_t size) {
+    if(arenas == nullptr) {
+      initialize_jsmalloc();
+    }
+
+    if(!is_power_of_two(alignment) || alignment % sizeof(void *) != 0) {
+      return EINVAL;
+    }
+
+    void *addr = aligned_allocate(alignment, size);
+    if(addr == nullptr) {
+      return ENOMEM;
+    }
+
+    if(trace_writer.is_open()) {
+      trace_writer.record(JSMallocTraceRecord::Allocate, addr, size);
+    }
+
+    *memptr = addr;
+    return 0;
+  }
+
+  void *aligned_alloc(size_t alignment, size_t size) {
+    if(arenas == nullptr) {
+      initialize_jsmalloc();
+    }
+
+    if(!is_power_of_two(alignment)) {
+      errno = EINVAL;
       return nullptr;
     }
 
-    void *newalloc = jsmalloc->allocate(size);
-    if(newalloc == nullptr) {
+    void *addr = aligned_allocate(alignment, size);
+    if(addr == nullptr) {
+      errno = ENOMEM;
+    } else if(trace_writer.is_open()) {
+      trace_writer.record(JSMallocTraceRecord::Allocate, addr, size);
+    }
+
+    return addr;
+  }
+
+  void *memalign(size_t alignment, size_t size) {
+    return aligned_alloc(alignment, size);
+  }
+
+  void *valloc(size_t size) {
+    return aligned_alloc(sysconf(_SC_PAGESIZE), size);
+  }
+
+  void *pvalloc(size_t size) {
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    if(size > std::numeric_limits<size_t>::max() - page_size) {
+      errno = ENOMEM;
       return nullptr;
     }
 
-    size_t old_size = jsmalloc->get_allocated_size(ptr);
-    size_t copy_size = old_size < size ? old_size : size;
+    return aligned_alloc(page_size, (size + page_size - 1) & ~(page_size - 1));
+  }
 
-    memcpy(newalloc, ptr, copy_size);
-    free(ptr);
+  // Objects in slabs and thread caches count as live, since their memory is
+  // allocated from the arenas.
+  struct mallinfo2 mallinfo2() {
+    struct mallinfo2 info = {};
+    if(arenas == nullptr) {
+      return info;
+    }
 
-    return newalloc;
+    JSMallocStats stats;
+    arenas->stats(stats);
+
+    info.arena = stats.pool_bytes;
+    info.uordblks = stats.total.live_bytes;
+    info.fordblks = stats.total.free_bytes;
+    info.hblks = large_objects.num_objects();
+    return info;
+  }
+
+  void malloc_stats() {
+    if(arenas == nullptr) {
+      return;
+    }
+
+    JSMallocStats stats;
+    arenas->stats(stats);
+    stats.print(stderr);
+
+    JSMallocFragmentation fragmentation;
+    arenas->fragmentation(fragmentation);
+    fprintf(stderr, "largest free:    %14zu\n", fragmentation.largest_free_block);
+    fprintf(stderr, "fragmentation:   %14.4f\n", fragmentation.index());
+    fprintf(stderr, "large objects:   %14zu\n", large_objects.num_objects());
   }
 }
@@ -6,12 +6,21 @@
 #include <chrono>
 #include <cstring>
 #include <sys/mman.h>
+#include <unistd.h>
 
 #include <x86intrin.h>
 
 #include <map>
+#include <thread>
+#include <vector>
 
-#include "JSMalloc.hpp"
+#include "JSMalloc.inline.hpp"
+#include "JSMallocAllocationBuffer.hpp"
+#include "JSMallocArena.hpp"
+#include "JSMallocLarge.hpp"
+#include "JSMallocSlab.hpp"
+#include "JSMallocThreadCache.hpp"
+#include "JSMallocTrace.hpp"
 
 static void print_bits(uint64_t n) {
     for (int i = 63; i >= 0; --i) {
@@ -274,6 +283,1017 @@ void aggregate_test() {
   print_bits(alloc.get_fl_bitmap());
 }
 
+void thread_cache_test() {
+  const size_t pool_size = 1024 * 1000;
+  uint8_t *pool = mmap_allocate(pool_size);
+  JSMalloc alloc(pool, pool_size);
+  static JSMallocThreadCache cache;
+
+  void *ptrs[1000];
+  for(int i = 0; i < 1000; i++) {
+    ptrs[i] = cache.allocate(&alloc, (i % 40) * 16);
+    assert(ptrs[i] != nullptr);
+    memset(ptrs[i], 0xAB, (i % 40) * 16);
+  }
+
+  for(int i = 0; i < 1000; i++) {
+    cache.free(&alloc, ptrs[i]);
+  }
+
+  // Cached blocks are handed out again without going through the allocator.
+  void *a = cache.allocate(&alloc, 32);
+  cache.free(&alloc, a);
+  assert(cache.allocate(&alloc, 32) == a);
+  cache.free(&alloc, a);
+
+  // Once everything is flushed the pool should be coalesced into one block.
+  cache.flush(&alloc);
+  assert(__builtin_popcountl(alloc.get_fl_bitmap()) == 1);
+  assert(alloc.allocate(pool_size / 2) != nullptr);
+}
+
+void arena_test() {
+  const size_t pool_size = 4 * 1024 * 1000;
+  uint8_t *pool = mmap_allocate(pool_size);
+  JSMallocArenas *arenas = JSMallocArenas::create(pool, pool_size, 4, ArenaBinding::RoundRobin);
+  assert(arenas->num_arenas() == 4);
+
+  std::vector<void *> ptrs[4];
+  std::vector<std::thread> threads;
+  for(int i = 0; i < 4; i++) {
+    threads.emplace_back([arenas, &ptrs, i]() {
+      for(int j = 0; j < 1000; j++) {
+        void *ptr = arenas->allocate(16 + j % 200);
+        assert(ptr != nullptr);
+        assert(arenas->get_owner(ptr) == arenas->get_arena());
+        ptrs[i].push_back(ptr);
+      }
+    });
+  }
+
+  for(auto &t : threads) {
+    t.join();
+  }
+
+  // Frees from another thread are routed back to the owning arena.
+  for(int i = 0; i < 4; i++) {
+    for(void *ptr : ptrs[i]) {
+      arenas->free(ptr);
+    }
+  }
+
+  for(int i = 0; i < 4; i++) {
+    assert(__builtin_popcountl(arenas->get_owner(ptrs[i][0])->get_fl_bitmap()) == 1);
+  }
+
+  int dummy;
+  assert(arenas->get_owner(&dummy) == nullptr);
+}
+
+void concurrent_coalescing_test() {
+  const size_t pool_size = 8 * 1024 * 1000;
+  uint8_t *pool = mmap_allocate(pool_size);
+  JSMalloc alloc(pool, pool_size);
+
+  const int num_threads = 8;
+  std::vector<std::thread> threads;
+  for(int i = 0; i < num_threads; i++) {
+    threads.emplace_back([&alloc, i]() {
+      std::vector<std::pair<uint8_t *, size_t>> live;
+      uint32_t seed = i + 1;
+
+      for(int j = 0; j < 50000; j++) {
+        seed = seed * 1103515245 + 12345;
+        if(live.size() < 64 && (seed >> 16) % 3 != 0) {
+          size_t size = 1 + (seed >> 8) % 2000;
+          uint8_t *ptr = static_cast<uint8_t *>(alloc.allocate(size));
+          assert(ptr != nullptr);
+          memset(ptr, i, size);
+          live.push_back({ptr, size});
+        } else if(!live.empty()) {
+          size_t index = (seed >> 4) % live.size();
+          auto obj = live[index];
+          for(size_t k = 0; k < obj.second; k++) {
+            assert(obj.first[k] == (uint8_t)i);
+          }
+          alloc.free(obj.first);
+          live[index] = live.back();
+          live.pop_back();
+        }
+      }
+
+      for(auto &obj : live) {
+        alloc.free(obj.first);
+      }
+    });
+  }
+
+  for(auto &t : threads) {
+    t.join();
+  }
+
+  // Everything should have been coalesced back into a single block.
+  assert(__builtin_popcountl(alloc.get_fl_bitmap()) == 1);
+  assert(alloc.allocate(pool_size / 2) != nullptr);
+}
+
+void growable_pool_test() {
+  const size_t pool_size = 4096;
+  uint8_t *pool = mmap_allocate(pool_size);
+  JSMalloc alloc(pool, pool_size);
+
+  // Without a provider the pool is fixed.
+  assert(alloc.allocate(8192) == nullptr);
+
+  alloc.set_region_provider({JSMalloc::mmap_region, nullptr});
+
+  std::vector<void *> ptrs;
+  for(int i = 0; i < 1000; i++) {
+    void *ptr = alloc.allocate(100 * 1024);
+    assert(ptr != nullptr);
+    memset(ptr, 1, 100 * 1024);
+    ptrs.push_back(ptr);
+  }
+  assert(alloc.num_regions() > 1);
+
+  // Allocations larger than the default region size get a region that fits.
+  void *large = alloc.allocate(200 * 1024 * 1024);
+  assert(large != nullptr);
+  memset(large, 1, 200 * 1024 * 1024);
+  ptrs.push_back(large);
+
+  for(void *ptr : ptrs) {
+    alloc.free(ptr);
+  }
+
+  // Every region is coalesced into one block, but never across regions.
+  assert((size_t)__builtin_popcountl(alloc.get_fl_bitmap()) <= alloc.num_regions());
+  assert(alloc.allocate(200 * 1024 * 1024) == large);
+
+  // Requests whose block could not be indexed fail without mapping a region.
+  size_t num_regions = alloc.num_regions();
+  assert(alloc.allocate(5UL * 1024 * 1024 * 1024) == nullptr);
+  assert(alloc.allocate(4UL * 1024 * 1024 * 1024) == nullptr);
+  assert(alloc.num_regions() == num_regions);
+}
+
+void purge_test() {
+  const size_t pool_size = 16 * 1024 * 1024;
+  const size_t size = 2 * 1024 * 1024;
+  uint8_t *pool = mmap_allocate(pool_size);
+  JSMalloc alloc(pool, pool_size);
+
+  alloc.set_purge_policy(1024 * 1024, std::numeric_limits<uint64_t>::max(), 64 * 1024);
+
+  void *a = alloc.allocate(size);
+  void *guard1 = alloc.allocate(16);
+  void *b = alloc.allocate(size);
+  void *guard2 = alloc.allocate(16);
+  memset(a, 1, size);
+  memset(b, 1, size);
+
+  // The first epoch only marks a as idle, the second one purges it.
+  alloc.free(a);
+  assert(alloc.purged_bytes() == 0);
+  alloc.free(b);
+  assert(alloc.purged_bytes() >= size - 4096);
+
+  // Everything else that is free is purged on request.
+  assert(alloc.purge(true) > 0);
+
+  uint8_t *c = static_cast<uint8_t *>(alloc.allocate_zeroed(size));
+  assert(c != nullptr);
+  for(size_t i = 0; i < size; i++) {
+    assert(c[i] == 0);
+  }
+
+  memset(c, 1, size);
+  alloc.free(c);
+  alloc.free(guard1);
+  alloc.free(guard2);
+
+  // Written blocks are zeroed again after being reused.
+  uint8_t *d = static_cast<uint8_t *>(alloc.allocate_zeroed(size));
+  for(size_t i = 0; i < size; i++) {
+    assert(d[i] == 0);
+  }
+}
+
+void reallocate_test() {
+  const size_t pool_size = 1024 * 1024;
+  uint8_t *pool = mmap_allocate(pool_size);
+  JSMalloc alloc(pool, pool_size);
+
+  uint8_t *a = static_cast<uint8_t *>(alloc.allocate(100));
+  void *b = alloc.allocate(1000);
+  void *c = alloc.allocate(100);
+  memset(a, 7, 100);
+
+  // Grows into the free successor without moving.
+  alloc.free(b);
+  assert(alloc.reallocate(a, 800) == a);
+  assert(alloc.get_allocated_size(a) >= 800);
+  for(size_t i = 0; i < 100; i++) {
+    assert(a[i] == 7);
+  }
+
+  // Shrinks in place, and the tail is merged with the rest of b.
+  assert(alloc.reallocate(a, 50) == a);
+  assert(alloc.get_allocated_size(a) < 100);
+  assert(alloc.reallocate(a, 800) == a);
+
+  // The successor is in use, so the block has to move.
+  uint8_t *d = static_cast<uint8_t *>(alloc.reallocate(a, 4000));
+  assert(d != nullptr && d != a);
+  for(size_t i = 0; i < 50; i++) {
+    assert(d[i] == 7);
+  }
+
+  alloc.free(c);
+  alloc.free(d);
+  assert(__builtin_popcountl(alloc.get_fl_bitmap()) == 1);
+}
+
+void compact_header_test() {
+  const size_t pool_size = 1024 * 1024;
+  uint8_t *pool = mmap_allocate(pool_size);
+  JSMalloc alloc(pool + 8, pool_size - 8);
+
+  // Used blocks only carry the 8-byte size word, and payloads stay aligned.
+  std::vector<uint8_t *> ptrs;
+  for(size_t i = 0; i < 1000; i++) {
+    uint8_t *ptr = static_cast<uint8_t *>(alloc.allocate(1 + i % 24));
+    assert(ptr != nullptr && (uintptr_t)ptr % BaseConfig::MBS == 0);
+    assert(alloc.get_allocated_size(ptr) == 24);
+    if(!ptrs.empty()) {
+      assert(ptr == ptrs.back() + 32);
+    }
+    memset(ptr, 0xff, 24);
+    ptrs.push_back(ptr);
+  }
+
+  // Every other block is freed first, so that the rest can only be coalesced
+  // through the boundary tags of their free predecessors.
+  for(size_t i = 0; i < ptrs.size(); i += 2) {
+    alloc.free(ptrs[i]);
+  }
+  for(size_t i = 1; i < ptrs.size(); i += 2) {
+    alloc.free(ptrs[i]);
+  }
+  assert(__builtin_popcountl(alloc.get_fl_bitmap()) == 1);
+
+  void *first = alloc.allocate(24);
+  void *rest = alloc.allocate(pool_size / 2);
+  assert(first == ptrs[0] && rest == ptrs[1]);
+  alloc.free(first);
+  alloc.free(rest);
+}
+
+void exact_fit_test() {
+  const size_t pool_size = 1024 * 1024;
+  uint8_t *pool = mmap_allocate(pool_size);
+  JSMalloc alloc(pool + 8, pool_size - 8);
+
+  // 4200 bytes is not on a size class boundary, so the good-fit search alone
+  // would skip a freed block of exactly that size and split the rest of the
+  // pool instead.
+  void *ptr = alloc.allocate(4200);
+  void *guard = alloc.allocate(64);
+  assert(ptr != nullptr && guard != nullptr);
+  alloc.free(ptr);
+
+  void *reused = alloc.allocate(4200);
+  assert(reused == ptr);
+
+  // A block in the exact class that is too small is left for later.
+  alloc.free(reused);
+  void *larger = alloc.allocate(4208);
+  assert(larger != nullptr && larger != ptr);
+  assert(alloc.allocate(4200) == ptr);
+
+  uint8_t *poolz = mmap_allocate(pool_size);
+  JSMallocZ allocz(poolz, pool_size, false);
+  void *ptrz = allocz.allocate(1040);
+  void *guardz = allocz.allocate(64);
+  assert(ptrz != nullptr && guardz != nullptr);
+  allocz.free(ptrz, 1040);
+  assert(allocz.allocate(1040) == ptrz);
+
+  // The block keeps its aligned size when it is freed with the requested size.
+  allocz.free(ptrz, 1030);
+  assert(allocz.allocate(1040) == ptrz);
+}
+
+void large_objects_test() {
+  static JSMallocLargeObjects large;
+  const size_t size = 4 * 1024 * 1024;
+
+  uint8_t *a = static_cast<uint8_t *>(large.allocate(size));
+  assert(a != nullptr && large.contains(a));
+  assert(large.get_allocated_size(a) >= size);
+  for(size_t i = 0; i < size; i++) {
+    a[i] = i % 251;
+  }
+
+  // Growing and shrinking keeps the payload without copying it.
+  uint8_t *b = static_cast<uint8_t *>(large.reallocate(a, 16 * size));
+  assert(b != nullptr && large.contains(b));
+  b = static_cast<uint8_t *>(large.reallocate(b, size / 2));
+  for(size_t i = 0; i < size / 2; i++) {
+    assert(b[i] == i % 251);
+  }
+
+  std::vector<void *> ptrs;
+  for(int i = 0; i < 200; i++) {
+    ptrs.push_back(large.allocate(i * 4096));
+  }
+  assert(large.num_objects() == 201);
+
+  for(void *ptr : ptrs) {
+    assert(large.free(ptr));
+  }
+  assert(large.free(b));
+  assert(large.num_objects() == 0);
+
+  uint64_t not_large[8];
+  assert(!large.contains(&not_large[0]));
+  assert(!large.free(&not_large[0]));
+}
+
+void allocate_aligned_test() {
+  const size_t pool_size = 4 * 1024 * 1024;
+  uint8_t *pool = mmap_allocate(pool_size);
+  JSMalloc alloc(pool, pool_size);
+
+  std::vector<void *> ptrs;
+  for(size_t alignment = 8; alignment <= 65536; alignment *= 2) {
+    for(size_t size : {1, 100, 5000}) {
+      void *ptr = alloc.allocate_aligned(size, alignment);
+      assert(ptr != nullptr && (uintptr_t)ptr % alignment == 0);
+      assert(alloc.get_allocated_size(ptr) >= size);
+      memset(ptr, 1, size);
+      ptrs.push_back(ptr);
+    }
+  }
+
+  assert(alloc.allocate_aligned(100, 48) == nullptr);
+
+  // The leading slack is merged back when the aligned blocks are freed.
+  for(void *ptr : ptrs) {
+    alloc.free(ptr);
+  }
+  assert(__builtin_popcountl(alloc.get_fl_bitmap()) == 1);
+
+  uint8_t *zpool = mmap_allocate(pool_size);
+  JSMallocZ *zalloc = JSMallocZ::create(zpool, pool_size, false);
+  void *zptr = zalloc->allocate_aligned(100, 4096);
+  assert(zptr != nullptr && (uintptr_t)zptr % 4096 == 0);
+}
+
+void side_table_test() {
+  const size_t pool_size = 1024 * 1024;
+  uint8_t *pool = mmap_allocate(pool_size);
+  JSMallocZ *alloc = JSMallocZ::create(pool, pool_size, false, true);
+  assert(alloc->has_side_table());
+
+  std::vector<void *> ptrs;
+  for(size_t size = 1; size < 5000; size += 97) {
+    void *ptr = alloc->allocate(size);
+    assert(ptr != nullptr);
+    assert(alloc->get_allocated_size(ptr) >= size);
+    assert(alloc->get_allocated_size(ptr) < size + 16);
+    memset(ptr, 0xff, size);
+    ptrs.push_back(ptr);
+  }
+
+  void *aligned = alloc->allocate_aligned(100, 1024);
+  assert(alloc->get_allocated_size(aligned) >= 100);
+
+  // Interior pointers are not the start of a block.
+  assert(alloc->get_allocated_size((void *)((uintptr_t)ptrs[3] + 16)) == 0);
+
+  // A wrong size passed by the caller is ignored, and so are double frees.
+  alloc->free(ptrs[0], 1 << 20);
+  assert(alloc->get_allocated_size(ptrs[0]) == 0);
+  alloc->free(ptrs[0]);
+
+  for(size_t i = 1; i < ptrs.size(); i++) {
+    alloc->free(ptrs[i]);
+    assert(alloc->get_allocated_size(ptrs[i]) == 0);
+  }
+  alloc->free(aligned);
+
+  // The freed blocks are available again.
+  void *ptr = alloc->allocate(4000);
+  assert(ptr != nullptr && alloc->get_allocated_size(ptr) == 4000);
+}
+
+void bitmap_coalescing_test(size_t num_threads) {
+  const size_t pool_size = 1024 * 1024;
+  uint8_t *pool = mmap_allocate(pool_size);
+  JSMallocZ alloc(pool, pool_size, false);
+
+  std::vector<uint64_t> live_map((alloc.num_granules() + 63) / 64);
+  uintptr_t pool_start = (uintptr_t)alloc.allocate(16);
+
+  // Every third object survives.
+  std::vector<std::pair<uint8_t *, size_t>> live;
+  for(size_t i = 0; i < 2000; i++) {
+    size_t size = 16 + (i * 37) % 300;
+    uint8_t *ptr = static_cast<uint8_t *>(alloc.allocate(size));
+    assert(ptr != nullptr);
+
+    if(i % 3 == 0) {
+      memset(ptr, i % 256, size);
+      live.push_back({ptr, size});
+
+      size_t first = ((uintptr_t)ptr - pool_start) / 16;
+      size_t last = ((uintptr_t)ptr + size - 1 - pool_start) / 16;
+      for(size_t granule = first; granule <= last; granule++) {
+        live_map[granule / 64] |= 1UL << (granule % 64);
+      }
+    }
+  }
+
+  alloc.coalesce(live_map.data(), num_threads);
+
+  // The gaps between live objects can be reused, and live objects are intact.
+  for(size_t i = 0; i < 1000; i++) {
+    assert(alloc.allocate(16 + (i * 37) % 300 * 2) != nullptr);
+  }
+
+  for(size_t i = 0; i < live.size(); i++) {
+    for(size_t j = 0; j < live[i].second; j++) {
+      assert(live[i].first[j] == (i * 3) % 256);
+    }
+  }
+
+  // With nothing live, runs are stitched across all stripes into one block.
+  std::fill(live_map.begin(), live_map.end(), 0);
+  alloc.coalesce(live_map.data(), num_threads);
+  assert(__builtin_popcountl(alloc.get_fl_bitmap()) == 1);
+  assert(alloc.allocate(pool_size / 2) != nullptr);
+}
+
+void incremental_coalescing_test() {
+  const size_t pool_size = 1024 * 1024;
+  uint8_t *pool = mmap_allocate(pool_size);
+  JSMallocZ alloc(pool, pool_size, false);
+
+  std::vector<uint64_t> live_map((alloc.num_granules() + 63) / 64);
+  uintptr_t pool_start = (uintptr_t)alloc.allocate(16);
+
+  std::vector<std::pair<uint8_t *, size_t>> live;
+  for(size_t i = 0; i < 2000; i++) {
+    size_t size = 16 + (i * 37) % 300;
+    uint8_t *ptr = static_cast<uint8_t *>(alloc.allocate(size));
+
+    if(i % 3 == 0) {
+      memset(ptr, 0xaa, size);
+      live.push_back({ptr, size});
+
+      size_t first = ((uintptr_t)ptr - pool_start) / 16;
+      size_t last = ((uintptr_t)ptr + size - 1 - pool_start) / 16;
+      for(size_t granule = first; granule <= last; granule++) {
+        live_map[granule / 64] |= 1UL << (granule % 64);
+      }
+    }
+  }
+
+  alloc.begin_coalesce(live_map.data());
+
+  // Another thread keeps allocating while the pool is swept.
+  std::atomic<bool> sweeping(true);
+  std::vector<std::pair<uint8_t *, size_t>> allocated;
+  std::thread mutator([&]() {
+    for(size_t i = 0; sweeping || i < 100; i++) {
+      size_t size = 16 + i % 200;
+      uint8_t *ptr = static_cast<uint8_t *>(alloc.allocate(size));
+      if(ptr != nullptr) {
+        memset(ptr, 0x55, size);
+        allocated.push_back({ptr, size});
+      }
+    }
+  });
+
+  size_t steps = 0;
+  while(alloc.coalesce_step(1024)) {
+    steps++;
+  }
+  sweeping = false;
+  mutator.join();
+
+  assert(steps > 1);
+  assert(!allocated.empty());
+
+  for(auto &block : live) {
+    for(size_t j = 0; j < block.second; j++) {
+      assert(block.first[j] == 0xaa);
+    }
+  }
+
+  for(auto &block : allocated) {
+    for(size_t j = 0; j < block.second; j++) {
+      assert(block.first[j] == 0x55);
+    }
+  }
+}
+
+void free_batch_test() {
+  const size_t pool_size = 16 * 1024 * 1024;
+  uint8_t *pool = mmap_allocate(pool_size);
+  JSMallocZ alloc(pool, pool_size, false);
+
+  // Threads allocate and verify their blocks, and return them in batches.
+  std::vector<std::thread> threads;
+  for(int t = 0; t < 4; t++) {
+    threads.emplace_back([&alloc, t]() {
+      std::vector<JSMallocRange> ranges;
+      for(int round = 0; round < 5; round++) {
+        for(size_t i = 0; i < 500; i++) {
+          size_t size = 16 + ((i * 48) % 2000);
+          void *ptr = alloc.allocate(size);
+          assert(ptr != nullptr);
+          memset(ptr, t, size);
+          ranges.push_back({ptr, size});
+        }
+
+        for(JSMallocRange &range : ranges) {
+          uint8_t *bytes = static_cast<uint8_t *>(range.start);
+          assert(bytes[0] == t && bytes[range.size - 1] == t);
+        }
+
+        alloc.free_batch(ranges.data(), ranges.size());
+        ranges.clear();
+      }
+    });
+  }
+
+  for(std::thread &thread : threads) {
+    thread.join();
+  }
+
+  // Once the pool is exhausted, only the freed ranges can be allocated.
+  std::vector<JSMallocRange> ranges;
+  void *ptr;
+  while((ptr = alloc.allocate(1024)) != nullptr) {
+    ranges.push_back({ptr, 1024});
+  }
+
+  alloc.free_batch(ranges.data(), ranges.size());
+  for(size_t i = 0; i < ranges.size(); i++) {
+    assert(alloc.allocate(700) != nullptr);
+  }
+}
+
+void large_list_test() {
+  const size_t pool_size = 4 * 1024 * 1024;
+  uint8_t *pool = mmap_allocate(pool_size);
+  JSMallocZ *alloc = JSMallocZ::create(pool, pool_size, false, false);
+
+  void *large = alloc->allocate(1024 * 1024);
+  void *small = alloc->allocate(300 * 1024);
+  assert(large != nullptr && small != nullptr);
+
+  // Leave nothing but the two blocks in the list above the size classes, with
+  // the one that is too small at its head.
+  while(alloc->allocate(256 * 1024) != nullptr) {
+  }
+  alloc->free(large, 1024 * 1024);
+  alloc->free(small, 300 * 1024);
+
+  assert(alloc->allocate(2 * 1024 * 1024) == nullptr);
+  assert(alloc->allocate(512 * 1024) == large);
+
+  // The block that was set aside is still in the list.
+  assert(alloc->allocate(300 * 1024) != nullptr);
+  assert(alloc->allocate(300 * 1024) == small);
+}
+
+void allocate_batch_test() {
+  const size_t pool_size = 1024 * 1024;
+  uint8_t *pool = mmap_allocate(pool_size);
+  JSMallocZ *alloc = JSMallocZ::create(pool, pool_size, false, true);
+
+  // The blocks are carved back to back from one free block.
+  void *ptrs[100];
+  assert(alloc->allocate_batch(48, 100, ptrs) == 100);
+  for(size_t i = 0; i < 100; i++) {
+    assert(alloc->get_allocated_size(ptrs[i]) == 48);
+    if(i > 0) {
+      assert((uintptr_t)ptrs[i] == (uintptr_t)ptrs[i - 1] + 48);
+    }
+  }
+
+  // Batches shrink to what fits.
+  void *large[8];
+  size_t count = alloc->allocate_batch(256 * 1024, 8, large);
+  assert(count > 0 && count < 8);
+
+  for(size_t i = 0; i < 100; i++) {
+    alloc->free(ptrs[i]);
+  }
+  for(size_t i = 0; i < count; i++) {
+    alloc->free(large[i]);
+  }
+}
+
+void allocation_buffer_test() {
+  const size_t pool_size = 1024 * 1024;
+  uint8_t *pool = mmap_allocate(pool_size);
+  JSMallocZ *alloc = JSMallocZ::create(pool, pool_size, false, true);
+  static thread_local JSMallocAllocationBuffer buffer;
+
+  // Small objects are bumped out of the buffer.
+  uintptr_t prev = (uintptr_t)buffer.allocate(alloc, 24);
+  for(size_t i = 0; i < 100; i++) {
+    uintptr_t ptr = (uintptr_t)buffer.allocate(alloc, 24);
+    assert(ptr == prev + 32);
+    assert(alloc->get_allocated_size((void *)ptr) == 32);
+    prev = ptr;
+  }
+
+  // Large objects bypass it.
+  void *large = buffer.allocate(alloc, 2 * JSMallocAllocationBuffer::MaxBumpSize);
+  assert(large != nullptr && buffer.remaining() > 0);
+
+  // Objects can be freed on their own, and the tail is handed back.
+  alloc->free((void *)prev);
+  assert(alloc->get_allocated_size((void *)prev) == 0);
+  buffer.retire(alloc);
+  assert(buffer.remaining() == 0);
+
+  // Every object carved from the buffer counts as one allocation, and the
+  // buffer itself is not counted.
+  JSMallocStats stats;
+  alloc->stats(stats);
+  assert(stats.total.allocs == 102 && stats.total.frees == 1);
+  assert(stats.total.live_bytes == 100 * 32 + alloc->get_allocated_size(large));
+
+  // Refills keep working until the pool runs out.
+  size_t count = 0;
+  while(buffer.allocate(alloc, 200) != nullptr) {
+    count++;
+  }
+  assert(count > pool_size / 2 / 208);
+}
+
+void slab_test() {
+  const size_t pool_size = 128 * 1024 * 1024;
+  uint8_t *pool = mmap_allocate(pool_size);
+  JSMalloc *alloc = JSMalloc::create(pool, pool_size);
+  JSMallocSlabs *slabs = JSMallocSlabs::create(alloc, 48);
+  assert(slabs != nullptr && slabs->cutoff() == 48);
+  assert(slabs->allocate(49) == nullptr);
+
+  std::vector<uint8_t *> ptrs;
+  for(size_t i = 0; i < 20000; i++) {
+    size_t size = i % 49;
+    uint8_t *ptr = static_cast<uint8_t *>(slabs->allocate(size));
+    assert(ptr != nullptr && slabs->contains(ptr));
+    assert(slabs->get_allocated_size(ptr) >= size);
+    memset(ptr, i % 251, size);
+    ptrs.push_back(ptr);
+  }
+  assert(slabs->num_slabs() > 6);
+
+  for(size_t i = 0; i < ptrs.size(); i++) {
+    for(size_t j = 0; j < i % 49; j++) {
+      assert(ptrs[i][j] == i % 251);
+    }
+  }
+
+  // Regular blocks of the same allocator are not slab objects.
+  void *block = alloc->allocate(32);
+  assert(!slabs->contains(block) && !slabs->free(block));
+  alloc->free(block);
+
+  for(uint8_t *ptr : ptrs) {
+    assert(slabs->free(ptr));
+  }
+
+  // Only one empty slab per size class is kept.
+  assert(slabs->num_slabs() <= JSMallocSlabs::NumClasses);
+
+  // Slabs that are added and released over and over leave tombstones in the
+  // registry, which are dropped without losing the slabs that are still live.
+  // A regular block is kept from every round, so that slabs keep moving.
+  std::vector<void *> live, blocks;
+  for(size_t i = 0; i < 2000; i++) {
+    live.push_back(slabs->allocate(16));
+  }
+  for(size_t round = 0; round < JSMallocSlabs::RegistryCapacity / 4; round++) {
+    std::vector<void *> churn;
+    for(size_t i = 0; i < 500; i++) {
+      churn.push_back(slabs->allocate(48));
+    }
+    for(void *ptr : churn) {
+      assert(slabs->free(ptr));
+    }
+    blocks.push_back(alloc->allocate(JSMallocSlabs::SlabSize));
+  }
+  for(void *ptr : live) {
+    assert(slabs->contains(ptr) && slabs->free(ptr));
+  }
+  for(void *ptr : blocks) {
+    assert(ptr != nullptr && !slabs->contains(ptr));
+    alloc->free(ptr);
+  }
+}
+
+void slab_alignment_test() {
+  const size_t pool_size = 16 * 1024 * 1024;
+  uint8_t *pool = mmap_allocate(pool_size);
+  JSMalloc *alloc = JSMalloc::create(pool, pool_size);
+  JSMallocSlabs *slabs = JSMallocSlabs::create(alloc, JSMallocSlabs::MaxCutoff);
+
+  // Enough objects of every size class to fill more than one slab.
+  for(size_t size = 0; size <= JSMallocSlabs::MaxCutoff; size++) {
+    for(size_t i = 0; i < 1100; i++) {
+      void *ptr = slabs->allocate(size);
+      assert(ptr != nullptr && (uintptr_t)ptr % alignof(max_align_t) == 0);
+    }
+  }
+}
+
+// Checks the system allocator unless the test runs with
+// LD_PRELOAD=./libjsmalloc.so, in which case it checks the wrapper.
+void malloc_alignment_test() {
+  std::vector<void *> ptrs;
+  for(size_t size = 1; size <= 256; size++) {
+    void *ptr = malloc(size);
+    assert(ptr != nullptr && (uintptr_t)ptr % alignof(max_align_t) == 0);
+    ptrs.push_back(ptr);
+
+    assert(posix_memalign(&ptr, 16, size) == 0 && (uintptr_t)ptr % 16 == 0);
+    ptrs.push_back(ptr);
+
+    ptr = aligned_alloc(16, JSMallocUtil::align_up(size, 16));
+    assert(ptr != nullptr && (uintptr_t)ptr % 16 == 0);
+    ptrs.push_back(ptr);
+  }
+
+  for(void *ptr : ptrs) {
+    free(ptr);
+  }
+}
+
+void stats_test() {
+  const size_t pool_size = 1024 * 1024;
+  uint8_t *pool = mmap_allocate(pool_size);
+  JSMalloc *alloc = JSMalloc::create(pool, pool_size);
+
+  JSMallocStats stats;
+  alloc->stats(stats);
+  assert(stats.total.allocs == 0 && stats.total.live_bytes == 0);
+  size_t initial_free = stats.total.free_bytes;
+  assert(initial_free > 0 && initial_free <= stats.pool_bytes);
+
+  void *ptrs[100];
+  for(size_t i = 0; i < 100; i++) {
+    ptrs[i] = alloc->allocate(100);
+  }
+
+  alloc->stats(stats);
+  assert(stats.total.allocs == 100 && stats.total.splits == 100);
+  assert(stats.total.requested_bytes == 100 * 100);
+  assert(stats.total.live_bytes == stats.total.allocated_bytes && stats.total.live_bytes >= 100 * 100);
+  assert(stats.total.free_bytes + stats.total.live_bytes + 100 * BLOCK_HEADER_LENGTH == initial_free);
+  assert(alloc->internal_fragmentation() > 0 && alloc->internal_fragmentation() < 0.1);
+
+  // Allocations are counted in the class of the block.
+  size_t class_index = 0;
+  while(class_index + 1 < stats.num_classes && stats.classes[class_index + 1].min_size <= 104) {
+    class_index++;
+  }
+  assert(stats.classes[class_index].allocs == 100);
+
+  for(size_t i = 0; i < 100; i += 2) {
+    alloc->free(ptrs[i]);
+  }
+  for(size_t i = 1; i < 100; i += 2) {
+    alloc->free(ptrs[i]);
+  }
+
+  // Everything is coalesced back into a single block.
+  alloc->stats(stats);
+  assert(stats.total.frees == 100 && stats.total.coalesces >= 99);
+  assert(stats.total.live_bytes == 0 && stats.total.free_bytes == initial_free);
+
+  // Frees that are only passed a size, and batched frees, are counted too.
+  JSMallocZ zalloc(mmap_allocate(pool_size), pool_size, false);
+  JSMallocRange ranges[10];
+  for(size_t i = 0; i < 10; i++) {
+    ranges[i] = {zalloc.allocate(64), 64};
+  }
+  zalloc.free(zalloc.allocate(32), 32);
+  zalloc.free_batch(ranges, 10);
+
+  zalloc.stats(stats);
+  assert(stats.total.allocs == 11 && stats.total.frees == 11);
+  assert(stats.total.live_bytes == 0);
+
+  // Snapshots of several allocators with the same classes can be summed.
+  JSMallocStats sum = {};
+  sum.add(stats);
+  sum.add(stats);
+  assert(sum.total.allocs == 22 && sum.pool_bytes == 2 * stats.pool_bytes);
+
+  // Every thread counts into a block of its own, and blocks that are
+  // coalesced into another class do not make any class wrap around.
+  const size_t num_threads = 8;
+  const size_t num_rounds = 20000;
+  JSMalloc *shared = JSMalloc::create(mmap_allocate(16 * pool_size), 16 * pool_size);
+  std::vector<std::thread> threads;
+  for(size_t t = 0; t < num_threads; t++) {
+    threads.emplace_back([shared]() {
+      for(size_t i = 0; i < num_rounds; i++) {
+        void *small = shared->allocate(16 + i % 200);
+        void *large = shared->allocate(4096 + i % 4096);
+        shared->free(small);
+        shared->free(large);
+      }
+    });
+  }
+  for(std::thread &thread : threads) {
+    thread.join();
+  }
+
+  shared->stats(stats);
+  assert(stats.total.allocs == 2 * num_threads * num_rounds);
+  assert(stats.total.frees == 2 * num_threads * num_rounds);
+  assert(stats.total.live_bytes == 0);
+  for(size_t i = 0; i < stats.num_classes; i++) {
+    assert(stats.classes[i].live_bytes <= stats.classes[i].allocated_bytes);
+  }
+
+  // The blocks of exited threads are reused without losing their counts, and
+  // objects can be freed by another thread than the one that allocated them.
+  void *leftover = nullptr;
+  for(size_t t = 0; t < 4 * num_threads; t++) {
+    std::thread([shared, &leftover]() {
+      shared->free(leftover);
+      leftover = shared->allocate(64);
+    }).join();
+  }
+  shared->free(leftover);
+
+  shared->stats(stats);
+  assert(stats.total.allocs == 2 * num_threads * num_rounds + 4 * num_threads);
+  assert(stats.total.frees == stats.total.allocs);
+  assert(stats.total.live_bytes == 0);
+}
+
+void fragmentation_test() {
+  const size_t pool_size = 1024 * 1024;
+  uint8_t *pool = mmap_allocate(pool_size);
+  JSMalloc alloc(pool, pool_size);
+
+  JSMallocFragmentation fragmentation;
+  alloc.fragmentation(fragmentation);
+  assert(fragmentation.free_bytes == fragmentation.largest_free_block);
+  assert(fragmentation.index() == 0);
+
+  // Use up the whole pool, and free every other block.
+  std::vector<void *> ptrs;
+  void *ptr;
+  while((ptr = alloc.allocate(1000)) != nullptr) {
+    ptrs.push_back(ptr);
+  }
+
+  alloc.fragmentation(fragmentation);
+  assert(fragmentation.free_bytes < 1024 && fragmentation.largest_free_block == fragmentation.free_bytes);
+
+  for(size_t i = 0; i < ptrs.size(); i += 2) {
+    alloc.free(ptrs[i]);
+  }
+
+  // Every free block is a single 1000-byte block, in the class of 512 bytes.
+  alloc.fragmentation(fragmentation);
+  size_t num_freed = (ptrs.size() + 1) / 2;
+  assert(fragmentation.largest_free_block == alloc.get_allocated_size(ptrs[1]));
+  assert(fragmentation.free_bytes >= num_freed * fragmentation.largest_free_block);
+  assert(fragmentation.index() > 0.99);
+
+  size_t class_bytes = 0;
+  for(size_t i = 0; i < fragmentation.num_classes; i++) {
+    if(fragmentation.class_min_size[i] == 512) {
+      class_bytes = fragmentation.class_free_bytes[i];
+    }
+  }
+  assert(class_bytes == num_freed * fragmentation.largest_free_block);
+
+  // Lock-free free-lists only report the smallest size of the largest list.
+  JSMallocZ zalloc(mmap_allocate(pool_size), pool_size, false);
+  void *zptrs[3];
+  for(size_t i = 0; i < 3; i++) {
+    zptrs[i] = zalloc.allocate(1000);
+  }
+  zalloc.free(zptrs[1], 1000);
+
+  zalloc.fragmentation(fragmentation);
+  assert(fragmentation.largest_free_block > 0 && fragmentation.largest_free_block <= pool_size);
+  assert(fragmentation.free_bytes > pool_size - 3 * 1024 - sizeof(JSMallocZ));
+  assert(fragmentation.index() > 0 && fragmentation.index() < 1);
+}
+
+// Only instantiated here, from the definitions in JSMalloc.inline.hpp.
+class CustomConfig {
+public:
+  static const size_t FirstLevelIndex = 24;
+  static const size_t SecondLevelIndexLog2 = 4;
+  static const size_t MBS = 32;
+  static const bool UseSecondLevels = true;
+  static const bool DeferredCoalescing = false;
+  static const bool ExactFitProbe = false;
+  static const bool CollectStats = false;
+  static const size_t BlockHeaderLength = BLOCK_HEADER_LENGTH;
+};
+
+void custom_config_test() {
+  const size_t pool_size = 1024 * 1024;
+  uint8_t *pool = mmap_allocate(pool_size);
+  JSMallocT<CustomConfig> *alloc = JSMallocT<CustomConfig>::create(pool, pool_size);
+
+  std::vector<uint8_t *> ptrs;
+  for(size_t i = 0; i < 1000; i++) {
+    uint8_t *ptr = static_cast<uint8_t *>(alloc->allocate(i % 300 + 1));
+    assert(ptr != nullptr && (uintptr_t)ptr % 16 == 0);
+    memset(ptr, i % 251, i % 300 + 1);
+    ptrs.push_back(ptr);
+  }
+
+  for(size_t i = 0; i < ptrs.size(); i += 2) {
+    ptrs[i] = static_cast<uint8_t *>(alloc->reallocate(ptrs[i], 600));
+    assert(ptrs[i] != nullptr && ptrs[i][0] == i % 251);
+  }
+
+  for(uint8_t *ptr : ptrs) {
+    alloc->free(ptr);
+  }
+
+  // Everything is coalesced back into a single block.
+  assert(__builtin_popcountl(alloc->get_fl_bitmap()) == 1);
+  assert(alloc->allocate(pool_size / 2) != nullptr);
+}
+
+void trace_writer_test() {
+  const char *filename = "/tmp/jsmalloc_trace_test.bin";
+  // Writers live as long as the threads that record to them.
+  static JSMallocTraceWriter writer;
+  assert(!writer.is_open());
+  assert(writer.open(filename) && writer.is_open());
+
+  // Enough records to fill several buffers on each thread.
+  const size_t num_records = 10000;
+  auto record = [](uint64_t base) {
+    for(size_t i = 0; i < num_records; i++) {
+      writer.record(JSMallocTraceRecord::Allocate, reinterpret_cast<void *>(base + i), i);
+      writer.record(JSMallocTraceRecord::Free, reinterpret_cast<void *>(base + i), 0);
+    }
+  };
+
+  std::thread thread(record, 1 << 20);
+  record(2 << 20);
+  thread.join();
+  writer.flush();
+
+  FILE *file = fopen(filename, "rb");
+  assert(file != nullptr);
+
+  JSMallocTraceHeader header;
+  assert(fread(&header, sizeof(header), 1, file) == 1);
+  assert(memcmp(header.magic, JSMallocTraceHeader::Magic, sizeof(header.magic)) == 0);
+  assert(header.version == JSMallocTraceHeader::Version && header.record_size == sizeof(JSMallocTraceRecord));
+
+  // Records of each thread are in order, and every thread starts at a
+  // timestamp.
+  std::map<uint16_t, size_t> counts;
+  std::map<uint16_t, uint64_t> bases;
+  JSMallocTraceRecord rec;
+  while(fread(&rec, sizeof(rec), 1, file) == 1) {
+    if(rec.op == JSMallocTraceRecord::Timestamp) {
+      continue;
+    }
+    assert(rec.op == JSMallocTraceRecord::Allocate || rec.op == JSMallocTraceRecord::Free);
+
+    size_t index = counts[rec.thread]++;
+    if(index == 0) {
+      bases[rec.thread] = rec.address;
+    }
+    assert(rec.address == bases[rec.thread] + index / 2);
+    assert(rec.op == (index % 2 == 0 ? JSMallocTraceRecord::Allocate : JSMallocTraceRecord::Free));
+    assert(rec.size == (index % 2 == 0 ? index / 2 : 0));
+  }
+  fclose(file);
+  unlink(filename);
+
+  assert(counts.size() == 2);
+  for(auto &count : counts) {
+    assert(count.second == 2 * num_records);
+  }
+}
+
 int main() {
   //basic_test();
   //constructor_test();
@@ -287,4 +1307,29 @@ int main() {
   //zero_test();
   //rdtsc_test();
   aggregate_test();
+  thread_cache_test();
+  arena_test();
+  concurrent_coalescing_test();
+  growable_pool_test();
+  purge_test();
+  reallocate_test();
+  large_objects_test();
+  allocate_aligned_test();
+  side_table_test();
+  bitmap_coalescing_test(1);
+  bitmap_coalescing_test(4);
+  incremental_coalescing_test();
+  free_batch_test();
+  large_list_test();
+  allocate_batch_test();
+  allocation_buffer_test();
+  slab_test();
+  slab_alignment_test();
+  malloc_alignment_test();
+  custom_config_test();
+  compact_header_test();
+  exact_fit_test();
+  trace_writer_test();
+  stats_test();
+  fragmentation_test();
 }